@@ -9,6 +9,7 @@
 #include <opengl/mygl_glfw.hpp>
 #include <glm/gtx/string_cast.hpp>
 #include <processing/gl_func.hpp>
+#include <processing/gl_state.hpp>
 
 namespace mpp
 {
@@ -47,7 +48,7 @@ void main()
         glfwWindowHint(GLFW_SAMPLES, 4);
     }
     void cameras_impl::on_start(program_state& state) {
-        glClearColor(0.5f, 0.5f, 0.5f, 1.f);
+        gl_state::current().set_clear_color(glm::vec4(0.5f, 0.5f, 0.5f, 1.f));
         _photogrammetry.run();
         _camera.set_axis_smoothing(0.7f);
         _camera.set_rotate_smoothing(0.7f);
@@ -95,17 +96,16 @@ void main()
         _last_curpos = { cposx, cposy };
         _camera.update(delta_millis);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        glEnable(GL_DEPTH_TEST);
+        gl_state::current().set_enabled(GL_DEPTH_TEST, true);
         
-        int viewport[4];
-        glGetIntegerv(GL_VIEWPORT, viewport);
+        const glm::ivec4 viewport = gl_state::current().viewport();
 
         const glm::mat4 view_proj =
             glm::perspectiveFov(glm::radians(60.f), float(viewport[2]), float(viewport[3]), 0.01f, 100.f) *
             _camera.view_matrix();
 
-        glUseProgram(_cube.program);
-        glBindVertexArray(_cube.vao);
+        gl_state::current().use_program(_cube.program);
+        gl_state::current().bind_vertex_array(_cube.vao);
         for (const auto& i : _hierarchy)
         {
             glUniformMatrix4fv(_cube.mvp_location, 1, false, glm::value_ptr(view_proj * i.transformation));
@@ -114,12 +114,18 @@ void main()
 
         if (ImGui::Begin("Settings"))
         {
+            ImGui::Combo("Backend", reinterpret_cast<int*>(&_photogrammetry.base_processor().detection_settings().backend), "OpenGL\0CPU\0");
+            ImGui::Combo("Precision", reinterpret_cast<int*>(&_photogrammetry.base_processor().detection_settings().precision), "32 Bit\0""16 Bit\0");
             ImGui::Text("Sizes");
             ImGui::DragInt("Scales", reinterpret_cast<int*>(&_photogrammetry.base_processor().detection_settings().feature_scales), 0.01f, 0, 10);
             ImGui::DragInt("Octaves", reinterpret_cast<int*>(&_photogrammetry.base_processor().detection_settings().octaves), 0.01f, 0, 10);
             ImGui::Text("Orientation");
             ImGui::DragFloat("Magnitude Thresh.", &_photogrammetry.base_processor().detection_settings().orientation_magnitude_threshold, 0.000002f, 0.f, 1.f);
             ImGui::DragInt("Slices", &_photogrammetry.base_processor().detection_settings().orientation_slices, 0.01f, 0, 360);
+            ImGui::Text("Selection");
+            ImGui::DragInt("Max. Features", reinterpret_cast<int*>(&_photogrammetry.base_processor().detection_settings().max_features), 1.f, 0, 1 << 16);
+            ImGui::DragInt("Grid", &_photogrammetry.base_processor().detection_settings().selection_grid, 0.01f, 1, 32);
+            ImGui::DragInt("Tile Size", &_photogrammetry.base_processor().detection_settings().tile_size, 1.f, 0, 1 << 14);
             if (ImGui::Button("Open Images", ImVec2(ImGui::GetContentRegionAvailWidth(), 0)))
             {
                 auto ps = open_files("Open Images");
@@ -10,48 +10,18 @@
 #include <glm/gtx/string_cast.hpp>
 #include <processing/epipolar.hpp>
 #include <random>
+#include <cmath>
+#include <limits>
+#include <algorithm>
 #include <processing/photogrammetry.hpp>
 #include <opengl/mygl_glfw.hpp>
+#include <processing/gl_func.hpp>
+#include <processing/gl_state.hpp>
 
 namespace mpp
 {
     namespace
     {
-        std::uint32_t create_shader(GLenum type, const char* src)
-        {
-            std::uint32_t sh = glCreateShader(type);
-            glShaderSource(sh, 1, &src, nullptr);
-            glCompileShader(sh);
-            int log_len;
-            glGetShaderiv(sh, GL_INFO_LOG_LENGTH, &log_len);
-            if (log_len > 3)
-            {
-                std::string info_log(log_len, '\0');
-                glGetShaderInfoLog(sh, log_len, &log_len, info_log.data());
-                spdlog::info("Shader Compilation Output:\n{}", info_log);
-            }
-            return sh;
-        }
-
-        std::uint32_t create_program(std::uint32_t frag, std::uint32_t vert)
-        {
-            std::uint32_t program = glCreateProgram();
-            glAttachShader(program, vert);
-            glAttachShader(program, frag);
-            glLinkProgram(program);
-            int log_len;
-            glGetProgramiv(program, GL_INFO_LOG_LENGTH, &log_len);
-            if (log_len > 3)
-            {
-                std::string info_log(log_len, '\0');
-                glGetProgramInfoLog(program, log_len, &log_len, info_log.data());
-                spdlog::info("Shader Compilation Output:\n{}", info_log);
-            }
-            glDetachShader(program, vert);
-            glDetachShader(program, frag);
-            return program;
-        }
-
         constexpr auto screen_vert_src = R"(#version 330 core
 out vec2 vs_uv;
 void main()
@@ -85,6 +55,22 @@ void main()
     color = u_color;
 }
 )";
+
+        sift::detection_settings demo_settings()
+        {
+            sift::detection_settings settings;
+            settings.octaves = 4;
+            settings.feature_scales = 3;
+            settings.orientation_magnitude_threshold = 0.0002f;
+            return settings;
+        }
+
+        image demo_image(const image& img)
+        {
+            constexpr auto max_width = 400;
+            const float aspect = float(img.dimensions().x) / img.dimensions().y;
+            return image(img).resize(max_width, int(aspect * max_width));
+        }
     }
     gl43_impl::gl43_impl()
     {
@@ -98,7 +84,7 @@ void main()
 
         for (auto id : tex)
         {
-            glBindTexture(GL_TEXTURE_2D, id);
+            gl_state::current().bind_texture(0, id);
             glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
             glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
             glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
@@ -122,24 +108,24 @@ void main()
 
     void gl43_impl::on_start(program_state& state)
     {
-        glEnable(GL_MULTISAMPLE);
+        gl_state::current().set_enabled(GL_MULTISAMPLE, true);
         const auto screen_vert = create_shader(GL_VERTEX_SHADER, screen_vert_src);
         const auto texture_frag = create_shader(GL_FRAGMENT_SHADER, texture_frag_scr);
-        full_screen.program = create_program(texture_frag, screen_vert);
+        full_screen.program = create_program({ texture_frag, screen_vert });
         glDeleteShader(screen_vert);
         glDeleteShader(texture_frag);
         full_screen.in_texture_location = glGetUniformLocation(full_screen.program, "in_texture");
 
         const auto points_vert = create_shader(GL_VERTEX_SHADER, points_vert_src);
         const auto simple_color_frag = create_shader(GL_FRAGMENT_SHADER, simple_color_frag_src);
-        points.program = create_program(simple_color_frag, points_vert);
+        points.program = create_program({ simple_color_frag, points_vert });
         points.u_color_location = glGetUniformLocation(points.program, "u_color");
         glDeleteShader(points_vert);
         glDeleteShader(simple_color_frag);
 
         glGenVertexArrays(1, &empty_vao);
         glGenVertexArrays(1, &points.vao);
-        glBindVertexArray(points.vao);
+        gl_state::current().bind_vertex_array(points.vao);
         glGenBuffers(1, &points.vbo);
         glGenBuffers(1, &points.ori_vbo);
         glEnableVertexAttribArray(0);
@@ -163,7 +149,7 @@ void main()
         settings.similarity_threshold = 0.8f;
         settings.max_match_count = 5000;
         auto matches12 = sift::match_features(features[0], features[1], settings);
-        auto pts = sift::corresponding_points(matches12);
+        auto pts = sift::corresponding_points(matches12, features[0], features[1]);
         glm::mat3 best_mat = ransac_fundamental(pts);
         spdlog::info("Fundamental matrix: {}", glm::to_string(best_mat));
        /* for (int i = 0; i < pts.size(); ++i)
@@ -179,8 +165,9 @@ void main()
 
         for (int i = 0; i < matches12.size(); ++i)
         {
-            auto& m = matches12[i];
-            ref.emplace_back(glm::vec2(((m.a.x + 1) / 2.f) - 1, m.a.y), glm::vec2(((m.b.x + 1) / 2.f), m.b.y));
+            const auto a = features[0].positions()[matches12[i].a];
+            const auto b = features[1].positions()[matches12[i].b];
+            ref.emplace_back(glm::vec2(((a.x + 1) / 2.f) - 1, a.y), glm::vec2(((b.x + 1) / 2.f), b.y));
         }
     }
     void gl43_impl::on_update(program_state& state, seconds delta)
@@ -190,22 +177,21 @@ void main()
         int fx, fy;
         glfwGetFramebufferSize(glfwGetCurrentContext(), &fx, &fy);
 
-        glDisable(GL_DEPTH_TEST);
-        glBindVertexArray(empty_vao);
-        glUseProgram(full_screen.program);
-        glActiveTexture(GL_TEXTURE0);
+        gl_state::current().set_enabled(GL_DEPTH_TEST, false);
+        gl_state::current().bind_vertex_array(empty_vao);
+        gl_state::current().use_program(full_screen.program);
         glUniform1i(full_screen.in_texture_location, 0);
-        glViewport(0, 0, fx / 2, fy);
-        glBindTexture(GL_TEXTURE_2D, textures[0]);
+        gl_state::current().set_viewport(glm::ivec4(0, 0, fx / 2, fy));
+        gl_state::current().bind_texture(0, textures[0]);
         glDrawArrays(GL_TRIANGLES, 0, 3);
 
-        glBindVertexArray(points.vao);
-        glUseProgram(points.program);
+        gl_state::current().bind_vertex_array(points.vao);
+        gl_state::current().use_program(points.program);
         glUniform4f(points.u_color_location, 1.f, 0.4f, 0.1f, 1.f);
         glBindBuffer(GL_ARRAY_BUFFER, points.vbo);
-        glVertexAttribPointer(0, 2, GL_FLOAT, false, sizeof(sift::feature), nullptr);
+        glVertexAttribPointer(0, 2, GL_FLOAT, false, sizeof(glm::vec2), nullptr);
         glPointSize(point_size);
-        glBufferData(GL_ARRAY_BUFFER, features[0].size() * sizeof(sift::feature), features[0].data(), GL_DYNAMIC_DRAW);
+        glBufferData(GL_ARRAY_BUFFER, features[0].size() * sizeof(glm::vec2), features[0].positions(), GL_DYNAMIC_DRAW);
         glDrawArrays(GL_POINTS, 0, int(features[0].size()));
         glBindBuffer(GL_ARRAY_BUFFER, points.ori_vbo);
         glLineWidth(1.f);
@@ -213,32 +199,31 @@ void main()
         glBufferData(GL_ARRAY_BUFFER, orientation_dbg[0].size() * sizeof(glm::vec2), orientation_dbg[0].data(), GL_DYNAMIC_DRAW);
         glDrawArrays(GL_LINES, 0, int(orientation_dbg[0].size()));
 
-        glDisable(GL_DEPTH_TEST);
-        glBindVertexArray(empty_vao);
-        glUseProgram(full_screen.program);
-        glActiveTexture(GL_TEXTURE0);
+        gl_state::current().set_enabled(GL_DEPTH_TEST, false);
+        gl_state::current().bind_vertex_array(empty_vao);
+        gl_state::current().use_program(full_screen.program);
         glUniform1i(full_screen.in_texture_location, 0);
-        glViewport(fx / 2, 0, fx / 2, fy);
-        glBindTexture(GL_TEXTURE_2D, textures[1]);
+        gl_state::current().set_viewport(glm::ivec4(fx / 2, 0, fx / 2, fy));
+        gl_state::current().bind_texture(0, textures[1]);
         glDrawArrays(GL_TRIANGLES, 0, 3);
 
-        glBindVertexArray(points.vao);
-        glUseProgram(points.program);
+        gl_state::current().bind_vertex_array(points.vao);
+        gl_state::current().use_program(points.program);
         glUniform4f(points.u_color_location, 1.f, 0.4f, 0.1f, 1.f);
         glBindBuffer(GL_ARRAY_BUFFER, points.vbo);
-        glVertexAttribPointer(0, 2, GL_FLOAT, false, sizeof(sift::feature), nullptr);
+        glVertexAttribPointer(0, 2, GL_FLOAT, false, sizeof(glm::vec2), nullptr);
         glPointSize(point_size);
-        glBufferData(GL_ARRAY_BUFFER, features[1].size() * sizeof(sift::feature), features[1].data(), GL_DYNAMIC_DRAW);
+        glBufferData(GL_ARRAY_BUFFER, features[1].size() * sizeof(glm::vec2), features[1].positions(), GL_DYNAMIC_DRAW);
         glDrawArrays(GL_POINTS, 0, int(features[1].size()));
         glBindBuffer(GL_ARRAY_BUFFER, points.ori_vbo);
         glLineWidth(1.f);
         glVertexAttribPointer(0, 2, GL_FLOAT, false, sizeof(glm::vec2), nullptr);
         glBufferData(GL_ARRAY_BUFFER, orientation_dbg[1].size() * sizeof(glm::vec2), orientation_dbg[1].data(), GL_DYNAMIC_DRAW);
         glDrawArrays(GL_LINES, 0, int(orientation_dbg[1].size()));
-        glViewport(0, 0, fx, fy);
+        gl_state::current().set_viewport(glm::ivec4(0, 0, fx, fy));
 
-        glBindVertexArray(points.vao);
-        glUseProgram(points.program);
+        gl_state::current().bind_vertex_array(points.vao);
+        gl_state::current().use_program(points.program);
         glBindBuffer(GL_ARRAY_BUFFER, points.ori_vbo);
         glBufferData(GL_ARRAY_BUFFER, ref.size() * 2 * sizeof(glm::vec2), ref.data(), GL_DYNAMIC_DRAW);
 
@@ -262,18 +247,22 @@ void main()
             ImGui::DragInt("Matches", &num_matches, 0.01f, -1, int(ref.size()));
             ImGui::DragFloat("Point Size", &point_size, 0.01f, 1.f, 100.f);
             ImGui::Text("Cursor at %0.7f, %0.7f", (cx / fx) * 2.f - 1.f, (1 - cy / fy) * 2.f - 1.f);
+            if (_sift_cache && ImGui::Button("Compare Precisions", ImVec2(ImGui::GetWindowContentRegionWidth(), 0)))
+                compare_precisions();
+            if (!precision_report.empty())
+                ImGui::TextWrapped("%s", precision_report.c_str());
 
         }
         ImGui::End();
     }
     void gl43_impl::on_end(program_state& state)
     {
-        glDeleteVertexArrays(1, &empty_vao);
+        gl_state::current().delete_vertex_arrays(1, &empty_vao);
         glDeleteProgram(full_screen.program);
         glDeleteProgram(points.program);
-        glDeleteVertexArrays(1, &points.vao);
+        gl_state::current().delete_vertex_arrays(1, &points.vao);
         glDeleteBuffers(1, &points.vbo);
-        glDeleteTextures(int(textures.size()), textures.data());
+        gl_state::current().delete_textures(int(textures.size()), textures.data());
         if (_sift_cache)
             _sift_cache.reset();
     }
@@ -283,22 +272,61 @@ void main()
         img.load_stream(file, 1);
         auto& ori = orientation_dbg.emplace_back();
 
-        constexpr auto max_width = 400;
-        const float aspect = float(img.dimensions().x) / img.dimensions().y;
-        const auto w = max_width;
-        const auto h = int(aspect * max_width);
-        sift::detection_settings settings;
-        settings.octaves = 4;
-        settings.feature_scales = 3;
-        settings.orientation_magnitude_threshold = 0.0002f;
+        const auto settings = demo_settings();
         if (!_sift_cache)
             _sift_cache = sift::create_cache(settings.octaves, settings.feature_scales);
 
-        for (auto& feat : features.emplace_back(sift::detect_features(*_sift_cache, image(img).resize(w, h), settings, sift::dst_system::normalized_coordinates)))
+        const auto& detected = features.emplace_back(sift::detect_feature_set(*_sift_cache, demo_image(img), settings, sift::dst_system::normalized_coordinates));
+        for (size_t i = 0; i < detected.size(); ++i)
         {
-            ori.emplace_back(glm::vec2(feat.x, feat.y));
-            ori.emplace_back(glm::vec2(feat.x, feat.y) + 0.05f * glm::vec2(glm::cos(feat.orientation), glm::sin(feat.orientation)));
+            const auto position = detected.positions()[i];
+            const auto orientation = detected.orientations()[i];
+            ori.emplace_back(position);
+            ori.emplace_back(position + 0.05f * glm::vec2(glm::cos(orientation), glm::sin(orientation)));
         }
         textures.emplace_back(allocate_textures(GL_RED, true, img));
     }
+
+    void gl43_impl::compare_precisions()
+    {
+        // Detects the last image with 32 and 16 bit textures on the GPU, and pairs each feature of the full precision
+        // detection with the nearest one of the same octave in the half precision detection.
+        const auto scaled = demo_image(img);
+        auto settings = demo_settings();
+        settings.precision = sift::texture_precision::full;
+        const auto full = sift::detect_features(*_sift_cache, scaled, settings);
+        settings.precision = sift::texture_precision::half;
+        const auto half = sift::detect_features(*_sift_cache, scaled, settings);
+
+        constexpr float max_offset = 1.f; // pixels
+        size_t paired = 0;
+        double offset_sum = 0.0;
+        float offset_max = 0.f;
+        double orientation_sum = 0.0;
+        for (const auto& f : full)
+        {
+            float nearest = std::numeric_limits<float>::max();
+            const sift::feature* match = nullptr;
+            for (const auto& h : half)
+            {
+                const float offset = glm::distance(glm::vec2(f.x, f.y), glm::vec2(h.x, h.y));
+                if (h.octave == f.octave && offset < nearest)
+                {
+                    nearest = offset;
+                    match = &h;
+                }
+            }
+            if (!match || nearest > max_offset)
+                continue;
+            ++paired;
+            offset_sum += nearest;
+            offset_max = std::max(offset_max, nearest);
+            orientation_sum += std::abs(std::remainder(double(f.orientation) - match->orientation, 2.0 * 3.14159265358979));
+        }
+
+        precision_report = fmt::format("{} full and {} half precision features, {} within {} px. Offset mean {:.4f} px, max {:.4f} px, "
+            "orientation difference mean {:.4f} rad.", full.size(), half.size(), paired, max_offset,
+            paired ? offset_sum / paired : 0.0, offset_max, paired ? orientation_sum / paired : 0.0);
+        spdlog::info("SIFT precision comparison: {}", precision_report);
+    }
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include <visualization.hpp>
 #include <cstdint>
+#include <string>
 #include <processing/sift/sift.hpp>
 #include <processing/image.hpp>
 
@@ -18,6 +19,8 @@ namespace mpp
 
     private:
         void add_img(const char* path);
+        // Debug check of texture_precision::half against full on the GPU, see precision_report.
+        void compare_precisions();
         struct
         {
             std::uint32_t program;
@@ -37,11 +40,12 @@ namespace mpp
         std::uint32_t empty_vao;
         image img;
         std::vector<std::uint32_t> textures;
-        std::vector<std::vector<sift::feature>> features;
+        std::vector<sift::feature_set> features;
         std::vector<std::pair<glm::vec2, glm::vec2>> ref;
         std::vector<std::vector<glm::vec2>> orientation_dbg;
         float point_size = 4.f;
         int current_texture = 0;
         int num_matches = -1;
+        std::string precision_report;
     };
 }
\ No newline at end of file
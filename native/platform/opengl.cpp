@@ -4,6 +4,7 @@
 #include <iostream>
 #include <spdlog/spdlog.h>
 #include <opengl/mygl_glfw.hpp>
+#include <processing/gl_state.hpp>
 
 namespace mpp
 {
@@ -67,6 +68,8 @@ namespace mpp
     }
 
     void opengl_environment::on_begin_update(program_state& state, seconds delta) {
+        // ImGui renders with plain OpenGL calls, so the shadowed state is stale after each frame.
+        gl_state::current().invalidate();
         ImGui_ImplOpenGL3_NewFrame();
     }
 
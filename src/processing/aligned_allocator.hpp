@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+
+namespace mpp
+{
+    // Allocator for containers which are read with wide vector loads. Every allocation starts at a multiple of Alignment.
+    template<typename T, size_t Alignment>
+    class aligned_allocator
+    {
+    public:
+        static_assert(Alignment >= alignof(T) && (Alignment & (Alignment - 1)) == 0, "Alignment must be a power of two and at least alignof(T).");
+
+        using value_type = T;
+        template<typename U>
+        struct rebind
+        {
+            using other = aligned_allocator<U, Alignment>;
+        };
+
+        aligned_allocator() noexcept = default;
+        template<typename U>
+        aligned_allocator(const aligned_allocator<U, Alignment>&) noexcept {}
+
+        T* allocate(size_t n)
+        {
+            return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+        }
+        void deallocate(T* p, size_t) noexcept
+        {
+            ::operator delete(p, std::align_val_t(Alignment));
+        }
+
+        template<typename U>
+        bool operator==(const aligned_allocator<U, Alignment>&) const noexcept { return true; }
+        template<typename U>
+        bool operator!=(const aligned_allocator<U, Alignment>&) const noexcept { return false; }
+    };
+}
\ No newline at end of file
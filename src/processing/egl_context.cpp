@@ -0,0 +1,135 @@
+#include <processing/egl_context.hpp>
+
+#ifdef MPP_HAS_EGL_CONTEXT
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <spdlog/spdlog.h>
+#include <cstring>
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+#ifndef EGL_OPENGL_ES3_BIT
+#define EGL_OPENGL_ES3_BIT 0x00000040
+#endif
+
+namespace mpp
+{
+    namespace
+    {
+        bool has_extension(const char* extensions, const char* name)
+        {
+            return extensions && std::strstr(extensions, name) != nullptr;
+        }
+
+        EGLDisplay open_display()
+        {
+            const char* client_extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+            if (has_extension(client_extensions, "EGL_MESA_platform_surfaceless"))
+            {
+                const auto get_platform_display = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(eglGetProcAddress("eglGetPlatformDisplayEXT"));
+                if (get_platform_display)
+                {
+                    EGLDisplay display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+                    if (display != EGL_NO_DISPLAY && eglInitialize(display, nullptr, nullptr))
+                        return display;
+                }
+            }
+
+            EGLDisplay display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+            if (display != EGL_NO_DISPLAY && eglInitialize(display, nullptr, nullptr))
+                return display;
+            return EGL_NO_DISPLAY;
+        }
+    }
+
+    egl_context::~egl_context()
+    {
+        destroy();
+    }
+
+    bool egl_context::create()
+    {
+        destroy();
+        EGLDisplay display = open_display();
+        if (display == EGL_NO_DISPLAY)
+        {
+            spdlog::warn("EGL: no display available.");
+            return false;
+        }
+        _display = display;
+        eglBindAPI(EGL_OPENGL_ES_API);
+
+        const bool surfaceless = has_extension(eglQueryString(display, EGL_EXTENSIONS), "EGL_KHR_surfaceless_context");
+        const EGLint attrib_list[] = {
+            EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT,
+            EGL_SURFACE_TYPE, surfaceless ? 0 : EGL_PBUFFER_BIT,
+            EGL_NONE
+        };
+        EGLConfig config;
+        EGLint num_configs = 0;
+        if (!eglChooseConfig(display, attrib_list, &config, 1, &num_configs) || num_configs == 0)
+        {
+            spdlog::warn("EGL: no OpenGL ES 3 config available.");
+            destroy();
+            return false;
+        }
+
+        const EGLint context_attrib_list[] = {
+            EGL_CONTEXT_CLIENT_VERSION, 3,
+            EGL_NONE
+        };
+        _context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attrib_list);
+        if (_context == EGL_NO_CONTEXT)
+        {
+            spdlog::warn("EGL: context creation failed.");
+            _context = nullptr;
+            destroy();
+            return false;
+        }
+
+        if (!surfaceless)
+        {
+            const EGLint pbuffer_attrib_list[] = {
+                EGL_WIDTH, 1,
+                EGL_HEIGHT, 1,
+                EGL_NONE
+            };
+            _surface = eglCreatePbufferSurface(display, config, pbuffer_attrib_list);
+        }
+        const EGLSurface surface = _surface ? static_cast<EGLSurface>(_surface) : EGL_NO_SURFACE;
+        if (!eglMakeCurrent(display, surface, surface, static_cast<EGLContext>(_context)))
+        {
+            spdlog::warn("EGL: could not make the context current.");
+            destroy();
+            return false;
+        }
+        spdlog::info("EGL: created {} OpenGL ES context.", surfaceless ? "surfaceless" : "pbuffer");
+        return true;
+    }
+
+    void egl_context::destroy()
+    {
+        if (!_display)
+            return;
+        const EGLDisplay display = static_cast<EGLDisplay>(_display);
+        eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        if (_surface)
+            eglDestroySurface(display, static_cast<EGLSurface>(_surface));
+        if (_context)
+            eglDestroyContext(display, static_cast<EGLContext>(_context));
+#ifndef __ANDROID__
+        // On Android the default display is shared with the Java side.
+        eglTerminate(display);
+#endif
+        _display = nullptr;
+        _context = nullptr;
+        _surface = nullptr;
+    }
+
+    void* egl_context::get_proc_address(const char* name)
+    {
+        return reinterpret_cast<void*>(eglGetProcAddress(name));
+    }
+}
+#endif
@@ -0,0 +1,32 @@
+#pragma once
+
+#if defined(__ANDROID__) || defined(MPP_HEADLESS_EGL)
+#define MPP_HAS_EGL_CONTEXT
+
+namespace mpp
+{
+    // Offscreen OpenGL ES 3.2 context which needs neither a window nor a display server.
+    // Prefers the surfaceless Mesa platform (which also works with llvmpipe), falls back to the
+    // default display and uses a 1x1 pbuffer if the driver does not support surfaceless contexts.
+    class egl_context
+    {
+    public:
+        egl_context() = default;
+        ~egl_context();
+        egl_context(const egl_context&) = delete;
+        egl_context& operator=(const egl_context&) = delete;
+
+        // Creates the context and makes it current on the calling thread.
+        bool create();
+        void destroy();
+        bool valid() const noexcept { return _context != nullptr; }
+
+        static void* get_proc_address(const char* name);
+
+    private:
+        void* _display = nullptr;
+        void* _context = nullptr;
+        void* _surface = nullptr;
+    };
+}
+#endif
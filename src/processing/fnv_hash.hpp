@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+
+namespace mpp
+{
+    // 64-bit FNV-1a. Fast enough for cache keys, not meant to resist deliberate collisions.
+    constexpr std::uint64_t fnv1a_offset_basis = 0xcbf29ce484222325ull;
+
+    inline void fnv1a(std::uint64_t& hash, const void* data, size_t size)
+    {
+        const auto bytes = static_cast<const std::uint8_t*>(data);
+        for (size_t i = 0; i < size; ++i)
+            hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+
+    // FNV-1a over 8-byte words for large buffers such as pixels, with far fewer multiplications than byte by byte.
+    // The multiplication only carries upwards, so the high half is folded back after each word. Gives other values than fnv1a.
+    inline void fnv1a_wide(std::uint64_t& hash, const void* data, size_t size)
+    {
+        const auto bytes = static_cast<const std::uint8_t*>(data);
+        const size_t words = size / sizeof(std::uint64_t);
+        for (size_t i = 0; i < words; ++i)
+        {
+            std::uint64_t word;
+            std::memcpy(&word, bytes + i * sizeof(word), sizeof(word));
+            hash = (hash ^ word) * 0x100000001b3ull;
+            hash ^= hash >> 32;
+        }
+        fnv1a(hash, bytes + words * sizeof(std::uint64_t), size % sizeof(std::uint64_t));
+    }
+
+    inline void fnv1a(std::uint64_t& hash, const char* str)
+    {
+        if (str)
+            fnv1a(hash, str, std::strlen(str));
+    }
+
+    // Only for types without padding, as padding bytes are not part of the value.
+    template<typename T, typename = std::enable_if_t<std::is_arithmetic_v<T> || std::is_enum_v<T>>>
+    void fnv1a(std::uint64_t& hash, T value)
+    {
+        fnv1a(hash, &value, sizeof(value));
+    }
+}
\ No newline at end of file
@@ -1,18 +1,169 @@
 #include <processing/gl_clock.hpp>
 #include <opengl/mygl.hpp>
+#include <algorithm>
+#include <cstring>
+#include <string>
 
 namespace mpp
 {
+    namespace
+    {
+        // GL_EXT_disjoint_timer_query, loaded by load_timer_query_extension. Per thread like the current context, so a desktop
+        // OpenGL context on another thread keeps using the core functions.
+        thread_local decltype(::glQueryCounter)* query_counter_ext = nullptr;
+        thread_local decltype(::glGetQueryObjectui64v)* get_query_objectui64v_ext = nullptr;
+        // Not in the generated enums, as mygl is generated for desktop OpenGL.
+        constexpr auto gpu_disjoint_ext = GLenum(0x8FBB);
+
+        bool is_opengl_es()
+        {
+            const auto version = reinterpret_cast<const char*>(glGetString(GL_VERSION));
+            return version && std::string(version).find("OpenGL ES") != std::string::npos;
+        }
+
+        bool has_extension(const char* name)
+        {
+            int count = 0;
+            glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+            for (int i = 0; i < count; ++i)
+            {
+                const auto extension = reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, std::uint32_t(i)));
+                if (extension && std::strcmp(extension, name) == 0)
+                    return true;
+            }
+            return false;
+        }
+
+        // Resolved once per context creation on this thread, see load_timer_query_extension.
+        bool uses_timer_query_extension()
+        {
+            return query_counter_ext != nullptr && get_query_objectui64v_ext != nullptr;
+        }
+
+        void query_counter(std::uint32_t query)
+        {
+            if (uses_timer_query_extension())
+                query_counter_ext(query, GL_TIMESTAMP);
+            else
+                glQueryCounter(query, GL_TIMESTAMP);
+        }
+
+        std::uint64_t query_result(std::uint32_t query)
+        {
+            std::uint64_t time_stamp = 0;
+            if (uses_timer_query_extension())
+                get_query_objectui64v_ext(query, GL_QUERY_RESULT, &time_stamp);
+            else
+                glGetQueryObjectui64v(query, GL_QUERY_RESULT, &time_stamp);
+            return time_stamp;
+        }
+
+        // Reading the flag also clears it. On OpenGL ES, timestamps taken across a disjoint event (e.g. a change of
+        // the GPU clock or a context loss) cannot be compared with each other.
+        bool gpu_disjoint()
+        {
+            if (!uses_timer_query_extension())
+                return false;
+            int disjoint = 0;
+            glGetIntegerv(gpu_disjoint_ext, &disjoint);
+            return disjoint != 0;
+        }
+
+        bool supports_timestamp_queries()
+        {
+            // GL_TIMESTAMP is core since OpenGL 3.3. OpenGL ES only has it in GL_EXT_disjoint_timer_query.
+            if (is_opengl_es())
+                return uses_timer_query_extension();
+            int major = 0;
+            int minor = 0;
+            glGetIntegerv(GL_MAJOR_VERSION, &major);
+            glGetIntegerv(GL_MINOR_VERSION, &minor);
+            return major > 3 || (major == 3 && minor >= 3);
+        }
+    }
+
+    void load_timer_query_extension(void* (*loader)(const char* name))
+    {
+        query_counter_ext = nullptr;
+        get_query_objectui64v_ext = nullptr;
+        if (!is_opengl_es() || !has_extension("GL_EXT_disjoint_timer_query"))
+            return;
+        query_counter_ext = reinterpret_cast<decltype(query_counter_ext)>(loader("glQueryCounterEXT"));
+        get_query_objectui64v_ext = reinterpret_cast<decltype(get_query_objectui64v_ext)>(loader("glGetQueryObjectui64vEXT"));
+    }
+
     gl_query_clock::time_point gl_query_clock::now() noexcept
     {
+        if (!supports_timestamp_queries())
+            return time_point{};
+
         std::uint32_t time_stamp_query;
         glGenQueries(1, &time_stamp_query);
 
-        glQueryCounter(time_stamp_query, GL_TIMESTAMP);
-        std::uint64_t time_stamp = 0;
-        glGetQueryObjectui64v(time_stamp_query, GL_QUERY_RESULT, &time_stamp);
+        query_counter(time_stamp_query);
+        const std::uint64_t time_stamp = query_result(time_stamp_query);
 
         glDeleteQueries(1, &time_stamp_query);
         return time_point{ duration(time_stamp) };
     }
+
+    gl_timestamp_queries::gl_timestamp_queries(size_t count)
+        : _recorded(count, false)
+    {
+        if (!supports_timestamp_queries())
+            return;
+        _queries.resize(count);
+        glGenQueries(int(count), _queries.data());
+    }
+
+    gl_timestamp_queries::~gl_timestamp_queries()
+    {
+        if (!_queries.empty())
+            glDeleteQueries(int(_queries.size()), _queries.data());
+    }
+
+    void gl_timestamp_queries::reset() noexcept
+    {
+        std::fill(_recorded.begin(), _recorded.end(), false);
+        // Clears a disjoint event from before, so only the ones between the new timestamps count.
+        if (!_queries.empty())
+            gpu_disjoint();
+    }
+
+    void gl_timestamp_queries::record(size_t index) noexcept
+    {
+        if (_queries.empty())
+            return;
+        query_counter(_queries[index]);
+        _recorded[index] = true;
+    }
+
+    std::optional<std::vector<gl_query_clock::time_point>> gl_timestamp_queries::resolve() const noexcept
+    {
+        if (_queries.empty() || !_recorded.front())
+            return std::nullopt;
+        for (size_t i = 0; i < _queries.size(); ++i)
+        {
+            if (!_recorded[i])
+                continue;
+            std::uint32_t available = 0;
+            glGetQueryObjectuiv(_queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                return std::nullopt;
+        }
+        if (gpu_disjoint())
+            return std::nullopt;
+
+        std::vector<gl_query_clock::time_point> result(_queries.size());
+        for (size_t i = 0; i < _queries.size(); ++i)
+        {
+            if (!_recorded[i])
+            {
+                result[i] = result[i - 1];
+                continue;
+            }
+            result[i] = gl_query_clock::time_point{ gl_query_clock::duration(query_result(_queries[i])) };
+        }
+        return result;
+    }
 }
\ No newline at end of file
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <chrono>
+#include <cstdint>
+#include <optional>
+#include <vector>
 
 namespace mpp
 {
@@ -12,6 +15,39 @@ namespace mpp
         using time_point = std::chrono::time_point<gl_query_clock>;
         inline static constexpr bool is_steady = false;
 
+        // Waits for all previously submitted commands, see gl_timestamp_queries for a way to measure without stalling.
+        // The epoch without timestamp support.
         static time_point now() noexcept;
     };
+
+    // OpenGL ES only has timestamps in GL_EXT_disjoint_timer_query, whose functions mygl does not load.
+    // Call this after mygl::load with the same loader, on the thread the context is current on. On desktop OpenGL it does nothing.
+    void load_timer_query_extension(void* (*loader)(const char* name));
+
+    // A fixed set of GPU timestamps. Recording one only inserts a query into the command stream, and the results
+    // are read later, once the GPU has passed them. Without GL_TIMESTAMP support nothing is recorded.
+    class gl_timestamp_queries
+    {
+    public:
+        explicit gl_timestamp_queries(size_t count);
+        ~gl_timestamp_queries();
+
+        gl_timestamp_queries(const gl_timestamp_queries&) = delete;
+        gl_timestamp_queries(gl_timestamp_queries&&) = delete;
+        gl_timestamp_queries& operator=(const gl_timestamp_queries&) = delete;
+        gl_timestamp_queries& operator=(gl_timestamp_queries&&) = delete;
+
+        bool supported() const noexcept { return !_queries.empty(); }
+        // Forgets all recorded timestamps.
+        void reset() noexcept;
+        void record(size_t index) noexcept;
+        // Never waits. Empty if the first timestamp was not recorded or if the GPU has not passed all recorded ones yet,
+        // and on OpenGL ES if a disjoint event since reset makes them incomparable.
+        // Timestamps which were not recorded take the value of the one before, so skipped intervals are zero.
+        std::optional<std::vector<gl_query_clock::time_point>> resolve() const noexcept;
+
+    private:
+        std::vector<std::uint32_t> _queries;
+        std::vector<bool> _recorded;
+    };
 }
\ No newline at end of file
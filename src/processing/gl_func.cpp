@@ -1,41 +1,234 @@
 #include <processing/gl_func.hpp>
+#include <processing/fnv_hash.hpp>
 #include <opengl/mygl.hpp>
 #include <spdlog/spdlog.h>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_set>
 
 namespace mpp
 {
+    namespace
+    {
+        constexpr std::uint32_t cache_magic = 0x4250504d; // "MPPB"
+        constexpr std::uint32_t cache_version = 1;
+
+        struct cache_header
+        {
+            std::uint32_t magic;
+            std::uint32_t version;
+            std::uint64_t key;
+            std::uint32_t format;
+            std::uint32_t size;
+        };
+
+        std::mutex cache_mutex;
+        std::optional<std::filesystem::path> cache_directory;
+
+        std::filesystem::path program_cache_directory()
+        {
+            std::lock_guard lock(cache_mutex);
+            if (!cache_directory)
+            {
+                std::error_code ec;
+                const auto temp = std::filesystem::temp_directory_path(ec);
+                cache_directory = ec ? std::filesystem::path() : temp / "mpp-program-cache";
+            }
+            return *cache_directory;
+        }
+
+        // Binaries are only valid for the driver which created them, so its identification is part of the key.
+        std::uint64_t program_key(std::initializer_list<std::uint32_t> shaders)
+        {
+            std::uint64_t hash = fnv1a_offset_basis;
+            fnv1a(hash, reinterpret_cast<const char*>(glGetString(GL_VENDOR)));
+            fnv1a(hash, reinterpret_cast<const char*>(glGetString(GL_RENDERER)));
+            fnv1a(hash, reinterpret_cast<const char*>(glGetString(GL_VERSION)));
+            for (auto shader : shaders)
+            {
+                int type = 0;
+                int length = 0;
+                glGetShaderiv(shader, GL_SHADER_TYPE, &type);
+                glGetShaderiv(shader, GL_SHADER_SOURCE_LENGTH, &length);
+                std::string source(std::max(length, 1), '\0');
+                glGetShaderSource(shader, length, &length, source.data());
+                fnv1a(hash, type);
+                fnv1a(hash, source.data(), size_t(length));
+            }
+            return hash;
+        }
+
+        bool load_program_binary(std::uint32_t program, const std::filesystem::path& file, std::uint64_t key)
+        {
+            std::ifstream stream(file, std::ios::binary);
+            cache_header header;
+            if (!stream.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != cache_magic
+                || header.version != cache_version || header.key != key)
+                return false;
+            std::vector<char> binary(header.size);
+            if (!stream.read(binary.data(), binary.size()))
+                return false;
+
+            // Fails if the driver changed in a way the key does not cover, the program is compiled from source then.
+            glProgramBinary(program, GLenum(header.format), binary.data(), int(binary.size()));
+            int linked = 0;
+            glGetProgramiv(program, GL_LINK_STATUS, &linked);
+            return linked != 0;
+        }
+
+        void store_program_binary(std::uint32_t program, const std::filesystem::path& file, std::uint64_t key)
+        {
+            int length = 0;
+            glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+            if (length <= 0)
+                return;
+            std::vector<char> binary(length);
+            GLenum format;
+            glGetProgramBinary(program, length, &length, &format, binary.data());
+            const cache_header header{ cache_magic, cache_version, key, std::uint32_t(format), std::uint32_t(length) };
+
+            // Write to a temporary file first, so other processes never read a partial binary.
+            std::error_code ec;
+            std::filesystem::create_directories(file.parent_path(), ec);
+            if (ec)
+            {
+                // E.g. on Android, where the temporary directory is not writable. Don't try again for every program.
+                spdlog::warn("Disabling the program binary cache, could not create {}: {}", file.parent_path().string(), ec.message());
+                set_program_cache_directory({});
+                return;
+            }
+            auto temporary = file;
+            temporary += ".tmp";
+            {
+                std::ofstream stream(temporary, std::ios::binary);
+                stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+                stream.write(binary.data(), length);
+                if (!stream)
+                {
+                    spdlog::warn("Could not write program binary to {}.", file.string());
+                    return;
+                }
+            }
+            std::filesystem::rename(temporary, file, ec);
+        }
+
+        void log_shader_output(std::uint32_t shader)
+        {
+            int log_len;
+            glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &log_len);
+            if (log_len > 3)
+            {
+                std::string info_log(log_len, '\0');
+                glGetShaderInfoLog(shader, log_len, &log_len, info_log.data());
+                spdlog::info("Shader Compilation Output:\n{}", info_log);
+            }
+        }
+
+        void log_program_output(std::uint32_t program)
+        {
+            int log_len;
+            glGetProgramiv(program, GL_INFO_LOG_LENGTH, &log_len);
+            if (log_len > 3)
+            {
+                std::string info_log(log_len, '\0');
+                glGetProgramInfoLog(program, log_len, &log_len, info_log.data());
+                spdlog::info("Shader Compilation Output:\n{}", info_log);
+            }
+        }
+    }
+
     std::uint32_t create_shader(GLenum type, const char* src)
     {
         std::uint32_t sh = glCreateShader(type);
         glShaderSource(sh, 1, &src, nullptr);
-        glCompileShader(sh);
-        int log_len;
-        glGetShaderiv(sh, GL_INFO_LOG_LENGTH, &log_len);
-        if (log_len > 3)
-        {
-            std::string info_log(log_len, '\0');
-            glGetShaderInfoLog(sh, log_len, &log_len, info_log.data());
-            spdlog::info("Shader Compilation Output:\n{}", info_log);
-        }
         return sh;
     }
 
     std::uint32_t create_program(std::initializer_list<std::uint32_t> shaders)
     {
-        std::uint32_t program = glCreateProgram();
-        for (auto s : shaders)
-            glAttachShader(program, s);
-        glLinkProgram(program);
-        int log_len;
-        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &log_len);
-        if (log_len > 3)
-        {
-            std::string info_log(log_len, '\0');
-            glGetProgramInfoLog(program, log_len, &log_len, info_log.data());
-            spdlog::info("Shader Compilation Output:\n{}", info_log);
-        }
-        for (auto s : shaders)
-            glDetachShader(program, s);
-        return program;
+        return create_programs({ shaders }).front();
+    }
+
+    std::vector<std::uint32_t> create_programs(std::initializer_list<std::initializer_list<std::uint32_t>> programs)
+    {
+        struct uncached_program
+        {
+            std::uint32_t program;
+            std::initializer_list<std::uint32_t> shaders;
+            std::filesystem::path file;
+            std::uint64_t key;
+        };
+
+        int num_binary_formats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_binary_formats);
+        const auto directory = num_binary_formats > 0 ? program_cache_directory() : std::filesystem::path();
+
+        std::vector<std::uint32_t> result;
+        std::vector<uncached_program> uncached;
+        for (const auto& shaders : programs)
+        {
+            const std::uint32_t program = result.emplace_back(glCreateProgram());
+            if (directory.empty())
+            {
+                uncached.push_back({ program, shaders, {}, 0 });
+                continue;
+            }
+            const auto key = program_key(shaders);
+            const auto file = directory / fmt::format("{:016x}.bin", key);
+            if (!load_program_binary(program, file, key))
+                uncached.push_back({ program, shaders, file, key });
+        }
+        if (uncached.empty())
+            return result;
+
+        // Shaders may be shared between programs or may have been compiled for an earlier call.
+        // Nothing has been submitted yet, so querying the compile status does not wait for anything.
+        std::vector<std::uint32_t> compile;
+        std::unordered_set<std::uint32_t> seen;
+        for (const auto& p : uncached)
+        {
+            for (auto shader : p.shaders)
+            {
+                int compiled = 0;
+                glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+                if (!compiled && seen.insert(shader).second)
+                    compile.push_back(shader);
+            }
+        }
+
+        // Submit everything before querying any results.
+        for (auto shader : compile)
+            glCompileShader(shader);
+        for (const auto& p : uncached)
+        {
+            if (!p.file.empty())
+                glProgramParameteri(p.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, true);
+            for (auto shader : p.shaders)
+                glAttachShader(p.program, shader);
+            glLinkProgram(p.program);
+        }
+
+        for (auto shader : compile)
+            log_shader_output(shader);
+        for (const auto& p : uncached)
+        {
+            log_program_output(p.program);
+            int linked = 0;
+            glGetProgramiv(p.program, GL_LINK_STATUS, &linked);
+            if (linked && !p.file.empty())
+                store_program_binary(p.program, p.file, p.key);
+            for (auto shader : p.shaders)
+                glDetachShader(p.program, shader);
+        }
+        spdlog::info("Compiled {} of {} programs, the others were loaded from the program binary cache.", uncached.size(), result.size());
+        return result;
+    }
+
+    void set_program_cache_directory(std::filesystem::path directory)
+    {
+        std::lock_guard lock(cache_mutex);
+        cache_directory = std::move(directory);
     }
 }
\ No newline at end of file
@@ -1,11 +1,22 @@
 #pragma once
 
 #include <cstdint>
+#include <vector>
+#include <filesystem>
 #include <initializer_list>
 #include <opengl/mygl_enums.hpp>
 
 namespace mpp
 {
+    // Creates a shader object from the source. It is compiled by create_program(s), and only if the program
+    // is not in the program binary cache.
     std::uint32_t create_shader(GLenum type, const char* src);
     std::uint32_t create_program(std::initializer_list<std::uint32_t> shaders);
+    // Creates one program for each list of shaders. All compiles and links are issued before any result is queried,
+    // so drivers with KHR_parallel_shader_compile can work on them concurrently.
+    std::vector<std::uint32_t> create_programs(std::initializer_list<std::initializer_list<std::uint32_t>> programs);
+
+    // Linked programs are stored in this directory with glGetProgramBinary, keyed by their shader sources and
+    // the driver. Defaults to "mpp-program-cache" in the temporary directory, an empty path disables the cache.
+    void set_program_cache_directory(std::filesystem::path directory);
 }
\ No newline at end of file
@@ -0,0 +1,313 @@
+#include <processing/gl_state.hpp>
+#include <opengl/mygl.hpp>
+#include <algorithm>
+#include <utility>
+
+namespace mpp
+{
+    gl_state& gl_state::current() noexcept
+    {
+        thread_local gl_state state;
+        return state;
+    }
+
+    void gl_state::invalidate() noexcept
+    {
+        _current = values{};
+    }
+
+    template<typename T, typename Query>
+    const T& gl_state::resolve(shadow<T>& value, Query&& query)
+    {
+        if (!value.known)
+            value = { query(), true };
+        return value.value;
+    }
+
+    template<typename T, typename Query, typename Apply>
+    void gl_state::change(shadow<T>& current, shadow<T>& saved, const T& value, Query&& query, Apply&& apply)
+    {
+        // The value from before the scope is only needed once, and only if it is about to be overwritten.
+        if (_scopes != 0 && !saved.known)
+            saved = { resolve(current, query), true };
+        if (current.known && current.value == value)
+            return;
+        apply(value);
+        current = { value, true };
+    }
+
+    int gl_state::capability_index(GLenum capability) noexcept
+    {
+        const auto it = std::find(tracked_capabilities.begin(), tracked_capabilities.end(), capability);
+        return it == tracked_capabilities.end() ? -1 : int(it - tracked_capabilities.begin());
+    }
+
+    gl_state::shadow<int>& gl_state::pixel_store_value(values& v, GLenum parameter) noexcept
+    {
+        return parameter == GL_PACK_ALIGNMENT ? v.pack_alignment : v.unpack_alignment;
+    }
+
+    namespace
+    {
+        std::uint32_t get_uint(GLenum parameter)
+        {
+            int value = 0;
+            glGetIntegerv(parameter, &value);
+            return std::uint32_t(value);
+        }
+
+        glm::ivec4 get_ivec4(GLenum parameter)
+        {
+            glm::ivec4 value;
+            glGetIntegerv(parameter, &value[0]);
+            return value;
+        }
+    }
+
+    void gl_state::set_active_texture(std::uint32_t unit) noexcept
+    {
+        change(_current.active_texture, _saved.active_texture, unit,
+            [] { return get_uint(GL_ACTIVE_TEXTURE) - std::uint32_t(GL_TEXTURE0); },
+            [](std::uint32_t u) { glActiveTexture(GLenum(GL_TEXTURE0 + u)); });
+    }
+
+    void gl_state::bind_texture(std::uint32_t unit, std::uint32_t texture) noexcept
+    {
+        set_active_texture(unit);
+        change(_current.textures[unit], _saved.textures[unit], texture,
+            [] { return get_uint(GL_TEXTURE_BINDING_2D); },
+            [](std::uint32_t t) { glBindTexture(GL_TEXTURE_2D, t); });
+    }
+
+    void gl_state::bind_texture_array(std::uint32_t unit, std::uint32_t texture) noexcept
+    {
+        set_active_texture(unit);
+        change(_current.texture_arrays[unit], _saved.texture_arrays[unit], texture,
+            [] { return get_uint(GL_TEXTURE_BINDING_2D_ARRAY); },
+            [](std::uint32_t t) { glBindTexture(GL_TEXTURE_2D_ARRAY, t); });
+    }
+
+    void gl_state::use_program(std::uint32_t program) noexcept
+    {
+        change(_current.program, _saved.program, program,
+            [] { return get_uint(GL_CURRENT_PROGRAM); },
+            [](std::uint32_t p) { glUseProgram(p); });
+    }
+
+    void gl_state::bind_vertex_array(std::uint32_t vertex_array) noexcept
+    {
+        change(_current.vertex_array, _saved.vertex_array, vertex_array,
+            [] { return get_uint(GL_VERTEX_ARRAY_BINDING); },
+            [](std::uint32_t v) { glBindVertexArray(v); });
+    }
+
+    void gl_state::bind_framebuffer(std::uint32_t framebuffer) noexcept
+    {
+        change(_current.framebuffer, _saved.framebuffer, framebuffer,
+            [] { return get_uint(GL_FRAMEBUFFER_BINDING); },
+            [](std::uint32_t f) { glBindFramebuffer(GL_FRAMEBUFFER, f); });
+    }
+
+    void gl_state::set_viewport(const glm::ivec4& viewport) noexcept
+    {
+        change(_current.viewport, _saved.viewport, viewport,
+            [] { return get_ivec4(GL_VIEWPORT); },
+            [](const glm::ivec4& v) { glViewport(v.x, v.y, v.z, v.w); });
+    }
+
+    void gl_state::set_scissor(const glm::ivec4& scissor) noexcept
+    {
+        change(_current.scissor, _saved.scissor, scissor,
+            [] { return get_ivec4(GL_SCISSOR_BOX); },
+            [](const glm::ivec4& s) { glScissor(s.x, s.y, s.z, s.w); });
+    }
+
+    void gl_state::set_enabled(GLenum capability, bool enabled) noexcept
+    {
+        const int index = capability_index(capability);
+        if (index < 0)
+        {
+            (enabled ? glEnable : glDisable)(capability);
+            return;
+        }
+        change(_current.capabilities[index], _saved.capabilities[index], enabled,
+            [=] { return glIsEnabled(capability); },
+            [=](bool e) { (e ? glEnable : glDisable)(capability); });
+    }
+
+    void gl_state::set_pixel_store(GLenum parameter, int value) noexcept
+    {
+        change(pixel_store_value(_current, parameter), pixel_store_value(_saved, parameter), value,
+            [=] { return int(get_uint(parameter)); },
+            [=](int v) { glPixelStorei(parameter, v); });
+    }
+
+    void gl_state::set_clear_color(const glm::vec4& color) noexcept
+    {
+        change(_current.clear_color, _saved.clear_color, color,
+            [] {
+                glm::vec4 value;
+                glGetFloatv(GL_COLOR_CLEAR_VALUE, &value[0]);
+                return value;
+            },
+            [](const glm::vec4& c) { glClearColor(c.r, c.g, c.b, c.a); });
+    }
+
+    std::uint32_t gl_state::active_texture() noexcept
+    {
+        return resolve(_current.active_texture, [] { return get_uint(GL_ACTIVE_TEXTURE) - std::uint32_t(GL_TEXTURE0); });
+    }
+
+    std::uint32_t gl_state::texture(std::uint32_t unit) noexcept
+    {
+        return resolve(_current.textures[unit], [&] {
+            set_active_texture(unit);
+            return get_uint(GL_TEXTURE_BINDING_2D);
+            });
+    }
+
+    std::uint32_t gl_state::texture_array(std::uint32_t unit) noexcept
+    {
+        return resolve(_current.texture_arrays[unit], [&] {
+            set_active_texture(unit);
+            return get_uint(GL_TEXTURE_BINDING_2D_ARRAY);
+            });
+    }
+
+    std::uint32_t gl_state::program() noexcept
+    {
+        return resolve(_current.program, [] { return get_uint(GL_CURRENT_PROGRAM); });
+    }
+
+    std::uint32_t gl_state::vertex_array() noexcept
+    {
+        return resolve(_current.vertex_array, [] { return get_uint(GL_VERTEX_ARRAY_BINDING); });
+    }
+
+    std::uint32_t gl_state::framebuffer() noexcept
+    {
+        return resolve(_current.framebuffer, [] { return get_uint(GL_FRAMEBUFFER_BINDING); });
+    }
+
+    glm::ivec4 gl_state::viewport() noexcept
+    {
+        return resolve(_current.viewport, [] { return get_ivec4(GL_VIEWPORT); });
+    }
+
+    glm::ivec4 gl_state::scissor() noexcept
+    {
+        return resolve(_current.scissor, [] { return get_ivec4(GL_SCISSOR_BOX); });
+    }
+
+    bool gl_state::enabled(GLenum capability) noexcept
+    {
+        const int index = capability_index(capability);
+        if (index < 0)
+            return glIsEnabled(capability);
+        return resolve(_current.capabilities[index], [=] { return glIsEnabled(capability); });
+    }
+
+    int gl_state::pixel_store(GLenum parameter) noexcept
+    {
+        return resolve(pixel_store_value(_current, parameter), [=] { return int(get_uint(parameter)); });
+    }
+
+    glm::vec4 gl_state::clear_color() noexcept
+    {
+        return resolve(_current.clear_color, [] {
+            glm::vec4 value;
+            glGetFloatv(GL_COLOR_CLEAR_VALUE, &value[0]);
+            return value;
+            });
+    }
+
+    namespace
+    {
+        template<typename Shadow>
+        void forget(Shadow& binding, const std::uint32_t* names, int count)
+        {
+            if (binding.known && std::find(names, names + count, binding.value) != names + count)
+                binding.value = 0;
+        }
+    }
+
+    void gl_state::delete_textures(int count, const std::uint32_t* textures) noexcept
+    {
+        glDeleteTextures(count, textures);
+        for (std::uint32_t unit = 0; unit < max_texture_units; ++unit)
+        {
+            forget(_current.textures[unit], textures, count);
+            forget(_saved.textures[unit], textures, count);
+            forget(_current.texture_arrays[unit], textures, count);
+            forget(_saved.texture_arrays[unit], textures, count);
+        }
+    }
+
+    void gl_state::delete_vertex_arrays(int count, const std::uint32_t* vertex_arrays) noexcept
+    {
+        glDeleteVertexArrays(count, vertex_arrays);
+        forget(_current.vertex_array, vertex_arrays, count);
+        forget(_saved.vertex_array, vertex_arrays, count);
+    }
+
+    void gl_state::delete_framebuffers(int count, const std::uint32_t* framebuffers) noexcept
+    {
+        glDeleteFramebuffers(count, framebuffers);
+        forget(_current.framebuffer, framebuffers, count);
+        forget(_saved.framebuffer, framebuffers, count);
+    }
+
+    void gl_state::begin_scope() noexcept
+    {
+        ++_scopes;
+    }
+
+    void gl_state::end_scope() noexcept
+    {
+        if (--_scopes != 0)
+            return;
+        const values saved = std::exchange(_saved, values{});
+        // Binding textures changes the active unit, so it is restored afterwards.
+        for (std::uint32_t unit = 0; unit < max_texture_units; ++unit)
+        {
+            if (saved.textures[unit].known)
+                bind_texture(unit, saved.textures[unit].value);
+            if (saved.texture_arrays[unit].known)
+                bind_texture_array(unit, saved.texture_arrays[unit].value);
+        }
+        if (saved.active_texture.known)
+            set_active_texture(saved.active_texture.value);
+        if (saved.program.known)
+            use_program(saved.program.value);
+        if (saved.vertex_array.known)
+            bind_vertex_array(saved.vertex_array.value);
+        if (saved.framebuffer.known)
+            bind_framebuffer(saved.framebuffer.value);
+        if (saved.viewport.known)
+            set_viewport(saved.viewport.value);
+        if (saved.scissor.known)
+            set_scissor(saved.scissor.value);
+        for (size_t i = 0; i < tracked_capabilities.size(); ++i)
+        {
+            if (saved.capabilities[i].known)
+                set_enabled(tracked_capabilities[i], saved.capabilities[i].value);
+        }
+        if (saved.pack_alignment.known)
+            set_pixel_store(GL_PACK_ALIGNMENT, saved.pack_alignment.value);
+        if (saved.unpack_alignment.known)
+            set_pixel_store(GL_UNPACK_ALIGNMENT, saved.unpack_alignment.value);
+        if (saved.clear_color.known)
+            set_clear_color(saved.clear_color.value);
+    }
+
+    gl_state_scope::gl_state_scope() noexcept
+        : _state(gl_state::current())
+    {
+        _state.begin_scope();
+    }
+
+    gl_state_scope::~gl_state_scope()
+    {
+        _state.end_scope();
+    }
+}
\ No newline at end of file
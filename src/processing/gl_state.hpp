@@ -0,0 +1,128 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <opengl/mygl_enums.hpp>
+
+namespace mpp
+{
+    // Shadow copy of the OpenGL state which the SIFT passes and the visualizations change. Changes to the value which is
+    // already set are skipped, and queries are answered from the copy instead of waiting for the driver with glGet.
+    // A value is only queried from OpenGL the first time it is needed after invalidate().
+    // Code which changes the same state without this class has to call invalidate() afterwards.
+    class gl_state
+    {
+    public:
+        static constexpr std::uint32_t max_texture_units = 16;
+
+        // One for each thread, as a context can only be current on one thread at a time. Call invalidate() after making
+        // another context current on the same thread.
+        static gl_state& current() noexcept;
+
+        gl_state() = default;
+        gl_state(const gl_state&) = delete;
+        gl_state(gl_state&&) = delete;
+        gl_state& operator=(const gl_state&) = delete;
+        gl_state& operator=(gl_state&&) = delete;
+
+        void invalidate() noexcept;
+
+        // Units are indices, not GL_TEXTURE0 + index.
+        void set_active_texture(std::uint32_t unit) noexcept;
+        // Binds a GL_TEXTURE_2D to the unit, which stays active afterwards.
+        void bind_texture(std::uint32_t unit, std::uint32_t texture) noexcept;
+        // Same for GL_TEXTURE_2D_ARRAY, which has a binding of its own on each unit.
+        void bind_texture_array(std::uint32_t unit, std::uint32_t texture) noexcept;
+        void use_program(std::uint32_t program) noexcept;
+        void bind_vertex_array(std::uint32_t vertex_array) noexcept;
+        // Binds to GL_FRAMEBUFFER, so for drawing and reading.
+        void bind_framebuffer(std::uint32_t framebuffer) noexcept;
+        void set_viewport(const glm::ivec4& viewport) noexcept;
+        void set_scissor(const glm::ivec4& scissor) noexcept;
+        // Capabilities which are not tracked are passed on to glEnable or glDisable every time.
+        void set_enabled(GLenum capability, bool enabled) noexcept;
+        // GL_PACK_ALIGNMENT or GL_UNPACK_ALIGNMENT.
+        void set_pixel_store(GLenum parameter, int value) noexcept;
+        void set_clear_color(const glm::vec4& color) noexcept;
+
+        std::uint32_t active_texture() noexcept;
+        // May change the active texture unit to query the binding.
+        std::uint32_t texture(std::uint32_t unit) noexcept;
+        std::uint32_t texture_array(std::uint32_t unit) noexcept;
+        std::uint32_t program() noexcept;
+        std::uint32_t vertex_array() noexcept;
+        std::uint32_t framebuffer() noexcept;
+        glm::ivec4 viewport() noexcept;
+        glm::ivec4 scissor() noexcept;
+        bool enabled(GLenum capability) noexcept;
+        int pixel_store(GLenum parameter) noexcept;
+        glm::vec4 clear_color() noexcept;
+
+        // Deleted objects are unbound by OpenGL, and their names may be handed out again.
+        void delete_textures(int count, const std::uint32_t* textures) noexcept;
+        void delete_vertex_arrays(int count, const std::uint32_t* vertex_arrays) noexcept;
+        void delete_framebuffers(int count, const std::uint32_t* framebuffers) noexcept;
+
+    private:
+        friend class gl_state_scope;
+        static constexpr std::array<GLenum, 7> tracked_capabilities{
+            GL_DEPTH_TEST, GL_STENCIL_TEST, GL_SCISSOR_TEST, GL_BLEND, GL_CULL_FACE, GL_MULTISAMPLE, GL_RASTERIZER_DISCARD
+        };
+
+        template<typename T>
+        struct shadow
+        {
+            T value{};
+            bool known = false;
+        };
+
+        struct values
+        {
+            shadow<std::uint32_t> active_texture;
+            std::array<shadow<std::uint32_t>, max_texture_units> textures;
+            std::array<shadow<std::uint32_t>, max_texture_units> texture_arrays;
+            shadow<std::uint32_t> program;
+            shadow<std::uint32_t> vertex_array;
+            shadow<std::uint32_t> framebuffer;
+            shadow<glm::ivec4> viewport;
+            shadow<glm::ivec4> scissor;
+            std::array<shadow<bool>, tracked_capabilities.size()> capabilities;
+            shadow<int> pack_alignment;
+            shadow<int> unpack_alignment;
+            shadow<glm::vec4> clear_color;
+        };
+
+        template<typename T, typename Query>
+        static const T& resolve(shadow<T>& value, Query&& query);
+        template<typename T, typename Query, typename Apply>
+        void change(shadow<T>& current, shadow<T>& saved, const T& value, Query&& query, Apply&& apply);
+        static int capability_index(GLenum capability) noexcept;
+        shadow<int>& pixel_store_value(values& v, GLenum parameter) noexcept;
+        void begin_scope() noexcept;
+        void end_scope() noexcept;
+
+        values _current;
+        // Values from before the first change inside of the outermost gl_state_scope.
+        values _saved;
+        int _scopes = 0;
+    };
+
+    // Restores everything that was changed through gl_state::current() while the scope was alive. Unlike capturing all
+    // of the state up front, this only queries values which are changed and not known yet. Nested scopes do nothing,
+    // the outermost one restores the state.
+    class gl_state_scope
+    {
+    public:
+        gl_state_scope() noexcept;
+        ~gl_state_scope();
+
+        gl_state_scope(const gl_state_scope&) = delete;
+        gl_state_scope(gl_state_scope&&) = delete;
+        gl_state_scope& operator=(const gl_state_scope&) = delete;
+        gl_state_scope& operator=(gl_state_scope&&) = delete;
+
+    private:
+        gl_state& _state;
+    };
+}
\ No newline at end of file
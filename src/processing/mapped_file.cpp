@@ -0,0 +1,67 @@
+#include <processing/mapped_file.hpp>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace mpp
+{
+#ifdef _WIN32
+    mapped_file::mapped_file(const std::filesystem::path& path)
+    {
+        const HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return;
+        LARGE_INTEGER size;
+        if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+        {
+            // The view keeps the file and the mapping object alive, so both handles can be closed right away.
+            if (const HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr))
+            {
+                _data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                _size = _data ? size_t(size.QuadPart) : 0;
+                CloseHandle(mapping);
+            }
+        }
+        CloseHandle(file);
+    }
+
+    mapped_file::~mapped_file()
+    {
+        if (_data)
+            UnmapViewOfFile(_data);
+    }
+#else
+    mapped_file::mapped_file(const std::filesystem::path& path)
+    {
+        const int file = open(path.c_str(), O_RDONLY);
+        if (file < 0)
+            return;
+        struct stat status;
+        if (fstat(file, &status) == 0 && status.st_size > 0)
+        {
+            // The mapping stays valid after the file descriptor is closed.
+            void* data = mmap(nullptr, size_t(status.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+            if (data != MAP_FAILED)
+            {
+                _data = data;
+                _size = size_t(status.st_size);
+            }
+        }
+        close(file);
+    }
+
+    mapped_file::~mapped_file()
+    {
+        if (_data)
+            munmap(const_cast<void*>(_data), _size);
+    }
+#endif
+}
\ No newline at end of file
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+
+namespace mpp
+{
+    // Read-only memory mapping of a whole file. Empty if the file could not be opened or mapped.
+    class mapped_file
+    {
+    public:
+        explicit mapped_file(const std::filesystem::path& path);
+        ~mapped_file();
+
+        mapped_file(const mapped_file&) = delete;
+        mapped_file(mapped_file&&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+        mapped_file& operator=(mapped_file&&) = delete;
+
+        const std::byte* data() const noexcept { return static_cast<const std::byte*>(_data); }
+        size_t size() const noexcept { return _size; }
+        bool empty() const noexcept { return _data == nullptr; }
+
+    private:
+        const void* _data = nullptr;
+        size_t _size = 0;
+    };
+}
\ No newline at end of file
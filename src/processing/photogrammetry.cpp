@@ -6,14 +6,46 @@
 #include <opengl/mygl_glfw.hpp>
 #include <future>
 #include <spdlog/spdlog.h>
+#include <processing/egl_context.hpp>
+#include <processing/gl_clock.hpp>
+#include <cstdlib>
 
 #ifdef __ANDROID__
-#include <EGL/egl.h>
 #include <spdlog/sinks/android_sink.h>
 #endif
 
 namespace mpp
 {
+#ifndef __ANDROID__
+    namespace
+    {
+        bool has_display()
+        {
+#ifdef _WIN32
+            return true;
+#else
+            return std::getenv("DISPLAY") != nullptr || std::getenv("WAYLAND_DISPLAY") != nullptr;
+#endif
+        }
+
+        GLFWwindow* create_hidden_window()
+        {
+            glfwDefaultWindowHints();
+            glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, true);
+            glfwWindowHint(GLFW_CLIENT_API, GLFW_OPENGL_ES_API);
+            glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+            glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
+            const auto w = glfwCreateWindow(1, 1, "_", nullptr, nullptr);
+            if (w)
+            {
+                glfwMakeContextCurrent(w);
+                glfwHideWindow(w);
+            }
+            return w;
+        }
+    }
+#endif
+
     photogrammetry_processor::photogrammetry_processor()
     {
         _detection_settings.octaves = 4;
@@ -27,42 +59,107 @@ namespace mpp
     }
     void photogrammetry_processor::clear()
     {
+        for (const auto& [img, info] : _images)
+        {
+            if (_sift_cache && info.descriptors.id != 0)
+                sift::release_descriptors(*_sift_cache, info.descriptors);
+        }
         _image_matches.clear();
         _images.clear();
     }
     void photogrammetry_processor::add_image(std::shared_ptr<image> img, float focal_length)
     {
-        if (!_sift_cache)
-            _sift_cache = sift::create_cache(_detection_settings.octaves, _detection_settings.feature_scales);
+        add_images({ { std::move(img), focal_length } });
+    }
+    void photogrammetry_processor::add_images(const std::vector<std::pair<std::shared_ptr<image>, float>>& images)
+    {
+        // Images which are not in the feature cache are detected together, so the GPU works on one image while the
+        // features of the previous one are read back.
+        std::vector<image> scaled_images;
+        std::vector<std::pair<image_info*, std::uint64_t>> detected;
+        for (const auto& [img, focal_length] : images)
+        {
+            const auto [insert_iter, did_emplace] = _images.emplace(img, image_info{});
+            if (!did_emplace)
+                continue;
 
-        const auto [insert_iter, did_emplace] = _images.emplace(std::move(img), image_info{});
-        constexpr auto max_width = 400;
-        auto& imgref = *insert_iter->first;
-        const float aspect = float(imgref.dimensions().x) / imgref.dimensions().y;
-        const auto w = max_width;
-        const auto h = int(aspect * max_width);
-        if (did_emplace)
+            constexpr auto max_width = 400;
+            auto& imgref = *insert_iter->first;
+            const float aspect = float(imgref.dimensions().x) / imgref.dimensions().y;
+            const auto w = max_width;
+            const auto h = int(aspect * max_width);
+            auto scaled = image(imgref).resize(w, h);
+            auto& info = insert_iter->second;
+            const auto key = sift::feature_cache::key(scaled, _detection_settings, sift::dst_system::normalized_coordinates);
+            if (_feature_cache.load(key, info.feature_points))
+            {
+                spdlog::info("Loaded {} features from the feature cache.", info.feature_points.size());
+            }
+            else
+            {
+                scaled_images.push_back(std::move(scaled));
+                detected.emplace_back(&info, key);
+            }
+            info.camera_intrinsics = glm::mat3(1.f);
+            info.camera_intrinsics[0][0] = focal_length;
+            info.camera_intrinsics[1][1] = focal_length;
+        }
+        if (scaled_images.empty())
+            return;
+
+        // Only created on the first cache miss, so runs on known images never compile the SIFT programs.
+        // Two frames, so the detections of a batch overlap.
+        if (!_sift_cache && _detection_settings.backend == sift::detection_backend::opengl)
+            _sift_cache = sift::create_cache(_detection_settings.octaves, _detection_settings.feature_scales, 2);
+        std::vector<sift::resident_descriptors> descriptors(scaled_images.size());
+        std::vector<sift::compact_feature_set> features;
+        if (_sift_cache)
+        {
+            features = sift::detect_resident_feature_sets(*_sift_cache, scaled_images, _detection_settings, descriptors, sift::dst_system::normalized_coordinates);
+        }
+        else
+        {
+            for (const auto& scaled : scaled_images)
+                features.push_back(sift::detect_compact_feature_set(scaled, _detection_settings, sift::dst_system::normalized_coordinates));
+        }
+        for (size_t i = 0; i < detected.size(); ++i)
         {
-            insert_iter->second.feature_points = sift::detect_features(*_sift_cache, image(imgref).resize(w, h), _detection_settings, sift::dst_system::normalized_coordinates);
-            insert_iter->second.camera_intrinsics = glm::mat3(1.f);
-            insert_iter->second.camera_intrinsics[0][0] = focal_length;
-            insert_iter->second.camera_intrinsics[1][1] = focal_length;
+            auto& [info, key] = detected[i];
+            info->feature_points = std::move(features[i]);
+            info->descriptors = descriptors[i];
+            // Resident descriptors are only read back for the feature cache, and dropped again once they are stored.
+            if (_feature_cache.directory().empty())
+                continue;
+            const bool resident = info->descriptors.id != 0;
+            if (resident)
+                sift::download_descriptors(*_sift_cache, info->descriptors, info->feature_points);
+            _feature_cache.store(key, info->feature_points);
+            if (resident)
+                info->feature_points.drop_descriptors();
         }
     }
 
     void photogrammetry_processor::match_all()
     {
         for (auto& i : _images)
+        {
             _image_matches[i.first];
+            // Features loaded from the feature cache are matched on the GPU as well, once there are resident descriptors.
+            if (_sift_cache && i.second.descriptors.id == 0)
+                i.second.descriptors = sift::upload_descriptors(*_sift_cache, i.second.feature_points);
+        }
 
         std::for_each(_images.begin(), _images.end(), [&](const std::pair<std::shared_ptr<image>, image_info>& a) {
             std::for_each(std::next(_images.find(a.first)), _images.end(), [&](const std::pair<std::shared_ptr<image>, image_info>& b) {
-                const auto matches = sift::match_features(a.second.feature_points, b.second.feature_points, _match_settings);
+                const bool resident = a.second.descriptors.id != 0 && b.second.descriptors.id != 0;
+                const auto matches = resident
+                    ? sift::match_features(*_sift_cache, a.second.descriptors, b.second.descriptors, _match_settings)
+                    : sift::match_features(a.second.feature_points, b.second.feature_points, _match_settings);
                 spdlog::info("{} matches.", matches.size());
                 if (matches.size() >= 8)
                 {
                     auto& insert = _image_matches[a.first][b.first];
-                    insert.match_points = sift::corresponding_points(matches);
+                    insert.match_points = sift::corresponding_points(matches, a.second.feature_points, b.second.feature_points);
                     insert.fundamental_matrix = ransac_fundamental(insert.match_points);
                 }
                 });
@@ -154,92 +251,84 @@ namespace mpp
         _worker = std::thread([this, prom = std::move(p)]() mutable {
             std::unique_lock<std::mutex> lock(_proc_mtx);
 
+#ifdef MPP_HAS_EGL_CONTEXT
+            egl_context headless;
+#endif
 #ifdef __ANDROID__
-            EGLDisplay display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
-            int vmaj, vmin;
-            eglInitialize(display, &vmaj, &vmin);
-            // Step 3 - Make OpenGL ES the current API.
-            eglBindAPI(EGL_OPENGL_ES_API);
-
-            const EGLint attrib_list[] = {
-                // this specifically requests an Open GL ES 2 renderer
-                EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
-                // (ommiting other configs regarding the color channels etc...
-                EGL_NONE
-            };
-
-            EGLConfig config;
-            EGLint num_configs;
-            eglChooseConfig(display, attrib_list, &config, 1, &num_configs);
-
-            // ommiting other codes
-
-            const EGLint context_attrib_list[] = {
-                // request a context using Open GL ES 2.0
-                EGL_CONTEXT_CLIENT_VERSION, 3,
-                EGL_NONE
-            };
-            EGLContext context = eglCreateContext(display, config, NULL, context_attrib_list);
-
-            // Step 8 - Bind the context to the current thread
-            eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
-            mygl::load(reinterpret_cast<mygl::loader_function>(eglGetProcAddress));
+            const bool has_context = headless.create();
+            if (has_context)
+            {
+                mygl::load(reinterpret_cast<mygl::loader_function>(&egl_context::get_proc_address));
+                load_timer_query_extension(&egl_context::get_proc_address);
+            }
             std::string tag = "spdlog-android";
             auto android_logger = spdlog::android_logger_mt("android", tag);
             spdlog::set_default_logger(android_logger);
 #else
-            glfwDefaultWindowHints();
-            glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, true);
-            glfwWindowHint(GLFW_CLIENT_API, GLFW_OPENGL_ES_API);
-            glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-            glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
-            //glfwWindowHint(GLFW_VISIBLE, false);
-            const auto w = glfwCreateWindow(1, 1, "_", nullptr, nullptr);
-            glfwMakeContextCurrent(w);
-            glfwHideWindow(w);
-            mygl::load(reinterpret_cast<mygl::loader_function>(glfwGetProcAddress));
+            GLFWwindow* w = has_display() ? create_hidden_window() : nullptr;
+            bool has_context = w != nullptr;
+            if (has_context)
+            {
+                mygl::load(reinterpret_cast<mygl::loader_function>(glfwGetProcAddress));
+                load_timer_query_extension(reinterpret_cast<mygl::loader_function>(glfwGetProcAddress));
+            }
+#ifdef MPP_HAS_EGL_CONTEXT
+            // No display server or no window could be created, try a headless context instead.
+            if (!has_context && (has_context = headless.create()))
+            {
+                mygl::load(reinterpret_cast<mygl::loader_function>(&egl_context::get_proc_address));
+                load_timer_query_extension(&egl_context::get_proc_address);
+            }
+#endif
 #endif
-
-            glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
-            glDebugMessageCallback([](GLenum source, GLenum type, std::uint32_t id, GLenum severity, std::int32_t length, const char* message, const void* userParam) {
-                switch (type)
-                {
-                case GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR:
-                    spdlog::warn("OpenGL Deprecated: {}", message);
-                    break;
-                case GL_DEBUG_TYPE_ERROR:
-                    spdlog::error("OpenGL Error: {}", message);
-                    break;
-                case GL_DEBUG_TYPE_MARKER:
-                    spdlog::info("OpenGL Marker: {}", message);
-                    break;
-                case GL_DEBUG_TYPE_OTHER:
-                    spdlog::debug("OpenGL Other: {}", message);
-                    break;
-                case GL_DEBUG_TYPE_PERFORMANCE:
-                    spdlog::warn("OpenGL Performance: {}", message);
-                    break;
-                case GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR:
-                    spdlog::warn("OpenGL Undefined Behavior: {}", message);
-                    break;
-                case GL_DEBUG_TYPE_PORTABILITY:
-                    spdlog::warn("OpenGL Portability: {}", message);
-                    break;
-                case GL_DEBUG_TYPE_PUSH_GROUP:
-                    spdlog::debug("OpenGL Push Group: {}", message);
-                    break;
-                case GL_DEBUG_TYPE_POP_GROUP:
-                    spdlog::debug("OpenGL Push Group: {}", message);
-                    break;
-                }
-                }, nullptr);
-            glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, nullptr, GL_FALSE);
-            glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_NOTIFICATION, 0, nullptr, GL_FALSE);
-            glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_LOW, 0, nullptr, GL_FALSE);
-            glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_MEDIUM, 0, nullptr, GL_TRUE);
-            glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_HIGH, 0, nullptr, GL_TRUE);
 
             _processor = std::make_unique<photogrammetry_processor>();
+            if (!has_context)
+            {
+                spdlog::warn("No OpenGL context available, falling back to CPU feature detection.");
+                _processor->detection_settings().backend = sift::detection_backend::cpu;
+            }
+            else
+            {
+                glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+                glDebugMessageCallback([](GLenum source, GLenum type, std::uint32_t id, GLenum severity, std::int32_t length, const char* message, const void* userParam) {
+                    switch (type)
+                    {
+                    case GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR:
+                        spdlog::warn("OpenGL Deprecated: {}", message);
+                        break;
+                    case GL_DEBUG_TYPE_ERROR:
+                        spdlog::error("OpenGL Error: {}", message);
+                        break;
+                    case GL_DEBUG_TYPE_MARKER:
+                        spdlog::info("OpenGL Marker: {}", message);
+                        break;
+                    case GL_DEBUG_TYPE_OTHER:
+                        spdlog::debug("OpenGL Other: {}", message);
+                        break;
+                    case GL_DEBUG_TYPE_PERFORMANCE:
+                        spdlog::warn("OpenGL Performance: {}", message);
+                        break;
+                    case GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR:
+                        spdlog::warn("OpenGL Undefined Behavior: {}", message);
+                        break;
+                    case GL_DEBUG_TYPE_PORTABILITY:
+                        spdlog::warn("OpenGL Portability: {}", message);
+                        break;
+                    case GL_DEBUG_TYPE_PUSH_GROUP:
+                        spdlog::debug("OpenGL Push Group: {}", message);
+                        break;
+                    case GL_DEBUG_TYPE_POP_GROUP:
+                        spdlog::debug("OpenGL Push Group: {}", message);
+                        break;
+                    }
+                    }, nullptr);
+                glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, nullptr, GL_FALSE);
+                glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_NOTIFICATION, 0, nullptr, GL_FALSE);
+                glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_LOW, 0, nullptr, GL_FALSE);
+                glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_MEDIUM, 0, nullptr, GL_TRUE);
+                glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_HIGH, 0, nullptr, GL_TRUE);
+            }
             prom.set_value();
             while (!_quit)
             {
@@ -251,10 +340,9 @@ namespace mpp
             }
             _processor.reset();
 
-#ifdef __ANDROID__
-            eglDestroyContext(display, context);
-#else
-            glfwDestroyWindow(w);
+#ifndef __ANDROID__
+            if (w)
+                glfwDestroyWindow(w);
 #endif
         });
 
@@ -283,11 +371,12 @@ namespace mpp
     {
         std::unique_lock<std::mutex> lock(_proc_mtx);
         _work_items.emplace_back([this, elem = std::exchange(_enqueued, {})]{
+            std::vector<std::pair<std::shared_ptr<image>, float>> images;
+            for (auto const& it : elem)
+                images.emplace_back(std::get<std::shared_ptr<image>>(it), std::get<float>(it));
+            _processor->add_images(images);
             for (auto const& it : elem)
-            {
-                _processor->add_image(std::get < std::shared_ptr<image>>(it), std::get<float>(it));
                 std::get<std::function<void()>>(it)();
-            }
             });
         _proc_wakeup.notify_one();
     }
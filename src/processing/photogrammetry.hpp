@@ -1,6 +1,7 @@
 #pragma once
 #include <processing/image.hpp>
 #include <processing/sift/sift.hpp>
+#include <processing/sift/feature_cache.hpp>
 #include <glm/glm.hpp>
 #include <unordered_set>
 #include <unordered_map>
@@ -26,12 +27,16 @@ namespace mpp
         
         void clear();
         void add_image(std::shared_ptr<image> img, float focal_length);
+        // Same as add_image for each image and focal length, but detects the features of all of them in one batch.
+        void add_images(const std::vector<std::pair<std::shared_ptr<image>, float>>& images);
         void match_all();
 
         sift::detection_settings& detection_settings() noexcept { return _detection_settings; }
         sift::match_settings& match_settings() noexcept { return _match_settings; }
+        // Images which were detected before with the same settings load their features from here instead.
+        sift::feature_cache& feature_cache() noexcept { return _feature_cache; }
 
-        const std::vector<sift::feature>& feature_points(const std::shared_ptr<image>& a)
+        const sift::compact_feature_set& feature_points(const std::shared_ptr<image>& a)
         {
             return _images[a].feature_points;
         }
@@ -84,10 +89,14 @@ namespace mpp
         sift::detection_settings _detection_settings;
         sift::match_settings _match_settings;
         std::shared_ptr<sift::sift_cache> _sift_cache;
+        sift::feature_cache _feature_cache;
 
         struct image_info
         {
-            std::vector<sift::feature> feature_points;
+            // Without descriptors if they are resident.
+            sift::compact_feature_set feature_points;
+            // Set for all images once there is a _sift_cache, they are matched on the GPU then.
+            sift::resident_descriptors descriptors;
             glm::mat3 camera_intrinsics;
         };
         std::unordered_map<std::shared_ptr<image>, image_info> _images;
@@ -0,0 +1,173 @@
+#include <processing/sift/adaptive_detector.hpp>
+#include <processing/image.hpp>
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <cmath>
+
+namespace mpp::sift
+{
+    namespace
+    {
+        // Weight of the newest measurement in the smoothed values.
+        constexpr double smoothing = 0.3;
+        constexpr float threshold_step = 1.25f;
+        // Expected latency growth of one step back up: a resolution step grows the area by sqrt(2),
+        // an octave adds at most a third of the area of the finest level.
+        constexpr double resolution_growth = 1.41421356237;
+        constexpr double octave_growth = 1.34;
+
+        double resolution_of(int level)
+        {
+            return std::exp2(-level / 4.0);
+        }
+    }
+
+    adaptive_detector::adaptive_detector(const detection_settings& settings, const adaptive_settings& adaptive)
+        : _base(settings), _adaptive(adaptive), _settings(settings)
+    {
+        _adaptive.min_octaves = std::clamp<size_t>(adaptive.min_octaves, 1, settings.octaves);
+        _caches.resize(settings.octaves - _adaptive.min_octaves + 1);
+        _max_resolution_level = std::max(int(std::floor(-4.0 * std::log2(std::clamp(adaptive.min_resolution, 0.01f, 1.f)) + 1e-6)), 0);
+        _settings.orientation_magnitude_threshold = std::clamp(settings.orientation_magnitude_threshold,
+            adaptive.min_magnitude_threshold, adaptive.max_magnitude_threshold);
+    }
+
+    float adaptive_detector::resolution() const noexcept
+    {
+        return float(resolution_of(_resolution_level));
+    }
+
+    std::vector<feature> adaptive_detector::detect(const image& img, dst_system system, detection_timings* timings)
+    {
+        const auto begin = std::chrono::steady_clock::now();
+        image scaled;
+        const image* source = &img;
+        if (_resolution_level > 0)
+        {
+            const glm::vec2 size = glm::vec2(img.dimensions()) * resolution();
+            scaled = img;
+            scaled.resize(std::max(int(size.x), 1), std::max(int(size.y), 1));
+            source = &scaled;
+        }
+
+        detection_timings local_timings;
+        std::vector<feature> features;
+        if (_settings.backend == detection_backend::cpu)
+        {
+            features = detect_features(*source, _settings, system, &local_timings);
+        }
+        else
+        {
+            // Caches are created for a fixed number of octaves.
+            auto& cache = _caches[_settings.octaves - _adaptive.min_octaves];
+            if (!cache)
+                cache = create_cache(_settings.octaves, _settings.feature_scales);
+            features = detect_features(*cache, *source, _settings, system, &local_timings);
+        }
+
+        if (source != &img)
+        {
+            // Image and normalized coordinates don't depend on the resolution, only pixel positions and scales do.
+            const glm::vec2 factor = glm::vec2(img.dimensions()) / glm::vec2(source->dimensions());
+            for (auto& feat : features)
+            {
+                if (system == dst_system::pixel_coordinates)
+                {
+                    feat.x *= factor.x;
+                    feat.y *= factor.y;
+                }
+                feat.scale *= factor.x;
+            }
+        }
+
+        update(std::chrono::steady_clock::now() - begin, local_timings, features.size());
+        if (timings)
+            *timings = local_timings;
+        return features;
+    }
+
+    void adaptive_detector::update(std::chrono::nanoseconds latency, const detection_timings& timings, size_t feature_count)
+    {
+        // Share of the stages which scale with the number of features instead of the image area. Without stage timings
+        // the last known share is kept, which makes the resolution the first thing to reduce.
+        double per_feature_share = _per_feature_share;
+        if (timings.valid && timings.gpu_total().count() > 0)
+        {
+            const auto per_feature = timings.filter + timings.orientation + timings.selection + timings.descriptor;
+            per_feature_share = double(per_feature.count()) / double(timings.gpu_total().count());
+        }
+
+        // The first measurement after a change starts over, the older ones were taken with other settings.
+        const double weight = _samples == 0 ? 1.0 : smoothing;
+        _latency += weight * (double(latency.count()) - _latency);
+        _feature_count += weight * (double(feature_count) - _feature_count);
+        _per_feature_share += weight * (per_feature_share - _per_feature_share);
+        if (++_samples < _adaptive.settle_detections)
+            return;
+
+        const double target = double(std::chrono::nanoseconds(_adaptive.target_latency).count());
+        const double hysteresis = _adaptive.hysteresis;
+        bool changed = false;
+        if (_latency > target * (1.0 + hysteresis))
+            changed = reduce_cost();
+        else if (_feature_count > _adaptive.max_features * (1.0 + hysteresis))
+            changed = scale_threshold(threshold_step);
+        else if (_feature_count < _adaptive.min_features * (1.0 - hysteresis))
+            changed = scale_threshold(1.f / threshold_step) || increase_quality();
+        else if (_latency < target * (1.0 - hysteresis))
+            changed = increase_quality();
+
+        if (changed)
+        {
+            spdlog::info("Adaptive SIFT: {:.2f} resolution, {} octaves, {} threshold after {} us and {:.0f} features.", resolution(),
+                _settings.octaves, _settings.orientation_magnitude_threshold, std::int64_t(_latency / 1000.0), _feature_count);
+            _samples = 0;
+        }
+    }
+
+    bool adaptive_detector::reduce_cost()
+    {
+        // When the per-feature stages dominate, fewer features are the cheapest fix, as long as enough of them are left.
+        if (_per_feature_share > 0.5 && _feature_count > _adaptive.min_features && scale_threshold(threshold_step))
+            return true;
+        if (_resolution_level < _max_resolution_level)
+        {
+            ++_resolution_level;
+            return true;
+        }
+        if (_settings.octaves > _adaptive.min_octaves)
+        {
+            --_settings.octaves;
+            return true;
+        }
+        return scale_threshold(threshold_step);
+    }
+
+    bool adaptive_detector::increase_quality()
+    {
+        // Undoes reduce_cost in reverse order, but only if the predicted latency stays below the target.
+        // Otherwise the next detection would reduce the cost again right away.
+        const double target = double(std::chrono::nanoseconds(_adaptive.target_latency).count());
+        if (_settings.octaves < _base.octaves && _latency * octave_growth < target)
+        {
+            ++_settings.octaves;
+            return true;
+        }
+        if (_resolution_level > 0 && _latency * resolution_growth < target)
+        {
+            --_resolution_level;
+            return true;
+        }
+        return false;
+    }
+
+    bool adaptive_detector::scale_threshold(float factor)
+    {
+        const float threshold = std::clamp(_settings.orientation_magnitude_threshold * factor,
+            _adaptive.min_magnitude_threshold, _adaptive.max_magnitude_threshold);
+        if (threshold == _settings.orientation_magnitude_threshold)
+            return false;
+        _settings.orientation_magnitude_threshold = threshold;
+        return true;
+    }
+}
\ No newline at end of file
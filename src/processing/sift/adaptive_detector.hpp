@@ -0,0 +1,66 @@
+#pragma once
+
+#include <processing/sift/sift.hpp>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+namespace mpp::sift
+{
+    // Targets of an adaptive_detector. Measurements only cause a change once they leave the target by more than the
+    // hysteresis, and each change is measured for settle_detections before the next one, so the settings don't oscillate.
+    struct adaptive_settings
+    {
+        std::chrono::microseconds target_latency{ 33'000 }; // per detection, including the readback
+        size_t min_features = 300;
+        size_t max_features = 1500;
+        float hysteresis = 0.15f; // relative to the latency target and the feature window
+        int settle_detections = 2;
+
+        // Resolution steps by a factor of 2^(-1/4), down to this fraction of the image size.
+        float min_resolution = 0.25f;
+        size_t min_octaves = 2; // the detection_settings passed to the detector are the maximum
+        float min_magnitude_threshold = 0.00005f;
+        float max_magnitude_threshold = 0.002f;
+    };
+
+    // Detects features under a latency budget, e.g. for every frame of a camera. After each detection, the resolution,
+    // octave count and orientation magnitude threshold for the next one are adjusted from the measured latency, the stage
+    // timings and the number of features. Must be used on the thread of the OpenGL context, like a sift_cache.
+    class adaptive_detector
+    {
+    public:
+        adaptive_detector(const detection_settings& settings, const adaptive_settings& adaptive);
+
+        // Features are in the given system of the original image, also if it was detected at a lower resolution.
+        std::vector<feature> detect(const image& img, dst_system system = dst_system::pixel_coordinates, detection_timings* timings = nullptr);
+        // Feeds the measurements of one detection into the controller. Called by detect, public for detections run elsewhere
+        // with current_settings and resolution.
+        void update(std::chrono::nanoseconds latency, const detection_timings& timings, size_t feature_count);
+
+        const detection_settings& current_settings() const noexcept { return _settings; }
+        float resolution() const noexcept;
+        // Smoothed measurements the last decision was based on.
+        std::chrono::nanoseconds latency() const noexcept { return std::chrono::nanoseconds(std::int64_t(_latency)); }
+        double feature_count() const noexcept { return _feature_count; }
+
+    private:
+        bool reduce_cost();
+        bool increase_quality();
+        bool scale_threshold(float factor);
+
+        detection_settings _base;
+        adaptive_settings _adaptive;
+        detection_settings _settings;
+        int _resolution_level = 0; // resolution is 2^(-level/4)
+        int _max_resolution_level;
+        // One for each octave count between min_octaves and the one of _base, created on first use and kept, so
+        // stepping the octaves back and forth does not compile the programs and allocate the textures again.
+        std::vector<std::shared_ptr<sift_cache>> _caches;
+
+        int _samples = 0; // measured since the last change
+        double _latency = 0.0; // in nanoseconds
+        double _feature_count = 0.0;
+        double _per_feature_share = 0.0;
+    };
+}
\ No newline at end of file
@@ -0,0 +1,54 @@
+#include <processing/sift/detail/binary_descriptor.hpp>
+#include <limits>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__)) && !defined(__POPCNT__)
+#define MPP_POPCNT_DISPATCH 1
+#endif
+
+namespace mpp::sift::detail
+{
+    namespace
+    {
+        // Inlined into each variant below, so popcount is compiled with the instruction set of the variant.
+#if defined(__GNUC__) || defined(__clang__)
+        __attribute__((always_inline))
+#endif
+        inline hamming_neighbours nearest_hamming_neighbours_impl(const std::uint32_t* a, const std::uint32_t* b, size_t count, size_t stride)
+        {
+            hamming_neighbours result{ std::numeric_limits<int>::max(), std::numeric_limits<int>::max(), 0 };
+            for (size_t k = 0; k < count; ++k)
+            {
+                const int distance = hamming_distance(a, b + k * stride);
+                if (distance < result.best)
+                {
+                    result.second = result.best;
+                    result.best = distance;
+                    result.best_index = k;
+                }
+                else if (distance < result.second)
+                {
+                    result.second = distance;
+                }
+            }
+            return result;
+        }
+
+#if defined(MPP_POPCNT_DISPATCH)
+        __attribute__((target("popcnt")))
+        hamming_neighbours nearest_hamming_neighbours_popcnt(const std::uint32_t* a, const std::uint32_t* b, size_t count, size_t stride)
+        {
+            return nearest_hamming_neighbours_impl(a, b, count, stride);
+        }
+#endif
+    }
+
+    hamming_neighbours nearest_hamming_neighbours(const std::uint32_t* a, const std::uint32_t* b, size_t count, size_t stride)
+    {
+#if defined(MPP_POPCNT_DISPATCH)
+        static const bool has_popcnt = __builtin_cpu_supports("popcnt");
+        if (has_popcnt)
+            return nearest_hamming_neighbours_popcnt(a, b, count, stride);
+#endif
+        return nearest_hamming_neighbours_impl(a, b, count, stride);
+    }
+}
\ No newline at end of file
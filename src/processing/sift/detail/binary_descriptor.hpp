@@ -0,0 +1,98 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <random>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace mpp::sift::detail
+{
+    constexpr int binary_descriptor_bits = 256;
+    // Sample points are drawn from a gaussian with this deviation and clamped to the radius, in texels of the feature octave.
+    constexpr float binary_pattern_sigma = 5.f;
+    constexpr float binary_pattern_radius = 12.f;
+
+    // Point pairs of the binary descriptor, xy and zw are compared. Each bit is set if the gaussian level at xy
+    // is darker than at zw, after rotating both points with the feature. Must be the same for all platforms,
+    // so it is built from mt19937 (which is fully specified) instead of std::normal_distribution (which is not).
+    inline const std::array<glm::vec4, binary_descriptor_bits>& binary_pattern()
+    {
+        static const auto pattern = [] {
+            std::mt19937 rng(0x5eed);
+            const auto uniform = [&] { return (double(rng()) + 0.5) / 4294967296.0; };
+            // Box-Muller. The random numbers are drawn in separate statements, as the evaluation order of
+            // function arguments differs between compilers.
+            const auto normal = [&] {
+                const double u0 = uniform();
+                const double u1 = uniform();
+                return float(std::sqrt(-2.0 * std::log(u0)) * std::cos(2.0 * 3.14159265358979 * u1));
+            };
+            const auto point = [&] {
+                const float x = normal();
+                const float y = normal();
+                const auto p = glm::vec2(x, y) * binary_pattern_sigma;
+                return glm::clamp(p, glm::vec2(-binary_pattern_radius), glm::vec2(binary_pattern_radius));
+            };
+
+            std::array<glm::vec4, binary_descriptor_bits> result;
+            for (auto& pair : result)
+            {
+                const auto p = point();
+                const auto q = point();
+                pair = glm::vec4(p, q);
+            }
+            return result;
+        }();
+        return pattern;
+    }
+
+    // Direction the pattern is rotated to. Orientations are stored as atan(x, y) of the dominant gradient, see orientation_comp.
+    inline float binary_pattern_angle(float orientation)
+    {
+        return 0.5f * 3.141592653587f - orientation;
+    }
+
+    // Without -mpopcnt, GCC and Clang compile __builtin_popcountll on x86 to a call of the bit twiddling __popcountdi2.
+    // The matcher is therefore also built with the popcnt instruction and picks it at runtime, see nearest_hamming_neighbours.
+    // MSVC always emits popcnt for __popcnt64, so it requires a CPU which has it.
+    inline int popcount(std::uint64_t value)
+    {
+#if defined(_MSC_VER) && defined(_M_X64)
+        return int(__popcnt64(value));
+#elif defined(__GNUC__) || defined(__clang__)
+        return __builtin_popcountll(value);
+#else
+        value = value - ((value >> 1) & 0x5555555555555555ull);
+        value = (value & 0x3333333333333333ull) + ((value >> 2) & 0x3333333333333333ull);
+        value = (value + (value >> 4)) & 0x0f0f0f0f0f0f0f0full;
+        return int((value * 0x0101010101010101ull) >> 56);
+#endif
+    }
+
+    // Number of differing bits of two 256-bit descriptors, as four 64-bit popcounts.
+    inline int hamming_distance(const std::uint32_t* a, const std::uint32_t* b)
+    {
+        std::uint64_t wa[4];
+        std::uint64_t wb[4];
+        std::memcpy(wa, a, sizeof(wa));
+        std::memcpy(wb, b, sizeof(wb));
+        return popcount(wa[0] ^ wb[0]) + popcount(wa[1] ^ wb[1]) + popcount(wa[2] ^ wb[2]) + popcount(wa[3] ^ wb[3]);
+    }
+
+    struct hamming_neighbours
+    {
+        int best;
+        int second;
+        size_t best_index;
+    };
+
+    // Both nearest neighbours of the descriptor a among count descriptors, the i-th of which starts at b + i * stride.
+    // Distances of an empty or single descriptor set are std::numeric_limits<int>::max().
+    hamming_neighbours nearest_hamming_neighbours(const std::uint32_t* a, const std::uint32_t* b, size_t count, size_t stride);
+}
\ No newline at end of file
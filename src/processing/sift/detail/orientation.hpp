@@ -0,0 +1,16 @@
+#pragma once
+
+#include <processing/sift/sift.hpp>
+#include <algorithm>
+
+namespace mpp::sift::detail
+{
+    // Largest number of orientation histogram bins, one per degree.
+    constexpr int max_orientation_slices = 360;
+
+    // Number of orientation histogram bins, see orientation_comp.
+    inline int orientation_slices(const detection_settings& settings)
+    {
+        return std::clamp(settings.orientation_slices, 1, max_orientation_slices);
+    }
+}
\ No newline at end of file
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+namespace mpp::sift::detail
+{
+    // Largest kernel radius the tiled blur in gauss_blur_comp can hold in shared memory.
+    constexpr int max_blur_radius = 63;
+    // Largest sigma whose kernel, cut off at 4 sigma, fits into max_blur_radius.
+    constexpr float max_blur_sigma = max_blur_radius / 4.f;
+
+    // Absolute blur of a gaussian scale level relative to the original image.
+    inline float scale_sigma(int scale)
+    {
+        return std::pow(std::sqrt(2.f), float(scale + 1)) * 1.3f;
+    }
+
+    // Blur applied to the previous level to get the given one, level 0 is blurred from the original image.
+    // Gaussians compose by adding their variances.
+    inline float incremental_sigma(int scale)
+    {
+        if (scale == 0)
+            return scale_sigma(0);
+        const float current = scale_sigma(scale);
+        const float previous = scale_sigma(scale - 1);
+        return std::sqrt(current * current - previous * previous);
+    }
+
+    // A blur wider than max_blur_sigma is split into passes of equal sigma, n gaussians of sigma / sqrt(n) compose to sigma.
+    // From the ninth gaussian level on, i.e. six or more feature scales, the incremental sigma needs more than one pass.
+    inline int blur_passes(float sigma)
+    {
+        return std::max(1, int(std::ceil(sigma * sigma / (max_blur_sigma * max_blur_sigma))));
+    }
+
+    // One side of a normalized gaussian kernel cut off at 4 sigma. kernel[0] is the center tap,
+    // kernel[i] is applied to the texels at -i and +i. The radius only reaches max_blur_radius by rounding, see blur_passes.
+    inline std::vector<float> gaussian_kernel(float sigma)
+    {
+        const int radius = std::clamp(int(std::ceil(4.f * sigma)), 1, max_blur_radius);
+        std::vector<float> kernel(size_t(radius) + 1);
+        float sum = 0.f;
+        for (int i = 0; i <= radius; ++i)
+        {
+            kernel[i] = std::exp(-float(i * i) / (2.f * sigma * sigma));
+            sum += i == 0 ? kernel[i] : 2.f * kernel[i];
+        }
+        for (auto& w : kernel)
+            w /= sum;
+        return kernel;
+    }
+
+    // Blur from the previous gaussian level to the given one, as a kernel applied in level_blur_passes passes.
+    inline int level_blur_passes(int scale)
+    {
+        return blur_passes(incremental_sigma(scale));
+    }
+    inline std::vector<float> level_blur_kernel(int scale)
+    {
+        return gaussian_kernel(incremental_sigma(scale) / std::sqrt(float(level_blur_passes(scale))));
+    }
+
+    // How far the blur of the last gaussian level reaches into the original image, in pixels.
+    inline int blur_extent(size_t num_gaussian_levels)
+    {
+        int extent = 0;
+        for (size_t scale = 0; scale < num_gaussian_levels; ++scale)
+            extent += (int(level_blur_kernel(int(scale)).size()) - 1) * level_blur_passes(int(scale));
+        return extent;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <processing/sift/sift.hpp>
+#include <cmath>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace mpp::sift::detail
+{
+    // Responses are ranked in histogram bins of a quarter octave each, see select_histogram_comp.
+    constexpr int selection_bins = 64;
+    // Largest number of buckets per image side.
+    constexpr int max_selection_grid = 32;
+    // Size of bucket_t in the select shaders: the histogram, threshold, threshold_quota, threshold_taken and total.
+    constexpr size_t selection_bucket_size = (selection_bins + 4) * sizeof(std::uint32_t);
+
+    // Must match response_bin in the select shaders.
+    inline int response_bin(float response)
+    {
+        return std::clamp(int((std::log2(std::max(response, 1e-8f)) + 16.f) * 4.f), 0, selection_bins - 1);
+    }
+
+    // Number of buckets per image side. There are never more buckets than features in the budget, so each
+    // bucket can keep at least one.
+    inline int selection_grid(const detection_settings& settings)
+    {
+        const int max_grid = std::max(int(std::sqrt(float(settings.max_features))), 1);
+        return std::clamp(settings.selection_grid, 1, std::min(max_grid, max_selection_grid));
+    }
+
+    // Largest number of features each bucket may keep, so that all buckets together keep at most max_features.
+    // Buckets with fewer features keep all of them and leave their share to the others.
+    inline std::uint32_t bucket_quota(const std::vector<std::uint32_t>& bucket_sizes, size_t max_features)
+    {
+        const auto max = std::uint32_t(max_features);
+        std::uint32_t low = 0;
+        std::uint32_t high = max;
+        while (low < high)
+        {
+            const std::uint32_t mid = (low + high + 1) / 2;
+            std::uint32_t sum = 0;
+            for (const auto size : bucket_sizes)
+                sum += std::min(size, mid);
+            if (sum <= max)
+                low = mid;
+            else
+                high = mid - 1;
+        }
+        return low;
+    }
+}
\ No newline at end of file
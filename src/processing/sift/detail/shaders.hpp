@@ -13,42 +13,81 @@ void main()
     vs_uv = ((gl_Position.xy+1.0f)*0.5f);
 }
 )";
-    constexpr auto gauss_blur_frag = R"(#version 320 es
+    constexpr auto luminance_frag = R"(#version 320 es
 #ifdef GL_ES
     precision highp float;
 #endif
 in vec2 vs_uv;
-uniform int u_mip;
-uniform int u_dir;
-uniform float u_sigma;
-uniform sampler2D in_texture;
+uniform sampler2D u_source;
+uniform vec3 u_weights;
 layout(location = 0) out vec4 out_color;
 
-float gaussian(float sigma, float diff)
+void main()
 {
-    const float sqrt_2_pi = 2.50662827463f;
-    float inner = diff/sigma;
-    float nom = exp(-(inner * inner / 2.f));
-    return nom / (sigma * sqrt_2_pi);
+    // Normalized 8-bit source, so the values are already in [0, 1].
+    vec3 color = texelFetch(u_source, ivec2(gl_FragCoord.xy), 0).rgb;
+    out_color = vec4(dot(color, u_weights));
+}
+)";
+    constexpr auto gauss_blur_comp = R"(#version 320 es
+#ifdef GL_ES
+    precision highp float;
+    precision highp image2D;
+#endif
+// MAX_RADIUS must match max_blur_radius in scale_space.hpp
+#define MAX_RADIUS 63
+#define TILE_SIZE 256
+layout(local_size_x = TILE_SIZE) in;
+
+// Normalized weights, see gaussian_kernel in scale_space.hpp. u_weights[i/4][i%4] is the weight of the taps at -i and +i.
+layout(std140, binding = 0) uniform GaussKernel
+{
+    vec4 u_weights[(MAX_RADIUS + 4) / 4];
+};
+uniform int u_radius;
+uniform int u_dir;
+uniform highp sampler2DArray u_input;
+uniform int u_input_layer;
+layout(r32f, binding = 0) writeonly uniform image2D u_output;
+
+shared float tile[TILE_SIZE + 2 * MAX_RADIUS];
+
+float weight(int i)
+{
+    return u_weights[i >> 2][i & 3];
+}
+
+ivec2 texel(int along, int line)
+{
+    return u_dir == 0 ? ivec2(along, line) : ivec2(line, along);
 }
 
 void main()
 {
-    ivec2 uv = ivec2(gl_FragCoord.xy);
-    float gval = gaussian(u_sigma, 0.f);
-    vec4 color = gval * texelFetch(in_texture, uv, u_mip);
-    ivec2 off = ivec2(0, 0);
-    ivec2 tsize = ivec2(textureSize(in_texture, u_mip).xy);
-    for(int i=1; i<int(6.f*u_sigma); ++i)
+    // Each work group blurs one segment of TILE_SIZE texels in a row (u_dir == 0) or column (u_dir == 1).
+    ivec2 size = textureSize(u_input, 0).xy;
+    int length = size[u_dir];
+    int line = int(gl_WorkGroupID.y);
+    int tile_start = int(gl_WorkGroupID.x) * TILE_SIZE;
+
+    // Load the segment and its apron once, addresses wrap around at the image borders.
+    for (int i = int(gl_LocalInvocationID.x); i < TILE_SIZE + 2 * u_radius; i += TILE_SIZE)
     {
-        off[u_dir] = i;
-        ivec2 pos_uv = ivec2(mod(vec2(uv + off), vec2(tsize)));
-        ivec2 neg_uv = ivec2(mod(vec2(uv + tsize - off), vec2(tsize)));
-        gval = gaussian(u_sigma, float(i));
-        color += gval * (texelFetch(in_texture, pos_uv, u_mip) 
-            + texelFetch(in_texture, neg_uv, u_mip));
+        int along = tile_start + i - u_radius;
+        along = ((along % length) + length) % length;
+        tile[i] = texelFetch(u_input, ivec3(texel(along, line), u_input_layer), 0).r;
     }
-    out_color = color;
+    barrier();
+
+    int along = tile_start + int(gl_LocalInvocationID.x);
+    if (along >= length)
+        return;
+
+    int center = int(gl_LocalInvocationID.x) + u_radius;
+    float color = weight(0) * tile[center];
+    for (int i = 1; i <= u_radius; ++i)
+        color += weight(i) * (tile[center + i] + tile[center - i]);
+    imageStore(u_output, texel(along, line), vec4(color));
 }
 )";
     constexpr auto difference_frag = R"(#version 320 es
@@ -56,51 +95,64 @@ void main()
     precision highp float;
 #endif
 in vec2 vs_uv;
-uniform sampler2D u_current_tex;
-uniform sampler2D u_previous_tex;
+uniform highp sampler2DArray u_gaussians;
+// Difference-of-gaussian level u_scale is computed from gaussian levels u_scale and u_scale + 1.
+uniform int u_scale;
 layout(location = 0) out vec4 color;
 void main()
 {
     ivec2 px = ivec2(gl_FragCoord.xy);
-    color = abs(texelFetch(u_current_tex, px, 0) - texelFetch(u_previous_tex, px, 0));
+    color = abs(texelFetch(u_gaussians, ivec3(px, u_scale + 1), 0) - texelFetch(u_gaussians, ivec3(px, u_scale), 0));
 }
 )";
-    constexpr auto orientation_vert = R"(#version 320 es
+    constexpr auto gradient_frag = R"(#version 320 es
 #ifdef GL_ES
     precision highp float;
 #endif
-layout(location = 0) in vec4 feature;
-layout(location = 1) in int octave;
+in vec2 vs_uv;
+uniform highp sampler2DArray u_input;
+uniform int u_layer;
+uniform int u_mip;
+layout(location = 0) out vec4 out_gradient;
+const float pi = 3.141592653587;
 
-out vec4 ft_feature;
-flat out ivec2 ft_pixel;
-flat out int ft_scale;
-flat out int ft_octave;
+float fetch(ivec2 px, ivec2 tsize)
+{
+    // Texels outside of the level read as zero.
+    if (any(lessThan(px, ivec2(0))) || any(greaterThanEqual(px, tsize)))
+        return 0.f;
+    return texelFetch(u_input, ivec3(px, u_layer), u_mip).r;
+}
 
 void main()
 {
-    ft_feature = feature;
-    ft_pixel = ivec2(round(feature.xy));
-    ft_scale = int(round(feature.z));
-    ft_octave = octave;
+    ivec2 px = ivec2(gl_FragCoord.xy);
+    ivec2 tsize = textureSize(u_input, u_mip).xy;
+    float xdiff = fetch(px + ivec2(1, 0), tsize) - fetch(px - ivec2(1, 0), tsize);
+    float ydiff = fetch(px + ivec2(0, 1), tsize) - fetch(px - ivec2(0, 1), tsize);
+
+    // Magnitude and direction in [0, 2*pi]
+    out_gradient = vec4(sqrt(xdiff * xdiff + ydiff * ydiff), atan(ydiff, xdiff) + pi, 0, 1);
 }
 )";
     constexpr auto descriptor_comp = R"(#version 320 es
-layout(local_size_x = 32) in;
+// One work group per feature, one invocation per sample of the 16x16 window around it.
+layout(local_size_x = 16, local_size_y = 16) in;
 struct in_feature_t
 {
     float x;
-    float y;   
+    float y;
     float sigma;
     float scale;
     int octave;
     float orientation; // angle in radians
-    vec2 _pad;
+    float response;
+    float _pad;
 };
 struct feature_t
 {
     float x;
-    float y;   
+    float y;
     float sigma;
     float scale;
 
@@ -111,14 +163,43 @@ struct feature_t
     float descriptor[128];
 };
 layout(std430, binding = 0) restrict readonly buffer InFeatures {
+    uvec3 in_num_groups;
+    uint in_count;
     in_feature_t in_features[];
 };
 
-layout(std430, binding = 1) restrict buffer OutFeatures {
+struct compact_feature_t
+{
+    float x;
+    float y;
+    float sigma;
+    float scale;
+
+    int octave;
+    float orientation; // angle in radians
+    vec2 _pad;
+
+    uint descriptor[32]; // 128 bytes, see quantize_descriptor in sift.hpp
+};
+layout(std430, binding = 1) restrict writeonly buffer OutFeatures {
     feature_t out_features[];
 };
-uniform sampler2D u_textures[16];
+// Alternative output for u_compact, the same buffer may be bound to both.
+layout(std430, binding = 2) restrict writeonly buffer OutCompactFeatures {
+    compact_feature_t out_compact_features[];
+};
+uniform bool u_compact;
+// Gradient magnitude and direction of each difference-of-gaussian level, one layer per level, see gradient_frag.
+uniform highp sampler2DArray u_gradients;
 const float pi = 3.141592653587;
+// Largest value of a normalized descriptor entry before normalizing again, reduces the influence of strong gradients.
+const float max_entry = 0.2f;
+
+shared float s_weights[256];
+shared int s_bins[256];
+shared float s_squares[128];
+shared uint s_bytes[128];
+
 float gaussian(float sigma, float diff)
 {
     const float sqrt_2_pi = 2.50662827463f;
@@ -127,89 +208,233 @@ float gaussian(float sigma, float diff)
     return nom / (sigma * sqrt_2_pi);
 }
 
+// Sums up s_squares into s_squares[0]. GLSL ES only allows barrier() directly in main, outside of any control flow.
+#define REDUCE_SQUARES_STEP(stride) if (tid < stride) s_squares[tid] += s_squares[tid + stride]; barrier();
+#define REDUCE_SQUARES() REDUCE_SQUARES_STEP(64u) REDUCE_SQUARES_STEP(32u) REDUCE_SQUARES_STEP(16u) REDUCE_SQUARES_STEP(8u) REDUCE_SQUARES_STEP(4u) REDUCE_SQUARES_STEP(2u) REDUCE_SQUARES_STEP(1u)
+
 void main()
 {
-    if(int(gl_GlobalInvocationID.x) > in_features.length())
-        return;
+    // See orientation_comp for the layout of the indirect dispatch. Work groups without a feature still run
+    // through all barriers, they just don't write anything.
+    uint index = gl_WorkGroupID.x + gl_WorkGroupID.y * 1024u;
+    bool valid = index < min(in_count, uint(in_features.length()));
 
-    int gid = int(gl_GlobalInvocationID.x);
-    in_feature_t ft = in_features[gid];
-    ivec2 px = ivec2(round(ft.x), round(ft.y));
-    int ft_scale = int(round(ft.sigma));
+    in_feature_t ft = in_features[valid ? index : 0u];
     int octave = ft.octave;
-    float orientation = ft.orientation;
-
-    out_features[gid].x = ft.x;
-    out_features[gid].y = ft.y;
-    out_features[gid].sigma = ft.sigma;
-    out_features[gid].scale = ft.scale;
-    out_features[gid].octave = ft.octave;
-    out_features[gid].orientation = ft.orientation;
-    for(int i=0; i < 128; ++i)
-        out_features[gid].descriptor[i] = 0.f;
-
-    // iterate over frames.
-    for (int fy = -2; fy < 2; ++fy)
+    int ft_scale = int(round(ft.sigma));
+    ivec2 px = ivec2(round(ft.x), round(ft.y)) >> octave;
+    uint tid = gl_LocalInvocationIndex;
+
+    // The window consists of 4x4 frames of 4x4 samples each.
+    ivec2 local_px = ivec2(gl_LocalInvocationID.xy);
+    ivec2 frame = local_px / 4;
+    ivec2 element = local_px % 4;
+    ivec2 sample_px = px + local_px - 8;
+    ivec2 tsize = textureSize(u_gradients, octave).xy;
+
+    vec2 gradient = vec2(0);
+    if (valid && all(greaterThanEqual(sample_px, ivec2(0))) && all(lessThan(sample_px, tsize)))
+        gradient = texelFetch(u_gradients, ivec3(sample_px, ft_scale), octave).rg;
+
+    float g = gaussian(2.5f, length(vec2(element) - 1.5f));
+    // compute angle difference to dominant orientation. In range rad[0, 2*pi] (deg[0, 360])
+    float angle_diff = mod((ft.orientation - gradient.y) + 3.f * pi, 2.f * pi);
+    int angle_index = min(int(floor((angle_diff / (2.f * pi)) * 8.f)), 7);
+
+    s_weights[tid] = g * gradient.x;
+    s_bins[tid] = frame.x + frame.y * 4 + angle_index * 4 * 4;
+    barrier();
+
+    // Each of the first 128 invocations sums up one histogram bin over the 16 samples of its frame.
+    float value = 0.f;
+    if (tid < 128u)
     {
-        for (int fx = -2; fx < 2; ++fx)
+        int bin = int(tid);
+        ivec2 frame_origin = ivec2(bin & 3, (bin >> 2) & 3) * 4;
+        for (int e = 0; e < 16; ++e)
         {
-            int fdx = fx * 4;
-            int fdy = fy * 4;
+            uint s = uint(frame_origin.x + (e & 3) + (frame_origin.y + (e >> 2)) * 16);
+            if (s_bins[s] == bin)
+                value += s_weights[s];
+        }
+        s_squares[tid] = value * value;
+    }
+    barrier();
+
+    // Normalize, clamp and normalize again
+    REDUCE_SQUARES()
+    float len = sqrt(s_squares[0]);
+    value = len > 0.f ? min(value / len, max_entry) : 0.f;
+    barrier();
+    if (tid < 128u)
+        s_squares[tid] = value * value;
+    barrier();
+    REDUCE_SQUARES()
+    len = sqrt(s_squares[0]);
+    value = len > 0.f ? value / len : 0.f;
+
+    // Quantized to bytes for u_compact, see quantize_descriptor in sift.hpp
+    if (tid < 128u)
+        s_bytes[tid] = uint(min(int(512.f * value), 255));
+    barrier();
+
+    if (!valid)
+        return;
 
-            // iterate over frame elements
-            for (int ex = 0; ex < 4; ++ex)
-            {
-                for (int ey = 0; ey < 4; ++ey)
-                {
-                    int x = px.x + fdx + ex;
-                    int y = px.y + fdy + ey;
-            
-                    float tpx = texelFetch(u_textures[ft_scale], ivec2(x+1, y), octave).r;
-                    float tnx = texelFetch(u_textures[ft_scale], ivec2(x-1, y), octave).r;
-                    float tpy = texelFetch(u_textures[ft_scale], ivec2(x, y+1), octave).r;
-                    float tny = texelFetch(u_textures[ft_scale], ivec2(x, y-1), octave).r;
-                    float xdiff = tpx - tnx;
-                    float ydiff = tpy - tny;
-
-                    float mag = sqrt(xdiff * xdiff + ydiff * ydiff);
-                    float theta = atan(ydiff, xdiff) + pi; // normalize to [0, 2*PI]
-                    float g = gaussian(2.5f, length(vec2(float(ex) - 1.5f, float(ey) - 1.5f)));
-
-                    // compute angle difference to dominant orientation. In range rad[0, 2*pi] (deg[0, 360])
-                    float angle_diff = mod((orientation - theta) + 3.f * pi, 2.f * pi);
-                    int angle_index = int(floor((angle_diff / (2.f * pi)) * 8.f));
-        
-                    int didx = (fx + 2) + (fy + 2) * 4 + angle_index * 4 * 4;
-                    out_features[gid].descriptor[didx] += g * mag;
-                }
-            }
+    if (u_compact)
+    {
+        // Four bytes per uint, in memory order.
+        if (tid < 32u)
+            out_compact_features[index].descriptor[tid] = s_bytes[4u * tid] | (s_bytes[4u * tid + 1u] << 8)
+                | (s_bytes[4u * tid + 2u] << 16) | (s_bytes[4u * tid + 3u] << 24);
+        if (tid == 0u)
+        {
+            out_compact_features[index].x = ft.x;
+            out_compact_features[index].y = ft.y;
+            out_compact_features[index].sigma = ft.sigma;
+            out_compact_features[index].scale = ft.scale;
+            out_compact_features[index].octave = ft.octave;
+            out_compact_features[index].orientation = ft.orientation;
+            out_compact_features[index]._pad = vec2(0);
+        }
+    }
+    else
+    {
+        if (tid < 128u)
+            out_features[index].descriptor[tid] = value;
+        if (tid == 0u)
+        {
+            out_features[index].x = ft.x;
+            out_features[index].y = ft.y;
+            out_features[index].sigma = ft.sigma;
+            out_features[index].scale = ft.scale;
+            out_features[index].octave = ft.octave;
+            out_features[index].orientation = ft.orientation;
+            out_features[index]._pad = vec2(0);
         }
     }
-    out_features[gid]._pad[0] = 0.f;
-    out_features[gid]._pad[1] = 0.f;
 }
-
 )";
 
-    constexpr auto orientation_geom = R"(#version 320 es
-#ifdef GL_ES
-    precision highp float;
-#endif
-layout(points) in;
-layout (points, max_vertices = 1) out;
+    // Binary alternative to descriptor_comp, see binary_pattern in binary_descriptor.hpp.
+    constexpr auto binary_descriptor_comp = R"(#version 320 es
+// One work group per feature, one invocation per bit of the descriptor.
+layout(local_size_x = 256) in;
+struct in_feature_t
+{
+    float x;
+    float y;
+    float sigma;
+    float scale;
+    int octave;
+    float orientation; // angle in radians
+    float response;
+    float _pad;
+};
+struct binary_feature_t
+{
+    float x;
+    float y;
+    float sigma;
+    float scale;
 
-in vec4 ft_feature[];
-flat in ivec2 ft_pixel[];
-flat in int ft_scale[];
-flat in int ft_octave[];
+    int octave;
+    float orientation; // angle in radians
+    vec2 _pad;
 
-uniform sampler2D u_textures[16];
+    uint descriptor[8];
+};
+layout(std430, binding = 0) restrict readonly buffer InFeatures {
+    uvec3 in_num_groups;
+    uint in_count;
+    in_feature_t in_features[];
+};
+layout(std430, binding = 1) restrict writeonly buffer OutFeatures {
+    binary_feature_t out_features[];
+};
+// Two points per bit, xy is compared with zw.
+layout(std140, binding = 1) uniform BinaryPattern {
+    vec4 u_pairs[256];
+};
+// Mipmapped gaussian levels, one layer per level. Difference-of-gaussian level i is computed from gaussian levels i and i + 1,
+// the lower one is sampled.
+uniform highp sampler2DArray u_gaussians;
 const float pi = 3.141592653587;
 
-out vec4 feature;
-out int octave;
-out float orientation;
-out ivec2 pad2;
+shared uint s_bits[8];
+
+void main()
+{
+    // See orientation_comp for the layout of the indirect dispatch. Work groups without a feature still run
+    // through all barriers, they just don't write anything.
+    uint index = gl_WorkGroupID.x + gl_WorkGroupID.y * 1024u;
+    bool valid = index < min(in_count, uint(in_features.length()));
+    uint tid = gl_LocalInvocationIndex;
+    if (tid < 8u)
+        s_bits[tid] = 0u;
+    barrier();
+
+    in_feature_t ft = in_features[valid ? index : 0u];
+    int level = int(round(ft.sigma));
+    ivec2 px = ivec2(round(ft.x), round(ft.y)) >> ft.octave;
+    ivec2 tsize = textureSize(u_gaussians, ft.octave).xy;
+
+    // Orientations are atan(x, y) of the dominant gradient, see binary_pattern_angle.
+    float angle = 0.5f * pi - ft.orientation;
+    mat2 rotation = mat2(cos(angle), sin(angle), -sin(angle), cos(angle));
+    vec4 pair = u_pairs[tid];
+    ivec2 p = clamp(px + ivec2(round(rotation * pair.xy)), ivec2(0), tsize - 1);
+    ivec2 q = clamp(px + ivec2(round(rotation * pair.zw)), ivec2(0), tsize - 1);
+    if (valid && texelFetch(u_gaussians, ivec3(p, level), ft.octave).r < texelFetch(u_gaussians, ivec3(q, level), ft.octave).r)
+        atomicOr(s_bits[tid / 32u], 1u << (tid % 32u));
+    barrier();
+
+    if (!valid)
+        return;
+    if (tid < 8u)
+        out_features[index].descriptor[tid] = s_bits[tid];
+    if (tid == 0u)
+    {
+        out_features[index].x = ft.x;
+        out_features[index].y = ft.y;
+        out_features[index].sigma = ft.sigma;
+        out_features[index].scale = ft.scale;
+        out_features[index].octave = ft.octave;
+        out_features[index].orientation = ft.orientation;
+        out_features[index]._pad = vec2(0);
+    }
+}
+)";
+
+    constexpr auto orientation_comp = R"(#version 320 es
+layout(local_size_x = 32) in;
+struct feature_t
+{
+    vec4 feature;
+    int octave;
+    float orientation;
+    float response; // difference-of-gaussian value at the extremum
+    int pad;
+};
+layout(std430, binding = 0) restrict readonly buffer InFeatures {
+    uvec3 in_num_groups;
+    uint in_count;
+    feature_t in_features[];
+};
+layout(std430, binding = 1) restrict buffer OutFeatures {
+    uint num_groups_x;
+    uint num_groups_y;
+    uint num_groups_z;
+    uint count;
+    feature_t out_features[];
+};
+
+// Difference-of-gaussian levels, one layer per level.
+uniform highp sampler2DArray u_differences;
+const float pi = 3.141592653587;
+// Squared gradient magnitude an orientation needs to be kept.
+uniform float u_magnitude_threshold;
+// ORIENTATION_SLICES is defined from the detection settings, see sift_variant_programs.
 
 float gaussian(float sigma, float diff)
 {
@@ -221,13 +446,16 @@ float gaussian(float sigma, float diff)
 
 void main()
 {
-    feature = ft_feature[0];
-    octave = ft_octave[0];
-    pad2 = ivec2(0, 0);
+    if(gl_GlobalInvocationID.x >= min(in_count, uint(in_features.length())))
+        return;
+
+    feature_t ft = in_features[gl_GlobalInvocationID.x];
+    int octave = ft.octave;
+    int ft_scale = int(round(ft.feature.z));
 
     // Compute orientation
-    ivec2 px = ivec2(ft_pixel[0].x >> octave, ft_pixel[0].y >> octave);
-    ivec2 tsize = textureSize(u_textures[ft_scale[0]], octave);
+    ivec2 px = ivec2(round(ft.feature.xy)) >> octave;
+    ivec2 tsize = textureSize(u_differences, octave).xy;
     const int window_size_half = 5;
     const int window_width = window_size_half + window_size_half + 1;
 
@@ -235,11 +463,11 @@ void main()
     if (px.x - window_size_half <= 0 || px.x + window_size_half >= tsize.x - 1 || px.y - window_size_half <= 0 || px.y + window_size_half > tsize.y - 1)
         return;
 
-    // Subdivide 360 degrees into 36 bins of 10 degrees.
+    // Subdivide 360 degrees into ORIENTATION_SLICES bins.
     // Then compute a gaussian- and magnitude-weighted orientation histogram.
     float mag_max = 0.f;
     float ang_max = pi / 2.f;
-    const int slices = 24;
+    const int slices = ORIENTATION_SLICES;
     float step = (2.f * pi) / float(slices);
 
     vec2 vectors[slices];
@@ -252,10 +480,10 @@ void main()
             int x = px.x + win_x;
             int y = px.y + win_y;
             
-            float tpx = texelFetch(u_textures[ft_scale[0]], ivec2(x+1, y), octave).r;
-            float tnx = texelFetch(u_textures[ft_scale[0]], ivec2(x-1, y), octave).r;
-            float tpy = texelFetch(u_textures[ft_scale[0]], ivec2(x, y+1), octave).r;
-            float tny = texelFetch(u_textures[ft_scale[0]], ivec2(x, y-1), octave).r;
+            float tpx = texelFetch(u_differences, ivec3(x+1, y, ft_scale), octave).r;
+            float tnx = texelFetch(u_differences, ivec3(x-1, y, ft_scale), octave).r;
+            float tpy = texelFetch(u_differences, ivec3(x, y+1, ft_scale), octave).r;
+            float tny = texelFetch(u_differences, ivec3(x, y-1, ft_scale), octave).r;
 
             float xdiff = tpx - tnx;
             float ydiff = tpy - tny;
@@ -285,50 +513,412 @@ void main()
         }
     }
 
-    if (dot(it, it) > 0.00015f)
+    if (dot(it, it) > u_magnitude_threshold)
     {
-        orientation = atan(it.x, it.y);
+        // Append to the output and grow the indirect dispatch for the descriptor stage,
+        // which runs one work group per feature in rows of 1024 work groups.
+        uint idx = atomicAdd(count, 1u);
+        if (idx < 1024u)
+            atomicMax(num_groups_x, idx + 1u);
+        if ((idx & 1023u) == 0u)
+            atomicMax(num_groups_y, idx / 1024u + 1u);
+        if (idx < uint(out_features.length()))
+            out_features[idx] = feature_t(ft.feature, octave, atan(it.x, it.y), ft.response, 0);
+    }
+}
+)";
 
-        EmitVertex();
-        EndPrimitive();
+    // Feature selection, see detection_settings::max_features. The image is split into a grid of buckets, each
+    // bucket keeps its strongest features by difference-of-gaussian response up to a common quota. Responses are
+    // sorted into histogram bins, so a bucket keeps all features above its threshold bin and fills up the rest
+    // of its quota from the threshold bin in no particular order.
+    constexpr auto select_histogram_comp = R"(#version 320 es
+layout(local_size_x = 32) in;
+struct feature_t
+{
+    vec4 feature;
+    int octave;
+    float orientation;
+    float response;
+    int pad;
+};
+struct bucket_t
+{
+    uint histogram[64];
+    uint threshold; // lowest bin which is kept
+    uint threshold_quota; // features taken from the threshold bin
+    uint threshold_taken;
+    uint total;
+};
+layout(std430, binding = 2) restrict buffer Buckets {
+    bucket_t buckets[];
+};
+
+uniform int u_grid;
+uniform vec2 u_size;
+
+// Must match response_bin in selection.hpp
+uint response_bin(float response)
+{
+    return uint(clamp(int((log2(max(response, 1e-8f)) + 16.f) * 4.f), 0, 63));
+}
+
+uint bucket_index(vec2 position)
+{
+    ivec2 cell = clamp(ivec2(position * float(u_grid) / u_size), ivec2(0), ivec2(u_grid - 1));
+    return uint(cell.x + cell.y * u_grid);
+}
+
+layout(std430, binding = 0) restrict readonly buffer InFeatures {
+    uvec3 in_num_groups;
+    uint in_count;
+    feature_t in_features[];
+};
+
+void main()
+{
+    if (gl_GlobalInvocationID.x >= min(in_count, uint(in_features.length())))
+        return;
+    feature_t ft = in_features[gl_GlobalInvocationID.x];
+    atomicAdd(buckets[bucket_index(ft.feature.xy)].histogram[response_bin(ft.response)], 1u);
+}
+)";
+
+    constexpr auto select_threshold_comp = R"(#version 320 es
+// Runs as a single work group, each invocation handles every 64th bucket.
+layout(local_size_x = 64) in;
+struct bucket_t
+{
+    uint histogram[64];
+    uint threshold; // lowest bin which is kept
+    uint threshold_quota; // features taken from the threshold bin
+    uint threshold_taken;
+    uint total;
+};
+layout(std430, binding = 2) restrict buffer Buckets {
+    bucket_t buckets[];
+};
+
+uniform int u_grid;
+uniform uint u_max_features;
+
+shared uint s_quota;
+
+void main()
+{
+    uint num_buckets = uint(u_grid * u_grid);
+    for (uint bucket = gl_LocalInvocationIndex; bucket < num_buckets; bucket += 64u)
+    {
+        uint total = 0u;
+        for (int bin = 0; bin < 64; ++bin)
+            total += buckets[bucket].histogram[bin];
+        buckets[bucket].total = total;
+    }
+    memoryBarrierBuffer();
+    barrier();
+
+    // Same quota for all buckets, as large as the budget allows. Sparse buckets keep all of their features and
+    // leave the rest of their share to the others. See bucket_quota in selection.hpp.
+    if (gl_LocalInvocationIndex == 0u)
+    {
+        uint low = 0u;
+        uint high = u_max_features;
+        while (low < high)
+        {
+            uint mid = (low + high + 1u) / 2u;
+            uint sum = 0u;
+            for (uint bucket = 0u; bucket < num_buckets; ++bucket)
+                sum += min(buckets[bucket].total, mid);
+            if (sum <= u_max_features)
+                low = mid;
+            else
+                high = mid - 1u;
+        }
+        s_quota = low;
+    }
+    barrier();
+
+    // Walk down from the strongest bin until the quota is reached. If it never is, all features are kept.
+    for (uint bucket = gl_LocalInvocationIndex; bucket < num_buckets; bucket += 64u)
+    {
+        uint taken = 0u;
+        uint threshold = 0u;
+        uint threshold_quota = buckets[bucket].histogram[0];
+        for (int bin = 63; bin >= 0; --bin)
+        {
+            uint count = buckets[bucket].histogram[bin];
+            if (taken + count >= s_quota)
+            {
+                threshold = uint(bin);
+                threshold_quota = s_quota - taken;
+                break;
+            }
+            taken += count;
+        }
+        buckets[bucket].threshold = threshold;
+        buckets[bucket].threshold_quota = threshold_quota;
+        buckets[bucket].threshold_taken = 0u;
     }
 }
 )";
 
-    constexpr auto filter_vert = R"(#version 320 es
-#ifdef GL_ES
-    precision highp float;
-#endif
-uniform sampler2D u_current_tex;
-uniform int u_mip;
-flat out ivec2 pixel;
+    constexpr auto select_compact_comp = R"(#version 320 es
+layout(local_size_x = 32) in;
+struct feature_t
+{
+    vec4 feature;
+    int octave;
+    float orientation;
+    float response;
+    int pad;
+};
+struct bucket_t
+{
+    uint histogram[64];
+    uint threshold; // lowest bin which is kept
+    uint threshold_quota; // features taken from the threshold bin
+    uint threshold_taken;
+    uint total;
+};
+layout(std430, binding = 2) restrict buffer Buckets {
+    bucket_t buckets[];
+};
+
+uniform int u_grid;
+uniform vec2 u_size;
+
+// Must match response_bin in selection.hpp
+uint response_bin(float response)
+{
+    return uint(clamp(int((log2(max(response, 1e-8f)) + 16.f) * 4.f), 0, 63));
+}
+
+uint bucket_index(vec2 position)
+{
+    ivec2 cell = clamp(ivec2(position * float(u_grid) / u_size), ivec2(0), ivec2(u_grid - 1));
+    return uint(cell.x + cell.y * u_grid);
+}
+
+layout(std430, binding = 0) restrict readonly buffer InFeatures {
+    uvec3 in_num_groups;
+    uint in_count;
+    feature_t in_features[];
+};
+layout(std430, binding = 1) restrict buffer OutFeatures {
+    uint num_groups_x;
+    uint num_groups_y;
+    uint num_groups_z;
+    uint count;
+    feature_t out_features[];
+};
+
+void main()
+{
+    if (gl_GlobalInvocationID.x >= min(in_count, uint(in_features.length())))
+        return;
+    feature_t ft = in_features[gl_GlobalInvocationID.x];
+    uint bucket = bucket_index(ft.feature.xy);
+    uint bin = response_bin(ft.response);
+    uint threshold = buckets[bucket].threshold;
+    if (bin < threshold)
+        return;
+    if (bin == threshold && atomicAdd(buckets[bucket].threshold_taken, 1u) >= buckets[bucket].threshold_quota)
+        return;
+
+    // Same layout as the output of orientation_comp.
+    uint idx = atomicAdd(count, 1u);
+    if (idx < 1024u)
+        atomicMax(num_groups_x, idx + 1u);
+    if ((idx & 1023u) == 0u)
+        atomicMax(num_groups_y, idx / 1024u + 1u);
+    if (idx < uint(out_features.length()))
+        out_features[idx] = ft;
+}
+)";
+
+    // Matches the compact descriptors of two detections, see match_indices in sift.cpp for the CPU version.
+    constexpr auto descriptor_norm_comp = R"(#version 320 es
+// Stores the norm of each compact descriptor in _pad.x, once per resident set instead of once per pair in match_comp.
+layout(local_size_x = 64) in;
+struct compact_feature_t
+{
+    float x;
+    float y;
+    float sigma;
+    float scale;
+
+    int octave;
+    float orientation; // angle in radians
+    vec2 _pad;
+
+    uint descriptor[32]; // 128 bytes, see quantize_descriptor in sift.hpp
+};
+layout(std430, binding = 0) restrict buffer Features {
+    compact_feature_t features[];
+};
+uniform uint u_count;
+
+// Sums of the byte-wise products of two packed descriptor words. 128 products of at most 255^2 fit into 32 bits.
+uint dot_bytes(uint a, uint b)
+{
+    return (a & 0xffu) * (b & 0xffu) + ((a >> 8) & 0xffu) * ((b >> 8) & 0xffu)
+        + ((a >> 16) & 0xffu) * ((b >> 16) & 0xffu) + (a >> 24) * (b >> 24);
+}
+
 void main()
 {
-    ivec2 ts = ivec2(textureSize(u_current_tex, u_mip));
-    pixel = ivec2(gl_VertexID % ts.x, gl_VertexID / ts.x);
+    uint index = gl_GlobalInvocationID.x;
+    if (index >= u_count)
+        return;
+
+    uint square = 0u;
+    for (int i = 0; i < 32; ++i)
+    {
+        uint word = features[index].descriptor[i];
+        square += dot_bytes(word, word);
+    }
+    features[index]._pad.x = sqrt(float(square));
 }
 )";
 
-    constexpr auto filter_geom = R"(#version 320 es
-#extension GL_EXT_geometry_shader : enable
-#ifdef GL_ES
-    precision highp float;
-#endif
-layout(points) in;
-layout (points, max_vertices = 1) out;
+    constexpr auto match_comp = R"(#version 320 es
+// One invocation per feature of a. The work group copies tiles of 64 descriptors of b into shared memory, so each
+// descriptor of b is read from the buffer once per work group. The norms were stored in _pad.x by descriptor_norm_comp.
+layout(local_size_x = 64) in;
+struct compact_feature_t
+{
+    float x;
+    float y;
+    float sigma;
+    float scale;
 
-flat in ivec2 pixel[];
-uniform sampler2D u_previous_tex;
-uniform sampler2D u_current_tex;
-uniform sampler2D u_next_tex;
-uniform sampler2D u_feature_tex;
+    int octave;
+    float orientation; // angle in radians
+    vec2 _pad;
+
+    uint descriptor[32]; // 128 bytes, see quantize_descriptor in sift.hpp
+};
+struct match_t
+{
+    uint a;
+    uint b;
+    float similarity;
+};
+layout(std430, binding = 0) restrict readonly buffer FeaturesA {
+    compact_feature_t features_a[];
+};
+layout(std430, binding = 1) restrict readonly buffer FeaturesB {
+    compact_feature_t features_b[];
+};
+layout(std430, binding = 2) restrict buffer Matches {
+    uint match_count;
+    match_t matches[];
+};
+uniform uint u_count_a;
+uniform uint u_count_b;
+uniform float u_relation_threshold;
+uniform float u_similarity_threshold;
+
+const uint tile_size = 64u;
+shared uint tile_descriptors[tile_size * 32u]; // 8 KiB
+shared float tile_norms[tile_size];
+
+// Sums of the byte-wise products of two packed descriptor words. 128 products of at most 255^2 fit into 32 bits.
+uint dot_bytes(uint a, uint b)
+{
+    return (a & 0xffu) * (b & 0xffu) + ((a >> 8) & 0xffu) * ((b >> 8) & 0xffu)
+        + ((a >> 16) & 0xffu) * ((b >> 16) & 0xffu) + (a >> 24) * (b >> 24);
+}
+
+void main()
+{
+    uint index = gl_GlobalInvocationID.x;
+    uint local_index = gl_LocalInvocationID.x;
+    // Invocations past the end of a still help loading the tiles, barrier() has to be reached by all of them.
+    bool in_range = index < u_count_a;
+
+    uint descriptor[32];
+    float norm_a = 0.f;
+    if (in_range)
+    {
+        for (int i = 0; i < 32; ++i)
+            descriptor[i] = features_a[index].descriptor[i];
+        norm_a = features_a[index]._pad.x;
+    }
+
+    // Two nearest neighbours by cosine similarity.
+    float best = -1.f;
+    float second = -1.f;
+    uint best_index = 0u;
+    // The loop only depends on uniforms, which makes it uniform control flow that may contain barrier() in compute shaders.
+    for (uint base = 0u; base < u_count_b; base += tile_size)
+    {
+        uint count = min(tile_size, u_count_b - base);
+        // Neighbouring invocations load neighbouring words.
+        for (uint word = local_index; word < count * 32u; word += tile_size)
+            tile_descriptors[word] = features_b[base + word / 32u].descriptor[word % 32u];
+        if (local_index < count)
+            tile_norms[local_index] = features_b[base + local_index]._pad.x;
+        barrier();
+
+        if (in_range)
+        {
+            for (uint k = 0u; k < count; ++k)
+            {
+                // All invocations read the same word, which is broadcast.
+                uint dot_ab = 0u;
+                for (uint i = 0u; i < 32u; ++i)
+                    dot_ab += dot_bytes(descriptor[i], tile_descriptors[k * 32u + i]);
+                float similarity = float(dot_ab) / (norm_a * tile_norms[k]);
+                if (similarity > best)
+                {
+                    second = best;
+                    best = similarity;
+                    best_index = base + k;
+                }
+                else if (similarity > second)
+                {
+                    second = similarity;
+                }
+            }
+        }
+        // The next tile overwrites the shared memory.
+        barrier();
+    }
+
+    if (!in_range || u_count_b < 2u || second / best > u_relation_threshold || best < u_similarity_threshold)
+        return;
+    uint slot = atomicAdd(match_count, 1u);
+    matches[slot].a = index;
+    matches[slot].b = best_index;
+    matches[slot].similarity = best;
+}
+)";
+
+    constexpr auto filter_comp = R"(#version 320 es
+layout(local_size_x = 16, local_size_y = 16) in;
+struct feature_t
+{
+    vec4 feature;
+    int octave;
+    float orientation;
+    float response; // difference-of-gaussian value at the extremum
+    int pad;
+};
+layout(std430, binding = 0) restrict buffer OutFeatures {
+    uint num_groups_x;
+    uint num_groups_y;
+    uint num_groups_z;
+    uint count;
+    feature_t out_features[];
+};
+
+// Difference-of-gaussian levels u_scale to u_scale + 2 and the candidates of u_scale, see maximize_frag.
+uniform highp sampler2DArray u_differences;
+uniform highp sampler2DArray u_features;
 uniform int u_scale;
 uniform int u_mip;
-uniform int u_border;
-
-out vec4 feature;
-out int octave;
-out ivec3 pad3;
+// BORDER is defined when compiling, features closer to the edge of the image are left out.
 
 ivec2 tsize;
 ivec2 tcl(ivec2 px)
@@ -336,19 +926,25 @@ ivec2 tcl(ivec2 px)
     return clamp(px, ivec2(0), tsize - ivec2(1));
 }
 
+float fetch(int layer, ivec2 px)
+{
+    return texelFetch(u_differences, ivec3(px, layer), u_mip).r;
+}
+
 void main()
 {
-    ivec2 px = ivec2(pixel[0]);
-    tsize = ivec2(textureSize(u_current_tex, u_mip));
-//#define texelFetch_(T, U, M) (textureLod((T), vec2(U) / vec2(tsize), float(M)))
-#define texelFetch_(T, U, M) (texelFetch(T, U, M))
+    ivec2 px = ivec2(gl_GlobalInvocationID.xy);
+    tsize = textureSize(u_differences, u_mip).xy;
+    int previous = u_scale;
+    int current = u_scale + 1;
+    int next = u_scale + 2;
 
-    if(any(lessThan(px, ivec2(u_border))) || any(greaterThan(px, tsize - ivec2(u_border + 1))) || all(equal(texelFetch_(u_feature_tex, px, u_mip), vec4(0, 0, 0, 1))))
+    if(any(lessThan(px, ivec2(BORDER))) || any(greaterThan(px, tsize - ivec2(BORDER + 1))) || all(equal(texelFetch(u_features, ivec3(px, u_scale), u_mip), vec4(0, 0, 0, 1))))
     {
         return;
     }
 
-    float d = texelFetch_(u_current_tex, px, u_mip).r;
+    float d = fetch(current, px);
    /* const float threshold = 0.0012f;
     if(d < threshold)
     {
@@ -356,27 +952,27 @@ void main()
         return;
     }*/
 
-    float xval_p = texelFetch_(u_current_tex, tcl(px + ivec2(1, 0)), u_mip).r;
-    float xval_n = texelFetch_(u_current_tex, tcl(px + ivec2(-1, 0)), u_mip).r;
-    float yval_p = texelFetch_(u_current_tex, tcl(px + ivec2(0, 1)), u_mip).r;
-    float yval_n = texelFetch_(u_current_tex, tcl(px + ivec2(0, -1)), u_mip).r;
-    float sval_p = texelFetch_(u_next_tex, tcl(px), u_mip).r;
-    float sval_n = texelFetch_(u_previous_tex, tcl(px), u_mip).r;
+    float xval_p = fetch(current, tcl(px + ivec2(1, 0)));
+    float xval_n = fetch(current, tcl(px + ivec2(-1, 0)));
+    float yval_p = fetch(current, tcl(px + ivec2(0, 1)));
+    float yval_n = fetch(current, tcl(px + ivec2(0, -1)));
+    float sval_p = fetch(next, tcl(px));
+    float sval_n = fetch(previous, tcl(px));
 
-    float xval_p_yval_p = texelFetch_(u_current_tex, tcl(px + ivec2(1, 1)), u_mip).r;
-    float xval_p_yval_n = texelFetch_(u_current_tex, tcl(px + ivec2(1, -1)), u_mip).r;
-    float xval_n_yval_p = texelFetch_(u_current_tex, tcl(px + ivec2(-1, 1)), u_mip).r;
-    float xval_n_yval_n = texelFetch_(u_current_tex, tcl(px + ivec2(-1, -1)), u_mip).r;
+    float xval_p_yval_p = fetch(current, tcl(px + ivec2(1, 1)));
+    float xval_p_yval_n = fetch(current, tcl(px + ivec2(1, -1)));
+    float xval_n_yval_p = fetch(current, tcl(px + ivec2(-1, 1)));
+    float xval_n_yval_n = fetch(current, tcl(px + ivec2(-1, -1)));
 
-    float xval_p_sval_p = texelFetch_(u_next_tex, tcl(px + ivec2(1, 0)), u_mip).r;
-    float xval_p_sval_n = texelFetch_(u_previous_tex, tcl(px + ivec2(1, 0)), u_mip).r;
-    float xval_n_sval_p = texelFetch_(u_next_tex, tcl(px + ivec2(-1, 0)), u_mip).r;
-    float xval_n_sval_n = texelFetch_(u_previous_tex, tcl(px + ivec2(-1, 0)), u_mip).r;
+    float xval_p_sval_p = fetch(next, tcl(px + ivec2(1, 0)));
+    float xval_p_sval_n = fetch(previous, tcl(px + ivec2(1, 0)));
+    float xval_n_sval_p = fetch(next, tcl(px + ivec2(-1, 0)));
+    float xval_n_sval_n = fetch(previous, tcl(px + ivec2(-1, 0)));
 
-    float sval_p_yval_p = texelFetch_(u_next_tex, tcl(px + ivec2(0, 1)), u_mip).r;
-    float sval_p_yval_n = texelFetch_(u_next_tex, tcl(px + ivec2(0, -1)), u_mip).r;
-    float sval_n_yval_p = texelFetch_(u_previous_tex, tcl(px + ivec2(0, 1)), u_mip).r;
-    float sval_n_yval_n = texelFetch_(u_previous_tex, tcl(px + ivec2(0, -1)), u_mip).r;
+    float sval_p_yval_p = fetch(next, tcl(px + ivec2(0, 1)));
+    float sval_p_yval_n = fetch(next, tcl(px + ivec2(0, -1)));
+    float sval_n_yval_p = fetch(previous, tcl(px + ivec2(0, 1)));
+    float sval_n_yval_n = fetch(previous, tcl(px + ivec2(0, -1)));
 
     vec3 gradient = vec3(
         xval_p - xval_n,
@@ -408,11 +1004,13 @@ void main()
 
         float lobe = float(1 << (u_mip + 1)) * (float(u_scale) + interpolated.z + 1.f) + 1.f;
         float scale = 1.2f / 3.f * lobe;
-        feature = vec4(final_point, scale);
-        octave = u_mip;
-        pad3 = ivec3(0, 0, 0);
-        EmitVertex();
-        EndPrimitive();
+
+        // Append to the output and grow the indirect dispatch for the orientation stage.
+        uint idx = atomicAdd(count, 1u);
+        if ((idx & 31u) == 0u)
+            atomicMax(num_groups_x, idx / 32u + 1u);
+        if (idx < uint(out_features.length()))
+            out_features[idx] = feature_t(vec4(final_point, scale), u_mip, 0.f, d, 0);
     }
 }
 )";
@@ -524,25 +1122,36 @@ void main()
     precision highp float;
 #endif
 in vec2 vs_uv;
-uniform sampler2D u_previous_tex;
-uniform sampler2D u_current_tex;
-uniform sampler2D u_next_tex;
+// Difference-of-gaussian levels, u_scale to u_scale + 2 are compared.
+uniform highp sampler2DArray u_differences;
+// Region of interest mask at full resolution, no candidates are searched where it is zero.
+uniform sampler2D u_mask;
+uniform bool u_masked;
 uniform int u_mip;
 uniform int u_scale;
-uniform int u_neighbors; // 0 both, 1 only next, -1 only prev
+// NEIGHBORS is defined when compiling, 0 both, 1 only next, -1 only prev
 layout(location = 0) out vec4 color;
+
+float fetch(int layer, ivec2 px)
+{
+    return texelFetch(u_differences, ivec3(px, layer), u_mip).r;
+}
+
 void main()
 {
     ivec2 px = ivec2(gl_FragCoord.xy);
     // look at neighbors
     //float max_val = -1.f/0.f;
     //float min_val = 1.f/0.f;
-    ivec2 tsize = ivec2(textureSize(u_current_tex, u_mip).xy);
+    ivec2 tsize = textureSize(u_differences, u_mip).xy;
+    if (u_masked && texelFetch(u_mask, min(px << u_mip, textureSize(u_mask, 0) - 1), 0).r == 0.f)
+        discard;
 
-//#define texelFetch_(T, U, M) (textureLod((T), vec2(U) / vec2(tsize), float(M)))
-#define texelFetch_(T, U, M) (texelFetch(T, U, M))
+    int previous = u_scale;
+    int current = u_scale + 1;
+    int next = u_scale + 2;
 
-    float val_curr = texelFetch_(u_current_tex, px, u_mip).r;
+    float val_curr = fetch(current, px);
     float cmax_val = -1.f/0.f;
     float cmin_val = 1.f/0.f;
     for(int x = -1; x <= 1; ++x)
@@ -552,9 +1161,9 @@ void main()
             if(x == 0 && y == 0)
                 continue;
             ivec2 pos_uv = ivec2(clamp(px + ivec2(x, y), ivec2(0, 0), tsize - 1));
-            float vprev = u_neighbors == 1 ? -(1.f/0.f) : texelFetch_(u_previous_tex, pos_uv, u_mip).r;
-            float vcurr = texelFetch_(u_current_tex, pos_uv, u_mip).r;
-            float vnext = u_neighbors == -1 ? -(1.f/0.f) : texelFetch_(u_next_tex, pos_uv, u_mip).r;
+            float vprev = NEIGHBORS == 1 ? -(1.f/0.f) : fetch(previous, pos_uv);
+            float vcurr = fetch(current, pos_uv);
+            float vnext = NEIGHBORS == -1 ? -(1.f/0.f) : fetch(next, pos_uv);
             
             float maxval = max(vprev, max(vcurr, vnext));
             float minval = min(vprev, min(vcurr, vnext));
@@ -0,0 +1,559 @@
+#include <processing/sift/detail/sift_cpu.hpp>
+#include <processing/sift/detail/scale_space.hpp>
+#include <processing/sift/detail/selection.hpp>
+#include <processing/sift/detail/binary_descriptor.hpp>
+#include <processing/sift/detail/orientation.hpp>
+#include <processing/image.hpp>
+#include <processing/algorithm.hpp>
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+#include <array>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace mpp::sift::detail
+{
+    namespace
+    {
+        constexpr float pi = 3.141592653587f;
+
+        // Single-channel float image, the CPU equivalent of one mip level of an R32F texture.
+        struct plane
+        {
+            plane() = default;
+            plane(int width, int height) : width(width), height(height), values(size_t(width) * height, 0.f) {}
+
+            float* row(int y) { return values.data() + size_t(y) * width; }
+            const float* row(int y) const { return values.data() + size_t(y) * width; }
+
+            // Like texelFetch with robust buffer access: texels outside of the level read as zero.
+            float fetch(int x, int y) const
+            {
+                if (x < 0 || y < 0 || x >= width || y >= height)
+                    return 0.f;
+                return values[size_t(x) + size_t(y) * width];
+            }
+            float fetch_clamped(int x, int y) const
+            {
+                return values[size_t(std::clamp(x, 0, width - 1)) + size_t(std::clamp(y, 0, height - 1)) * width];
+            }
+
+            int width = 0;
+            int height = 0;
+            std::vector<float> values;
+        };
+        using mip_chain = std::vector<plane>;
+
+        struct keypoint
+        {
+            glm::vec4 feat;
+            int octave;
+            float orientation;
+            float response;
+        };
+
+        int wrap(int value, int size)
+        {
+            value %= size;
+            return value < 0 ? value + size : value;
+        }
+
+        float glsl_mod(float x, float y)
+        {
+            return x - y * std::floor(x / y);
+        }
+
+        float gaussian(float sigma, float diff)
+        {
+            constexpr float sqrt_2_pi = 2.50662827463f;
+            const float inner = diff / sigma;
+            const float nom = std::exp(-(inner * inner / 2.f));
+            return nom / (sigma * sqrt_2_pi);
+        }
+
+        plane to_luminance(const image& img)
+        {
+            plane result(img.dimensions().x, img.dimensions().y);
+            const auto* src = reinterpret_cast<const unsigned char*>(img.data());
+            const int components = img.components();
+            for_n(result.height, [&](int y) {
+                const unsigned char* line = src + size_t(y) * result.width * components;
+                float* dst = result.row(y);
+                if (components >= 3)
+                {
+                    for (int x = 0; x < result.width; ++x)
+                    {
+                        const unsigned char* px = line + size_t(x) * components;
+                        dst[x] = (0.21f * px[0] + 0.72f * px[1] + 0.07f * px[2]) / 255.f;
+                    }
+                }
+                else
+                {
+                    for (int x = 0; x < result.width; ++x)
+                        dst[x] = line[size_t(x) * components] / 255.f;
+                }
+                });
+            return result;
+        }
+
+        // Separable blur with wrap-around addressing. Both passes only run over contiguous rows,
+        // so the inner loops can be vectorized by the compiler.
+        void blur(const plane& src, plane& temp, plane& dst, const std::vector<float>& kernel)
+        {
+            const int w = src.width;
+            const int h = src.height;
+            const int radius = int(kernel.size()) - 1;
+
+            for_n(h, [&](int y) {
+                std::vector<float> padded(size_t(w) + 2 * size_t(radius));
+                const float* in = src.row(y);
+                for (int x = 0; x < int(padded.size()); ++x)
+                    padded[x] = in[wrap(x - radius, w)];
+
+                const float* center = padded.data() + radius;
+                float* out = temp.row(y);
+                for (int x = 0; x < w; ++x)
+                    out[x] = kernel[0] * center[x];
+                for (int i = 1; i <= radius; ++i)
+                {
+                    const float g = kernel[i];
+                    const float* pos = center + i;
+                    const float* neg = center - i;
+                    for (int x = 0; x < w; ++x)
+                        out[x] += g * (pos[x] + neg[x]);
+                }
+                });
+
+            for_n(h, [&](int y) {
+                const float* center = temp.row(y);
+                float* out = dst.row(y);
+                for (int x = 0; x < w; ++x)
+                    out[x] = kernel[0] * center[x];
+                for (int i = 1; i <= radius; ++i)
+                {
+                    const float g = kernel[i];
+                    const float* pos = temp.row(wrap(y + i, h));
+                    const float* neg = temp.row(wrap(y - i, h));
+                    for (int x = 0; x < w; ++x)
+                        out[x] += g * (pos[x] + neg[x]);
+                }
+                });
+        }
+
+        // 2x2 box filter, as used by glGenerateMipmap.
+        plane downsample(const plane& src)
+        {
+            plane dst(std::max(src.width / 2, 1), std::max(src.height / 2, 1));
+            for_n(dst.height, [&](int y) {
+                const float* r0 = src.row(std::min(2 * y, src.height - 1));
+                const float* r1 = src.row(std::min(2 * y + 1, src.height - 1));
+                float* out = dst.row(y);
+                for (int x = 0; x < dst.width; ++x)
+                {
+                    const int x0 = std::min(2 * x, src.width - 1);
+                    const int x1 = std::min(2 * x + 1, src.width - 1);
+                    out[x] = 0.25f * (r0[x0] + r0[x1] + r1[x0] + r1[x1]);
+                }
+                });
+            return dst;
+        }
+
+        // Rounds all values to the nearest half float, like storing them in an R16F texture.
+        void quantize_half(plane& p)
+        {
+            for (auto& v : p.values)
+                v = glm::unpackHalf1x16(glm::packHalf1x16(v));
+        }
+
+        mip_chain build_mips(plane base, size_t levels)
+        {
+            mip_chain chain;
+            chain.reserve(levels);
+            chain.push_back(std::move(base));
+            while (chain.size() < levels)
+                chain.push_back(downsample(chain.back()));
+            return chain;
+        }
+
+        // maximize_frag
+        bool is_extremum(const plane& prev, const plane& curr, const plane& next, int px, int py)
+        {
+            const float val_curr = curr.fetch(px, py);
+            float cmax_val = -std::numeric_limits<float>::infinity();
+            float cmin_val = std::numeric_limits<float>::infinity();
+            for (int y = -1; y <= 1; ++y)
+            {
+                for (int x = -1; x <= 1; ++x)
+                {
+                    if (x == 0 && y == 0)
+                        continue;
+                    const float vprev = prev.fetch_clamped(px + x, py + y);
+                    const float vcurr = curr.fetch_clamped(px + x, py + y);
+                    const float vnext = next.fetch_clamped(px + x, py + y);
+                    cmax_val = std::max(cmax_val, std::max(vprev, std::max(vcurr, vnext)));
+                    cmin_val = std::min(cmin_val, std::min(vprev, std::min(vcurr, vnext)));
+                }
+            }
+            return cmax_val < val_curr || cmin_val > val_curr;
+        }
+
+        // filter_geom
+        bool refine(const plane& prev, const plane& curr, const plane& next, int px, int py, int octave, int scale, keypoint& kp)
+        {
+            const float d = curr.fetch(px, py);
+
+            const float xval_p = curr.fetch_clamped(px + 1, py);
+            const float xval_n = curr.fetch_clamped(px - 1, py);
+            const float yval_p = curr.fetch_clamped(px, py + 1);
+            const float yval_n = curr.fetch_clamped(px, py - 1);
+            const float sval_p = next.fetch_clamped(px, py);
+            const float sval_n = prev.fetch_clamped(px, py);
+
+            const float xval_p_yval_p = curr.fetch_clamped(px + 1, py + 1);
+            const float xval_p_yval_n = curr.fetch_clamped(px + 1, py - 1);
+            const float xval_n_yval_n = curr.fetch_clamped(px - 1, py - 1);
+
+            const float xval_p_sval_p = next.fetch_clamped(px + 1, py);
+            const float xval_p_sval_n = prev.fetch_clamped(px + 1, py);
+            const float xval_n_sval_p = next.fetch_clamped(px - 1, py);
+            const float xval_n_sval_n = prev.fetch_clamped(px - 1, py);
+
+            const float sval_p_yval_p = next.fetch_clamped(px, py + 1);
+            const float sval_p_yval_n = next.fetch_clamped(px, py - 1);
+            const float sval_n_yval_p = prev.fetch_clamped(px, py + 1);
+            const float sval_n_yval_n = prev.fetch_clamped(px, py - 1);
+
+            const glm::vec3 gradient(xval_p - xval_n, yval_p - yval_n, sval_p - sval_n);
+            glm::mat3 hessian;
+            hessian[0][0] = (xval_p + xval_n) - 2.f * d;
+            hessian[0][1] = hessian[1][0] = (xval_p_yval_p + xval_n_yval_n - xval_p_yval_n - xval_p_yval_n) / 4.f;
+            hessian[1][1] = (yval_p + yval_n) - 2.f * d;
+            hessian[0][2] = hessian[2][0] = (xval_p_sval_p + xval_n_sval_n - xval_p_sval_n - xval_n_sval_p) / 4.f;
+            hessian[2][2] = (sval_p + sval_n) - 2.f * d;
+            hessian[1][2] = hessian[2][1] = (sval_p_yval_p + sval_n_yval_n - sval_n_yval_p - sval_p_yval_n) / 4.f;
+
+            const glm::vec3 interpolated = glm::inverse(hessian) * gradient;
+            const bool offset_lt_half = glm::all(glm::lessThan(glm::abs(interpolated), glm::vec3(0.5f)));
+
+            const float eigen_val_1 = hessian[0][0] - hessian[0][1];
+            const float eigen_val_2 = hessian[0][0] + hessian[0][1];
+            const bool eigen_values_valid = std::min(eigen_val_1, eigen_val_2) / std::max(eigen_val_1, eigen_val_2) < 0.7f;
+
+            if (!offset_lt_half || !eigen_values_valid)
+                return false;
+
+            const glm::vec3 step_size(float(1 << octave), float(1 << octave), 1.f);
+            const glm::vec3 final_point = (glm::vec3(px, py, scale) + interpolated) * step_size;
+            const float lobe = float(1 << (octave + 1)) * (float(scale) + interpolated.z + 1.f) + 1.f;
+            kp.feat = glm::vec4(final_point, 1.2f / 3.f * lobe);
+            kp.octave = octave;
+            kp.orientation = 0.f;
+            kp.response = d;
+            return true;
+        }
+
+        int level_index(const std::vector<mip_chain>& dog, float sigma)
+        {
+            return std::clamp(int(std::round(sigma)), 0, int(dog.size()) - 1);
+        }
+
+        // orientation_geom
+        bool assign_orientation(const std::vector<mip_chain>& dog, keypoint& kp, const detection_settings& settings)
+        {
+            const int octave = kp.octave;
+            const plane& level = dog[level_index(dog, kp.feat.z)][octave];
+            const glm::ivec2 px(int(std::round(kp.feat.x)) >> octave, int(std::round(kp.feat.y)) >> octave);
+            constexpr int window_size_half = 5;
+
+            if (px.x - window_size_half <= 0 || px.x + window_size_half >= level.width - 1 || px.y - window_size_half <= 0 || px.y + window_size_half > level.height - 1)
+                return false;
+
+            const int slices = orientation_slices(settings);
+            const float step = (2.f * pi) / float(slices);
+            std::array<glm::vec2, max_orientation_slices> vectors;
+            std::fill_n(vectors.begin(), slices, glm::vec2(0));
+
+            for (int win_y = -window_size_half; win_y <= window_size_half; ++win_y)
+            {
+                for (int win_x = -window_size_half; win_x <= window_size_half; ++win_x)
+                {
+                    const int x = px.x + win_x;
+                    const int y = px.y + win_y;
+                    const float xdiff = level.fetch(x + 1, y) - level.fetch(x - 1, y);
+                    const float ydiff = level.fetch(x, y + 1) - level.fetch(x, y - 1);
+
+                    const float g = gaussian(1.83f, glm::length(glm::vec2(float(win_x) + 0.5f, float(win_y) + 0.5f)));
+                    const float angle = glsl_mod(std::atan2(ydiff, xdiff) + pi, 2.f * pi);
+                    const glm::vec2 mag(g * xdiff, g * ydiff);
+
+                    int bin = (int(angle / step) + slices - 1) % slices;
+                    vectors[bin] += mag;
+                    bin = (bin + 1) % slices;
+                    vectors[bin] += mag;
+                    bin = (bin + 1) % slices;
+                    vectors[bin] += mag;
+                }
+            }
+
+            glm::vec2 it(0);
+            for (int i = 0; i < slices; ++i)
+            {
+                if (dot(vectors[i], vectors[i]) > dot(it, it))
+                    it = vectors[i];
+            }
+
+            if (dot(it, it) > settings.orientation_magnitude_threshold)
+            {
+                kp.orientation = std::atan2(it.x, it.y);
+                return true;
+            }
+            return false;
+        }
+
+        // descriptor_comp: normalizes, clamps all entries to 0.2 and normalizes again.
+        // select_*_comp: keep the strongest keypoints of each bucket. Unlike the shaders, this sorts by response
+        // inside of the threshold bin as well.
+        void select_keypoints(std::vector<keypoint>& keypoints, int width, int height, const detection_settings& settings)
+        {
+            const int grid = selection_grid(settings);
+            std::vector<std::vector<keypoint>> buckets(size_t(grid * grid));
+            for (const auto& kp : keypoints)
+            {
+                const glm::ivec2 cell = glm::clamp(glm::ivec2(glm::vec2(kp.feat) * float(grid) / glm::vec2(width, height)), glm::ivec2(0), glm::ivec2(grid - 1));
+                buckets[cell.x + cell.y * grid].push_back(kp);
+            }
+            std::vector<std::uint32_t> bucket_sizes(buckets.size());
+            std::transform(buckets.begin(), buckets.end(), bucket_sizes.begin(), [](const auto& bucket) { return std::uint32_t(bucket.size()); });
+            const size_t quota = bucket_quota(bucket_sizes, settings.max_features);
+
+            keypoints.clear();
+            for (auto& bucket : buckets)
+            {
+                const auto end = bucket.begin() + std::min(bucket.size(), quota);
+                std::partial_sort(bucket.begin(), end, bucket.end(), [](const keypoint& a, const keypoint& b) {
+                    return a.response > b.response;
+                    });
+                keypoints.insert(keypoints.end(), bucket.begin(), end);
+            }
+        }
+
+        void normalize_descriptor(std::array<float, 128>& histogram)
+        {
+            constexpr float max_entry = 0.2f;
+            const auto length = [&] {
+                float sum = 0.f;
+                for (const auto v : histogram)
+                    sum += v * v;
+                return std::sqrt(sum);
+            };
+
+            float len = length();
+            for (auto& v : histogram)
+                v = len > 0.f ? std::min(v / len, max_entry) : 0.f;
+            len = length();
+            for (auto& v : histogram)
+                v = len > 0.f ? v / len : 0.f;
+        }
+
+        // descriptor_comp, with the gradients of gradient_frag computed on the fly.
+        void compute_descriptor(const std::vector<mip_chain>& dog, const keypoint& kp, feature& out)
+        {
+            const plane& level = dog[level_index(dog, kp.feat.z)][kp.octave];
+            const glm::ivec2 px(int(std::round(kp.feat.x)) >> kp.octave, int(std::round(kp.feat.y)) >> kp.octave);
+
+            out.x = kp.feat.x;
+            out.y = kp.feat.y;
+            out.sigma = kp.feat.z;
+            out.scale = kp.feat.w;
+            out.octave = kp.octave;
+            out.orientation = kp.orientation;
+            out._pad[0] = 0.f;
+            out._pad[1] = 0.f;
+            out.descriptor.histrogram.fill(0.f);
+
+            // 4x4 frames of 4x4 samples, summed in the same order as the shader does.
+            for (int frame_y = 0; frame_y < 4; ++frame_y)
+            {
+                for (int frame_x = 0; frame_x < 4; ++frame_x)
+                {
+                    for (int ey = 0; ey < 4; ++ey)
+                    {
+                        for (int ex = 0; ex < 4; ++ex)
+                        {
+                            const int x = px.x + frame_x * 4 + ex - 8;
+                            const int y = px.y + frame_y * 4 + ey - 8;
+                            if (x < 0 || y < 0 || x >= level.width || y >= level.height)
+                                continue;
+                            const float xdiff = level.fetch(x + 1, y) - level.fetch(x - 1, y);
+                            const float ydiff = level.fetch(x, y + 1) - level.fetch(x, y - 1);
+
+                            const float mag = std::sqrt(xdiff * xdiff + ydiff * ydiff);
+                            const float theta = std::atan2(ydiff, xdiff) + pi;
+                            const float g = gaussian(2.5f, glm::length(glm::vec2(float(ex) - 1.5f, float(ey) - 1.5f)));
+
+                            const float angle_diff = glsl_mod((kp.orientation - theta) + 3.f * pi, 2.f * pi);
+                            const int angle_index = std::min(int(std::floor((angle_diff / (2.f * pi)) * 8.f)), 7);
+
+                            const int didx = frame_x + frame_y * 4 + angle_index * 4 * 4;
+                            out.descriptor.histrogram[didx] += g * mag;
+                        }
+                    }
+                }
+            }
+            normalize_descriptor(out.descriptor.histrogram);
+        }
+
+        // Everything up to the descriptors, which only differ in the levels they are sampled from.
+        struct keypoint_detection
+        {
+            std::vector<plane> gaussian_planes;
+            std::vector<mip_chain> dog;
+            std::vector<keypoint> keypoints;
+        };
+
+        keypoint_detection detect_keypoints(const image& img, const detection_settings& settings)
+        {
+            const int num_octaves = int(settings.octaves);
+            const int num_feature_scales = int(settings.feature_scales);
+            // leave out border of a couple of pixels
+            constexpr int border = 8;
+
+            // STEP 1: Generate gauss-blurred images
+            const plane original = to_luminance(img);
+            std::vector<plane> gaussian_planes(num_feature_scales + 3);
+            plane temporary(original.width, original.height);
+            // Each level is blurred incrementally from the previous one, like in apply_gaussian.
+            for (size_t scale = 0; scale < gaussian_planes.size(); ++scale)
+            {
+                gaussian_planes[scale] = plane(original.width, original.height);
+                const plane& source = scale == 0 ? original : gaussian_planes[scale - 1];
+                const auto kernel = level_blur_kernel(int(scale));
+                blur(source, temporary, gaussian_planes[scale], kernel);
+                for (int pass = 1; pass < level_blur_passes(int(scale)); ++pass)
+                    blur(gaussian_planes[scale], temporary, gaussian_planes[scale], kernel);
+            }
+
+            // STEP 2: Generate Difference-of-Gaussian images (only the full-size ones) and build pyramid by downsampling
+            std::vector<mip_chain> dog(gaussian_planes.size() - 1);
+            for_n(int(dog.size()), [&](int scale) {
+                const auto& current = gaussian_planes[scale + 1].values;
+                const auto& previous = gaussian_planes[scale].values;
+                plane diff(original.width, original.height);
+                for (size_t i = 0; i < diff.values.size(); ++i)
+                    diff.values[i] = std::abs(current[i] - previous[i]);
+                dog[scale] = build_mips(std::move(diff), size_t(num_octaves));
+                if (settings.precision == texture_precision::half)
+                {
+                    for (auto& level : dog[scale])
+                        quantize_half(level);
+                }
+                });
+
+            // STEP 3 + 4: Detect feature candidates by testing for extrema, filter them to exclude outliers and to improve accuracy
+            std::vector<std::vector<keypoint>> job_keypoints(size_t(num_octaves) * num_feature_scales);
+            for_n(int(job_keypoints.size()), [&](int job) {
+                const int octave = job / num_feature_scales;
+                const int scale = job % num_feature_scales;
+                const plane& prev = dog[scale][octave];
+                const plane& curr = dog[scale + 1][octave];
+                const plane& next = dog[scale + 2][octave];
+
+                std::vector<std::vector<keypoint>> rows(std::max(curr.height - 2 * border, 0));
+                for_n(int(rows.size()), [&](int row) {
+                    const int y = row + border;
+                    for (int x = border; x < curr.width - border; ++x)
+                    {
+                        keypoint kp;
+                        if (is_extremum(prev, curr, next, x, y) && refine(prev, curr, next, x, y, octave, scale, kp))
+                            rows[row].push_back(kp);
+                    }
+                    });
+                for (const auto& r : rows)
+                    job_keypoints[job].insert(job_keypoints[job].end(), r.begin(), r.end());
+                });
+
+            std::vector<keypoint> keypoints;
+            for (const auto& j : job_keypoints)
+                keypoints.insert(keypoints.end(), j.begin(), j.end());
+
+            // Orientation Computation
+            std::vector<char> oriented(keypoints.size());
+            for_n(int(keypoints.size()), [&](int i) {
+                oriented[i] = assign_orientation(dog, keypoints[i], settings);
+                });
+            size_t num_oriented = 0;
+            for (size_t i = 0; i < keypoints.size(); ++i)
+            {
+                if (oriented[i])
+                    keypoints[num_oriented++] = keypoints[i];
+            }
+            keypoints.resize(num_oriented);
+
+            // Feature Selection
+            if (settings.max_features != 0)
+                select_keypoints(keypoints, original.width, original.height, settings);
+
+            return { std::move(gaussian_planes), std::move(dog), std::move(keypoints) };
+        }
+
+        // binary_descriptor_comp
+        void compute_binary_descriptor(const std::vector<mip_chain>& gaussians, const keypoint& kp, binary_feature& out)
+        {
+            const plane& level = gaussians[level_index(gaussians, kp.feat.z)][kp.octave];
+            const glm::ivec2 px(int(std::round(kp.feat.x)) >> kp.octave, int(std::round(kp.feat.y)) >> kp.octave);
+            const float angle = binary_pattern_angle(kp.orientation);
+            const glm::mat2 rotation(std::cos(angle), std::sin(angle), -std::sin(angle), std::cos(angle));
+
+            out.x = kp.feat.x;
+            out.y = kp.feat.y;
+            out.sigma = kp.feat.z;
+            out.scale = kp.feat.w;
+            out.octave = kp.octave;
+            out.orientation = kp.orientation;
+            out._pad[0] = 0.f;
+            out._pad[1] = 0.f;
+            out.descriptor.bits.fill(0u);
+
+            const auto& pattern = binary_pattern();
+            for (int bit = 0; bit < binary_descriptor_bits; ++bit)
+            {
+                const glm::ivec2 p = px + glm::ivec2(glm::round(rotation * glm::vec2(pattern[bit].x, pattern[bit].y)));
+                const glm::ivec2 q = px + glm::ivec2(glm::round(rotation * glm::vec2(pattern[bit].z, pattern[bit].w)));
+                if (level.fetch_clamped(p.x, p.y) < level.fetch_clamped(q.x, q.y))
+                    out.descriptor.bits[bit / 32] |= 1u << (bit % 32);
+            }
+        }
+    }
+
+    std::vector<feature> detect_features_cpu(const image& img, const detection_settings& settings)
+    {
+        const auto detection = detect_keypoints(img, settings);
+
+        // Descriptor Computation
+        std::vector<feature> features(detection.keypoints.size());
+        for_n(int(features.size()), [&](int i) {
+            compute_descriptor(detection.dog, detection.keypoints[i], features[i]);
+            });
+        return features;
+    }
+
+    std::vector<binary_feature> detect_binary_features_cpu(const image& img, const detection_settings& settings)
+    {
+        auto detection = detect_keypoints(img, settings);
+
+        // Gaussian pyramids, the GPU has them as mipmaps of the gaussian textures.
+        std::vector<mip_chain> gaussians(detection.gaussian_planes.size());
+        for_n(int(gaussians.size()), [&](int scale) {
+            gaussians[scale] = build_mips(std::move(detection.gaussian_planes[scale]), settings.octaves);
+            });
+
+        // Descriptor Computation
+        std::vector<binary_feature> features(detection.keypoints.size());
+        for_n(int(features.size()), [&](int i) {
+            compute_binary_descriptor(gaussians, detection.keypoints[i], features[i]);
+            });
+        return features;
+    }
+
+}
\ No newline at end of file
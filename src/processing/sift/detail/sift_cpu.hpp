@@ -0,0 +1,13 @@
+#pragma once
+
+#include <processing/sift/sift.hpp>
+#include <vector>
+
+namespace mpp::sift::detail
+{
+    // CPU implementation of the SIFT pipeline. Mirrors the OpenGL passes in shaders.hpp step by step,
+    // so results can be used as a reference for the GPU implementation.
+    std::vector<feature> detect_features_cpu(const image& img, const detection_settings& settings);
+    // Same keypoints, with the descriptors of binary_descriptor_comp.
+    std::vector<binary_feature> detect_binary_features_cpu(const image& img, const detection_settings& settings);
+}
\ No newline at end of file
@@ -1,219 +1,273 @@
 #include <processing/sift/sift.hpp>
 #include <processing/sift/detail/sift_state.hpp>
 #include <processing/sift/detail/shaders.hpp>
+#include <processing/sift/detail/scale_space.hpp>
+#include <processing/sift/detail/selection.hpp>
+#include <processing/sift/detail/binary_descriptor.hpp>
+#include <processing/sift/detail/orientation.hpp>
+#include <processing/fnv_hash.hpp>
 #include <opengl/mygl.hpp>
 #include <string>
 #include <spdlog/spdlog.h>
 #include <processing/gl_func.hpp>
+#include <processing/gl_state.hpp>
 #include "sift_state.hpp"
 
 namespace mpp::sift::detail
 {
-
-    std::vector<std::uint32_t> allocate_textures(size_t count)
+    bool supports_persistent_mapping()
     {
-        std::vector<std::uint32_t> tex(count);
-        glGenTextures(int(tex.size()), tex.data());
-        return tex;
+        // glBufferStorage is core since OpenGL 4.4. OpenGL ES only has it as GL_EXT_buffer_storage, which is not loaded.
+        const auto version = reinterpret_cast<const char*>(glGetString(GL_VERSION));
+        if (!version || std::string(version).find("OpenGL ES") != std::string::npos)
+            return false;
+        int major = 0;
+        int minor = 0;
+        glGetIntegerv(GL_MAJOR_VERSION, &major);
+        glGetIntegerv(GL_MINOR_VERSION, &minor);
+        return major > 4 || (major == 4 && minor >= 4);
     }
 
-    void resize_textures(std::vector<std::uint32_t>& tex, int width, int height, GLenum format, int mips)
+    namespace
     {
-        for (auto& id : tex)
+        // Features closer to the image border than this are left out by filter_comp.
+        constexpr int filter_border = 8;
+
+        // Defines the constants right after the #version line, which has to stay the first line of the source.
+        std::string specialize(const char* source, std::initializer_list<std::pair<const char*, std::string>> constants)
         {
-            if (glIsTexture(id))
-                glDeleteTextures(1, &id);
-            glGenTextures(1, &id);
-            glBindTexture(GL_TEXTURE_2D, id);
-            glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-            glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-            glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-            glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-            glTexStorage2D(GL_TEXTURE_2D, mips, format, width, height);
+            std::string result = source;
+            std::string defines;
+            for (const auto& [name, value] : constants)
+                defines += fmt::format("#define {} {}\n", name, value);
+            result.insert(result.find('\n') + 1, defines);
+            return result;
         }
     }
 
-    sift_state::sift_state(size_t num_octaves, size_t num_feature_scales)
-        : num_octaves(num_octaves), num_feature_scales(num_feature_scales)
+    sift_programs::sift_programs()
     {
-        // Allocate Textures needed for SIFT:
-        // gaussian [r16f   ]: num_feature_scales + 2 outer + 1 extra
-        // DoG      [r16f   ]: num_feature_scales + 2 outer
-        // features [rgba16f]: num_feature_scales
-        // temps    [r16f   ]: 2
-        temporary_textures = allocate_textures(2);
-        gaussian_textures = allocate_textures(num_feature_scales + 3);
-        difference_of_gaussian_textures = allocate_textures(num_feature_scales + 2);
-        feature_textures = allocate_textures(num_feature_scales);
-        // Create Renderbuffers for stencil testing
-        feature_stencil_buffers.resize(num_feature_scales * num_octaves);
-        glGenRenderbuffers(int(feature_stencil_buffers.size()), feature_stencil_buffers.data());
-        glGenBuffers(1, &filter_transform_buffer);
-        glGenBuffers(1, &orientation_transform_buffer);
-        glGenBuffers(1, &full_feature_buffer);
-
         // Shared Screen-Filling-Triangle Shader
         const auto screen_vert = create_shader(GL_VERTEX_SHADER, shader_source::screen_vert);
-        const auto empty_fs = create_shader(GL_FRAGMENT_SHADER, "#version 320 es\n"
-            "#if GL_ES\n"
-            "precision highp float;\n"
-            "#endif\n"
-            "void main(){ }");
+        const auto luminance_fs = create_shader(GL_FRAGMENT_SHADER, shader_source::luminance_frag);
+        const auto gauss_cs = create_shader(GL_COMPUTE_SHADER, shader_source::gauss_blur_comp);
+        const auto diff_fs = create_shader(GL_FRAGMENT_SHADER, shader_source::difference_frag);
+        const auto gradient_fs = create_shader(GL_FRAGMENT_SHADER, shader_source::gradient_frag);
+        const auto max_fs = create_shader(GL_FRAGMENT_SHADER, specialize(shader_source::maximize_frag, { { "NEIGHBORS", "0" } }).c_str());
+        const auto filter_cs = create_shader(GL_COMPUTE_SHADER, specialize(shader_source::filter_comp, { { "BORDER", std::to_string(filter_border) } }).c_str());
+        const auto descriptor_cs = create_shader(GL_COMPUTE_SHADER, shader_source::descriptor_comp);
+        const auto binary_descriptor_cs = create_shader(GL_COMPUTE_SHADER, shader_source::binary_descriptor_comp);
+        const auto match_cs = create_shader(GL_COMPUTE_SHADER, shader_source::match_comp);
+        const auto descriptor_norm_cs = create_shader(GL_COMPUTE_SHADER, shader_source::descriptor_norm_comp);
+        const auto histogram_cs = create_shader(GL_COMPUTE_SHADER, shader_source::select_histogram_comp);
+        const auto threshold_cs = create_shader(GL_COMPUTE_SHADER, shader_source::select_threshold_comp);
+        const auto compact_cs = create_shader(GL_COMPUTE_SHADER, shader_source::select_compact_comp);
+
+        // All programs in one batch, so the driver may compile them in parallel.
+        const auto programs = create_programs({
+            { luminance_fs, screen_vert },
+            { gauss_cs },
+            { diff_fs, screen_vert },
+            { gradient_fs, screen_vert },
+            { max_fs, screen_vert },
+            { filter_cs },
+            { descriptor_cs },
+            { histogram_cs },
+            { threshold_cs },
+            { compact_cs },
+            { binary_descriptor_cs },
+            { match_cs },
+            { descriptor_norm_cs },
+            });
+        for (auto shader : { screen_vert, luminance_fs, gauss_cs, diff_fs, gradient_fs, max_fs, filter_cs, descriptor_cs, histogram_cs, threshold_cs, compact_cs, binary_descriptor_cs, match_cs, descriptor_norm_cs })
+            glDeleteShader(shader);
 
-        // Create Gauss-Blur Program for DoG Pyramid Pre-Filtering
+        // Luminance Program to convert the 8-bit source image
         {
-            const auto gauss_fs = create_shader(GL_FRAGMENT_SHADER, shader_source::gauss_blur_frag);
-            gauss_blur.program = create_program({ gauss_fs, screen_vert });
-            glDeleteShader(gauss_fs);
-            gauss_blur.u_mip_location = glGetUniformLocation(gauss_blur.program, "u_mip");
+            luminance.program = programs[0];
+            luminance.u_source_location = glGetUniformLocation(luminance.program, "u_source");
+            luminance.u_weights_location = glGetUniformLocation(luminance.program, "u_weights");
+        }
+
+        // Gauss-Blur Program for DoG Pyramid Pre-Filtering
+        {
+            gauss_blur.program = programs[1];
+            gauss_blur.u_radius_location = glGetUniformLocation(gauss_blur.program, "u_radius");
             gauss_blur.u_dir_location = glGetUniformLocation(gauss_blur.program, "u_dir");
-            gauss_blur.u_sigma_location = glGetUniformLocation(gauss_blur.program, "u_sigma");
-            gauss_blur.in_texture_location = glGetUniformLocation(gauss_blur.program, "in_texture");
+            gauss_blur.u_input_location = glGetUniformLocation(gauss_blur.program, "u_input");
+            gauss_blur.u_input_layer_location = glGetUniformLocation(gauss_blur.program, "u_input_layer");
         }
 
-        // Create Difference Program for DoG Pyramid Generation
+        // Difference Program for DoG Pyramid Generation
         {
-            const auto diff_fs = create_shader(GL_FRAGMENT_SHADER, shader_source::difference_frag);
-            difference.program = create_program({ diff_fs, screen_vert });
-            glDeleteShader(diff_fs);
-            difference.u_current_tex_location = glGetUniformLocation(difference.program, "u_current_tex");
-            difference.u_previous_tex_location = glGetUniformLocation(difference.program, "u_previous_tex");
+            difference.program = programs[2];
+            difference.u_gaussians_location = glGetUniformLocation(difference.program, "u_gaussians");
+            difference.u_scale_location = glGetUniformLocation(difference.program, "u_scale");
         }
 
-        // Create Maximize Program for First Feature Selection
+        // Gradient Program for the Descriptor Computation
         {
-            const auto max_fs = create_shader(GL_FRAGMENT_SHADER, shader_source::maximize_frag);
-            maximize.program = create_program({ max_fs, screen_vert });
-            glDeleteShader(max_fs);
-            maximize.u_previous_tex_location = glGetUniformLocation(maximize.program, "u_previous_tex");
-            maximize.u_current_tex_location = glGetUniformLocation(maximize.program, "u_current_tex");
-            maximize.u_next_tex_location = glGetUniformLocation(maximize.program, "u_next_tex");
-            maximize.u_neighbors_location = glGetUniformLocation(maximize.program, "u_neighbors");
+            gradient.program = programs[3];
+            gradient.u_input_location = glGetUniformLocation(gradient.program, "u_input");
+            gradient.u_layer_location = glGetUniformLocation(gradient.program, "u_layer");
+            gradient.u_mip_location = glGetUniformLocation(gradient.program, "u_mip");
+        }
+
+        // Maximize Program for First Feature Selection
+        {
+            maximize.program = programs[4];
+            maximize.u_differences_location = glGetUniformLocation(maximize.program, "u_differences");
+            maximize.u_mask_location = glGetUniformLocation(maximize.program, "u_mask");
+            maximize.u_masked_location = glGetUniformLocation(maximize.program, "u_masked");
             maximize.u_mip_location = glGetUniformLocation(maximize.program, "u_mip");
             maximize.u_scale_location = glGetUniformLocation(maximize.program, "u_scale");
         }
 
-        // Create Filter Program to remove outliers
+        // Filter Program to remove outliers
         {
-            const auto filter_gs = create_shader(GL_GEOMETRY_SHADER, shader_source::filter_geom);
-            const auto filter_vs = create_shader(GL_VERTEX_SHADER, shader_source::filter_vert);
+            filter.program = programs[5];
+            filter.u_differences_location = glGetUniformLocation(filter.program, "u_differences");
+            filter.u_features_location = glGetUniformLocation(filter.program, "u_features");
+            filter.u_scale_location = glGetUniformLocation(filter.program, "u_scale");
+            filter.u_mip_location = glGetUniformLocation(filter.program, "u_mip");
+        }
 
-            filter.program = glCreateProgram();
+        // Descriptor Program
+        {
+            descriptor.program = programs[6];
+            descriptor.u_gradients_location = glGetUniformLocation(descriptor.program, "u_gradients");
+            descriptor.u_compact_location = glGetUniformLocation(descriptor.program, "u_compact");
+        }
 
-            constexpr const char* tf_out_names[3]{ "feature", "octave", "pad3" };
-            glTransformFeedbackVaryings(filter.program, int(std::size(tf_out_names)), std::data(tf_out_names), GL_INTERLEAVED_ATTRIBS);
+        // Binary Descriptor Program
+        {
+            binary_descriptor.program = programs[10];
+            binary_descriptor.u_gaussians_location = glGetUniformLocation(binary_descriptor.program, "u_gaussians");
+        }
 
-            glAttachShader(filter.program, filter_vs);
-            glAttachShader(filter.program, filter_gs);
-            glAttachShader(filter.program, empty_fs);
-            glLinkProgram(filter.program);
-            int log_len;
-            glGetProgramiv(filter.program, GL_INFO_LOG_LENGTH, &log_len);
-            if (log_len > 3)
-            {
-                std::string info_log(log_len, '\0');
-                glGetProgramInfoLog(filter.program, log_len, &log_len, info_log.data());
-                spdlog::info("Shader Compilation Output:\n{}", info_log);
-            }
-            glDetachShader(filter.program, filter_vs);
-            glDetachShader(filter.program, filter_gs);
-            glDetachShader(filter.program, empty_fs);
+        // Feature Selection Programs
+        {
+            select_histogram.program = programs[7];
+            select_histogram.u_grid_location = glGetUniformLocation(select_histogram.program, "u_grid");
+            select_histogram.u_size_location = glGetUniformLocation(select_histogram.program, "u_size");
 
-            glDeleteShader(filter_vs);
-            glDeleteShader(filter_gs);
+            select_threshold.program = programs[8];
+            select_threshold.u_grid_location = glGetUniformLocation(select_threshold.program, "u_grid");
+            select_threshold.u_max_features_location = glGetUniformLocation(select_threshold.program, "u_max_features");
 
-            filter.u_previous_tex_location = glGetUniformLocation(filter.program, "u_previous_tex");
-            filter.u_current_tex_location = glGetUniformLocation(filter.program, "u_current_tex");
-            filter.u_next_tex_location = glGetUniformLocation(filter.program, "u_next_tex");
-            filter.u_feature_tex_location = glGetUniformLocation(filter.program, "u_feature_tex");
-            filter.u_scale_location = glGetUniformLocation(filter.program, "u_scale");
-            filter.u_mip_location = glGetUniformLocation(filter.program, "u_mip");
-            filter.u_border_location = glGetUniformLocation(filter.program, "u_border");
+            select_compact.program = programs[9];
+            select_compact.u_grid_location = glGetUniformLocation(select_compact.program, "u_grid");
+            select_compact.u_size_location = glGetUniformLocation(select_compact.program, "u_size");
         }
 
-        // Create Orientation Program
+        // Matching Program
         {
-            const auto orientation_gs = create_shader(GL_GEOMETRY_SHADER, shader_source::orientation_geom);
-            const auto orientation_vs = create_shader(GL_VERTEX_SHADER, shader_source::orientation_vert);
+            match.program = programs[11];
+            match.u_count_a_location = glGetUniformLocation(match.program, "u_count_a");
+            match.u_count_b_location = glGetUniformLocation(match.program, "u_count_b");
+            match.u_relation_threshold_location = glGetUniformLocation(match.program, "u_relation_threshold");
+            match.u_similarity_threshold_location = glGetUniformLocation(match.program, "u_similarity_threshold");
 
-            orientation.program = glCreateProgram();
+            descriptor_norm.program = programs[12];
+            descriptor_norm.u_count_location = glGetUniformLocation(descriptor_norm.program, "u_count");
+        }
+    }
+    sift_programs::~sift_programs()
+    {
+        glDeleteProgram(luminance.program);
+        glDeleteProgram(gauss_blur.program);
+        glDeleteProgram(difference.program);
+        glDeleteProgram(maximize.program);
+        glDeleteProgram(filter.program);
+        glDeleteProgram(gradient.program);
+        glDeleteProgram(descriptor.program);
+        glDeleteProgram(binary_descriptor.program);
+        glDeleteProgram(select_histogram.program);
+        glDeleteProgram(select_threshold.program);
+        glDeleteProgram(select_compact.program);
+        glDeleteProgram(match.program);
+        glDeleteProgram(descriptor_norm.program);
+    }
 
-            constexpr const char* tf_out_names[4] { "feature", "octave", "orientation", "pad2" };
-            glTransformFeedbackVaryings(orientation.program, int(std::size(tf_out_names)), std::data(tf_out_names), GL_INTERLEAVED_ATTRIBS);
+    sift_variant_programs::sift_variant_programs(const detection_settings& settings)
+    {
+        const auto orientation_cs = create_shader(GL_COMPUTE_SHADER, specialize(shader_source::orientation_comp, {
+            { "ORIENTATION_SLICES", std::to_string(orientation_slices(settings)) },
+            }).c_str());
+        orientation.program = create_program({ orientation_cs });
+        glDeleteShader(orientation_cs);
 
-            glAttachShader(orientation.program, orientation_vs);
-            glAttachShader(orientation.program, orientation_gs);
-            glAttachShader(orientation.program, empty_fs);
-            glLinkProgram(orientation.program);
-            int log_len;
-            glGetProgramiv(orientation.program, GL_INFO_LOG_LENGTH, &log_len);
-            if (log_len > 3)
-            {
-                std::string info_log(log_len, '\0');
-                glGetProgramInfoLog(orientation.program, log_len, &log_len, info_log.data());
-                spdlog::info("Shader Compilation Output:\n{}", info_log);
-            }
-            glDetachShader(orientation.program, orientation_vs);
-            glDetachShader(orientation.program, orientation_gs);
-            glDetachShader(orientation.program, empty_fs);
+        orientation.u_differences_location = glGetUniformLocation(orientation.program, "u_differences");
+        orientation.u_magnitude_threshold_location = glGetUniformLocation(orientation.program, "u_magnitude_threshold");
+    }
+    sift_variant_programs::~sift_variant_programs()
+    {
+        glDeleteProgram(orientation.program);
+    }
+
+    std::uint64_t sift_variant_programs::variant_key(const detection_settings& settings)
+    {
+        std::uint64_t hash = fnv1a_offset_basis;
+        fnv1a(hash, orientation_slices(settings));
+        return hash;
+    }
 
-            glDeleteShader(orientation_vs);
-            glDeleteShader(orientation_gs);
+    sift_state::sift_state(std::shared_ptr<const sift_programs> programs, std::shared_ptr<texture_pool> pool, size_t num_octaves, size_t num_feature_scales)
+        : num_octaves(num_octaves), num_feature_scales(num_feature_scales), timestamps(size_t(detection_stage::count)),
+        programs(std::move(programs)), pool(std::move(pool))
+    {
+        glGenBuffers(1, &filter_buffer);
+        glGenBuffers(1, &orientation_buffer);
+        glGenBuffers(1, &oriented_buffer);
+        glGenBuffers(1, &full_feature_buffer);
+        glGenBuffers(1, &upload_buffer);
 
-            orientation.u_textures_locations[0] = glGetUniformLocation(orientation.program, "u_textures[0]");
-            orientation.u_textures_locations[1] = glGetUniformLocation(orientation.program, "u_textures[1]");
-            orientation.u_textures_locations[2] = glGetUniformLocation(orientation.program, "u_textures[2]");
-            orientation.u_textures_locations[3] = glGetUniformLocation(orientation.program, "u_textures[3]");
-            orientation.u_textures_locations[4] = glGetUniformLocation(orientation.program, "u_textures[4]");
-            orientation.u_textures_locations[5] = glGetUniformLocation(orientation.program, "u_textures[5]");
-            orientation.u_textures_locations[6] = glGetUniformLocation(orientation.program, "u_textures[6]");
-            orientation.u_textures_locations[7] = glGetUniformLocation(orientation.program, "u_textures[7]");
-            orientation.u_textures_locations[8] = glGetUniformLocation(orientation.program, "u_textures[8]");
-            orientation.u_textures_locations[9] = glGetUniformLocation(orientation.program, "u_textures[9]");
-            orientation.u_textures_locations[10] = glGetUniformLocation(orientation.program, "u_textures[10]");
-            orientation.u_textures_locations[11] = glGetUniformLocation(orientation.program, "u_textures[11]");
-            orientation.u_textures_locations[12] = glGetUniformLocation(orientation.program, "u_textures[12]");
-            orientation.u_textures_locations[13] = glGetUniformLocation(orientation.program, "u_textures[13]");
-            orientation.u_textures_locations[14] = glGetUniformLocation(orientation.program, "u_textures[14]");
-            orientation.u_textures_locations[15] = glGetUniformLocation(orientation.program, "u_textures[15]");
+        // Two headers: filter_buffer and orientation_buffer.
+        persistent_readback = supports_persistent_mapping();
+        glGenBuffers(1, &header_readback_buffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, header_readback_buffer);
+        if (persistent_readback)
+        {
+            glBufferStorage(GL_COPY_WRITE_BUFFER, 2 * sizeof(feature_buffer_header), nullptr, GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+            mapped_headers = static_cast<const feature_buffer_header*>(glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, 2 * sizeof(feature_buffer_header),
+                GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT));
+        }
+        else
+        {
+            glBufferData(GL_COPY_WRITE_BUFFER, 2 * sizeof(feature_buffer_header), nullptr, GL_STREAM_READ);
         }
 
+        // Precompute the blur kernels of all gaussian levels
         {
-            const auto descriptor_cs = create_shader(GL_COMPUTE_SHADER, shader_source::descriptor_comp);
-            descriptor.program = glCreateProgram();
-            glAttachShader(descriptor.program, descriptor_cs);
-            glLinkProgram(descriptor.program);
-            int log_len;
-            glGetProgramiv(descriptor.program, GL_INFO_LOG_LENGTH, &log_len);
-            if (log_len > 3)
+            // std140 layout of GaussKernel: vec4 u_weights[16]
+            constexpr size_t kernel_block_size = (max_blur_radius + 1) * sizeof(float);
+            int alignment = 1;
+            glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+            gauss_kernel_stride = (kernel_block_size + alignment - 1) / alignment * alignment;
+
+            const size_t num_gaussian_levels = num_feature_scales + 3;
+            std::vector<float> weights(num_gaussian_levels * gauss_kernel_stride / sizeof(float), 0.f);
+            for (size_t scale = 0; scale < num_gaussian_levels; ++scale)
             {
-                std::string info_log(log_len, '\0');
-                glGetProgramInfoLog(descriptor.program, log_len, &log_len, info_log.data());
-                spdlog::info("Shader Compilation Output:\n{}", info_log);
+                const auto kernel = level_blur_kernel(int(scale));
+                gauss_kernel_radii.push_back(int(kernel.size()) - 1);
+                gauss_kernel_passes.push_back(level_blur_passes(int(scale)));
+                std::copy(kernel.begin(), kernel.end(), weights.begin() + scale * gauss_kernel_stride / sizeof(float));
             }
-            glDetachShader(descriptor.program, descriptor_cs);
+            glGenBuffers(1, &gauss_kernel_buffer);
+            glBindBuffer(GL_UNIFORM_BUFFER, gauss_kernel_buffer);
+            glBufferData(GL_UNIFORM_BUFFER, weights.size() * sizeof(float), weights.data(), GL_STATIC_DRAW);
+        }
 
-            glDeleteShader(descriptor_cs);
+        // std140 layout of BinaryPattern: vec4 u_pairs[256], same as the array.
+        const auto& pattern = binary_pattern();
+        glGenBuffers(1, &binary_pattern_buffer);
+        glBindBuffer(GL_UNIFORM_BUFFER, binary_pattern_buffer);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(pattern), pattern.data(), GL_STATIC_DRAW);
 
-            descriptor.u_textures_locations[0] = glGetUniformLocation(descriptor.program, "u_textures[0]");
-            descriptor.u_textures_locations[1] = glGetUniformLocation(descriptor.program, "u_textures[1]");
-            descriptor.u_textures_locations[2] = glGetUniformLocation(descriptor.program, "u_textures[2]");
-            descriptor.u_textures_locations[3] = glGetUniformLocation(descriptor.program, "u_textures[3]");
-            descriptor.u_textures_locations[4] = glGetUniformLocation(descriptor.program, "u_textures[4]");
-            descriptor.u_textures_locations[5] = glGetUniformLocation(descriptor.program, "u_textures[5]");
-            descriptor.u_textures_locations[6] = glGetUniformLocation(descriptor.program, "u_textures[6]");
-            descriptor.u_textures_locations[7] = glGetUniformLocation(descriptor.program, "u_textures[7]");
-            descriptor.u_textures_locations[8] = glGetUniformLocation(descriptor.program, "u_textures[8]");
-            descriptor.u_textures_locations[9] = glGetUniformLocation(descriptor.program, "u_textures[9]");
-            descriptor.u_textures_locations[10] = glGetUniformLocation(descriptor.program, "u_textures[10]");
-            descriptor.u_textures_locations[11] = glGetUniformLocation(descriptor.program, "u_textures[11]");
-            descriptor.u_textures_locations[12] = glGetUniformLocation(descriptor.program, "u_textures[12]");
-            descriptor.u_textures_locations[13] = glGetUniformLocation(descriptor.program, "u_textures[13]");
-            descriptor.u_textures_locations[14] = glGetUniformLocation(descriptor.program, "u_textures[14]");
-            descriptor.u_textures_locations[15] = glGetUniformLocation(descriptor.program, "u_textures[15]");
-        }
-        glDeleteShader(empty_fs);
-        glDeleteShader(screen_vert);
+        glGenBuffers(1, &bucket_buffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, bucket_buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, max_selection_grid * max_selection_grid * selection_bucket_size, nullptr, GL_DYNAMIC_COPY);
 
         // Create one Framebuffer for each Octave (mip-level)
         framebuffers.resize(num_octaves);
@@ -221,48 +275,64 @@ namespace mpp::sift::detail
 
         // Create an empty vertex array to draw a screen-filling-triangle
         glGenVertexArrays(1, &empty_vao);
-        glGenVertexArrays(1, &orientation_vao);
     }
-    void sift_state::resize(int width, int height)
+    void sift_state::resize(int width, int height, int components, texture_precision precision)
+    {
+        if (!textures || width != this->width || height != this->height || precision != textures->precision)
+        {
+            pool->release(std::move(textures));
+            textures = pool->acquire(width, height, precision);
+            this->width = width;
+            this->height = height;
+        }
+        textures->reserve_source(components);
+    }
+    void sift_state::reserve_features(std::uint32_t capacity)
     {
-        if (width == this->width && height == this->height)
+        if (capacity <= feature_capacity)
             return;
+        feature_capacity = capacity;
 
-        this->width = width;
-        this->height = height;
-
-        resize_textures(temporary_textures, width, height, GL_R32F, int(num_octaves));
-        resize_textures(gaussian_textures, width, height, GL_R32F, int(num_octaves));
-        resize_textures(difference_of_gaussian_textures, width, height, GL_R32F, int(num_octaves));
-        resize_textures(feature_textures, width, height, GL_RGBA32F, int(num_octaves));
+        const auto compact_size = sizeof(feature_buffer_header) + size_t(capacity) * sizeof(feature_buffer_entry);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, filter_buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, compact_size, nullptr, GL_DYNAMIC_COPY);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, orientation_buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, compact_size, nullptr, GL_DYNAMIC_COPY);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, oriented_buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, compact_size, nullptr, GL_DYNAMIC_COPY);
 
-        for (int oct = 0; oct < num_octaves; ++oct)
+        const auto full_size = size_t(capacity) * sizeof(feature);
+        if (persistent_readback)
         {
-            for (int feat = 0; feat < num_feature_scales; ++feat)
-            {
-                glBindRenderbuffer(GL_RENDERBUFFER, feature_stencil_buffers[feat + oct * num_feature_scales]);
-                glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width >> oct, height >> oct);
-            }
+            // Immutable storage can't be resized, so the buffer is replaced. Deleting it also unmaps it.
+            glDeleteBuffers(1, &full_feature_buffer);
+            glGenBuffers(1, &full_feature_buffer);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, full_feature_buffer);
+            glBufferStorage(GL_SHADER_STORAGE_BUFFER, full_size, nullptr, GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+            mapped_features = glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, full_size,
+                GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+        }
+        else
+        {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, full_feature_buffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, full_size, nullptr, GL_DYNAMIC_COPY);
         }
     }
     sift_state::~sift_state()
     {
-        glDeleteBuffers(1, &filter_transform_buffer);
-        glDeleteBuffers(1, &orientation_transform_buffer);
+        glDeleteBuffers(1, &filter_buffer);
+        glDeleteBuffers(1, &orientation_buffer);
+        glDeleteBuffers(1, &oriented_buffer);
+        glDeleteBuffers(1, &bucket_buffer);
         glDeleteBuffers(1, &full_feature_buffer);
-        glDeleteVertexArrays(1, &empty_vao);
-        glDeleteVertexArrays(1, &orientation_vao);
-        glDeleteFramebuffers(int(framebuffers.size()), framebuffers.data());
-        glDeleteTextures(int(temporary_textures.size()), temporary_textures.data());
-        glDeleteTextures(int(gaussian_textures.size()), gaussian_textures.data());
-        glDeleteTextures(int(difference_of_gaussian_textures.size()), difference_of_gaussian_textures.data());
-        glDeleteTextures(int(feature_textures.size()), feature_textures.data());
-        glDeleteRenderbuffers(int(feature_stencil_buffers.size()), feature_stencil_buffers.data());
-        glDeleteProgram(gauss_blur.program);
-        glDeleteProgram(difference.program);
-        glDeleteProgram(maximize.program);
-        glDeleteProgram(filter.program);
-        glDeleteProgram(orientation.program);
-        glDeleteProgram(descriptor.program);
+        glDeleteBuffers(1, &header_readback_buffer);
+        glDeleteBuffers(1, &upload_buffer);
+        glDeleteBuffers(1, &gauss_kernel_buffer);
+        glDeleteBuffers(1, &binary_pattern_buffer);
+        if (readback_fence)
+            glDeleteSync(readback_fence);
+        gl_state::current().delete_vertex_arrays(1, &empty_vao);
+        gl_state::current().delete_framebuffers(int(framebuffers.size()), framebuffers.data());
+        pool->release(std::move(textures));
     }
 }
\ No newline at end of file
@@ -1,80 +1,238 @@
 #pragma once
 
+#include <processing/sift/sift.hpp>
+#include <processing/sift/detail/texture_pool.hpp>
+#include <processing/gl_clock.hpp>
 #include <vector>
+#include <memory>
 #include <cstdint>
 
+struct __GLsync;
+
 namespace mpp::sift::detail
 {
-    struct sift_state
+    // Header of the compacted feature buffers. The first three values are the glDispatchComputeIndirect
+    // arguments for the next stage, count is the number of features appended by the shaders.
+    struct feature_buffer_header
+    {
+        std::uint32_t num_groups[3];
+        std::uint32_t count;
+    };
+
+    // Feature layout in the compacted buffers, as written by the filter and orientation stages.
+    struct feature_buffer_entry
+    {
+        float feature[4];
+        std::int32_t octave;
+        float orientation;
+        float response; // difference-of-gaussian value at the extremum, used for the selection
+        std::int32_t _pad;
+    };
+
+    // Header of the output buffer of match_comp, followed by one indexed_match per match.
+    struct match_buffer_header
+    {
+        std::uint32_t count;
+    };
+
+    // Output of the descriptor stage, which also decides the feature type that is read back.
+    enum class descriptor_format
+    {
+        histogram, // feature
+        compact_histogram, // compact_feature
+        binary // binary_feature, from the gaussian levels instead of the gradients
+    };
+
+    // Timestamps recorded into sift_state::timestamps. Each one marks the end of the stage it is named after.
+    enum class detection_stage
+    {
+        begin,
+        upload,
+        blur,
+        difference_of_gaussian,
+        extrema,
+        gradients,
+        filter,
+        orientation,
+        selection,
+        descriptor,
+        count
+    };
+
+    // Programs of all SIFT passes. They only depend on the shader sources, so one set is shared by all
+    // sift_states of a cache.
+    struct sift_programs
     {
         using uniform_t = std::int32_t;
 
-        sift_state(size_t num_octaves, size_t num_feature_scales);
-        void resize(int width, int height);
-        ~sift_state();
+        sift_programs();
+        ~sift_programs();
 
-        sift_state(const sift_state&) = delete;
-        sift_state(sift_state&&) = delete;
-        sift_state& operator=(const sift_state&) = delete;
-        sift_state& operator=(sift_state&&) = delete;
+        sift_programs(const sift_programs&) = delete;
+        sift_programs(sift_programs&&) = delete;
+        sift_programs& operator=(const sift_programs&) = delete;
+        sift_programs& operator=(sift_programs&&) = delete;
 
-        int width = -1;
-        int height = -1;
-        size_t num_octaves;
-        size_t num_feature_scales;
-        std::vector<std::uint32_t> temporary_textures;
-        std::vector<std::uint32_t> gaussian_textures;
-        std::vector<std::uint32_t> difference_of_gaussian_textures;
-        std::vector<std::uint32_t> feature_textures;
-        std::vector<std::uint32_t> feature_stencil_buffers;
-        std::vector<std::uint32_t> framebuffers;
-        std::uint32_t filter_transform_buffer;
-        std::uint32_t orientation_transform_buffer;
-        std::uint32_t full_feature_buffer;
-        std::uint32_t orientation_vao;
-        std::uint32_t empty_vao;
+        struct {
+            std::uint32_t program;
+            uniform_t  u_source_location;
+            uniform_t  u_weights_location;
+        } luminance;
 
         struct {
             std::uint32_t program;
-            uniform_t  u_mip_location;
+            uniform_t  u_radius_location;
             uniform_t  u_dir_location;
-            uniform_t  u_sigma_location;
-            uniform_t  in_texture_location;                    
+            uniform_t  u_input_location;
+            uniform_t  u_input_layer_location;
         } gauss_blur;
 
         struct {
             std::uint32_t program;
-            uniform_t  u_current_tex_location;
-            uniform_t  u_previous_tex_location;
+            uniform_t  u_gaussians_location;
+            uniform_t  u_scale_location;
         } difference;
 
         struct {
             std::uint32_t program;
-            uniform_t  u_previous_tex_location;
-            uniform_t  u_current_tex_location;
-            uniform_t  u_next_tex_location;
-            uniform_t  u_neighbors_location;
+            uniform_t  u_differences_location;
+            uniform_t  u_mask_location;
+            uniform_t  u_masked_location;
             uniform_t  u_mip_location;
             uniform_t  u_scale_location;
         } maximize;
 
         struct {
             std::uint32_t program;
-            uniform_t u_previous_tex_location;
-            uniform_t u_current_tex_location;
-            uniform_t u_next_tex_location;
-            uniform_t u_feature_tex_location;
+            uniform_t u_differences_location;
+            uniform_t u_features_location;
             uniform_t u_scale_location;
             uniform_t u_mip_location;
-            uniform_t u_border_location;
         } filter;
         struct {
             std::uint32_t program;
-            uniform_t u_textures_locations[16];
-        } orientation;
+            uniform_t u_input_location;
+            uniform_t u_layer_location;
+            uniform_t u_mip_location;
+        } gradient;
         struct {
             std::uint32_t program;
-            uniform_t u_textures_locations[16];
+            uniform_t u_gradients_location;
+            uniform_t u_compact_location;
         } descriptor;
+        struct {
+            std::uint32_t program;
+            uniform_t u_gaussians_location;
+        } binary_descriptor;
+        struct {
+            std::uint32_t program;
+            uniform_t u_grid_location;
+            uniform_t u_size_location;
+        } select_histogram;
+        struct {
+            std::uint32_t program;
+            uniform_t u_grid_location;
+            uniform_t u_max_features_location;
+        } select_threshold;
+        struct {
+            std::uint32_t program;
+            uniform_t u_grid_location;
+            uniform_t u_size_location;
+        } select_compact;
+        struct {
+            std::uint32_t program;
+            uniform_t u_count_a_location;
+            uniform_t u_count_b_location;
+            uniform_t u_relation_threshold_location;
+            uniform_t u_similarity_threshold_location;
+        } match;
+        struct {
+            std::uint32_t program;
+            uniform_t u_count_location;
+        } descriptor_norm;
+    };
+
+    // Programs which have the orientation slice count compiled in as a constant, so their loops have a fixed length and
+    // can be unrolled. Continuous settings like the magnitude threshold stay uniforms, so tuning them does not compile
+    // a new program. A cache keeps the most recently used sets by variant_key.
+    struct sift_variant_programs
+    {
+        using uniform_t = std::int32_t;
+
+        explicit sift_variant_programs(const detection_settings& settings);
+        ~sift_variant_programs();
+
+        sift_variant_programs(const sift_variant_programs&) = delete;
+        sift_variant_programs(sift_variant_programs&&) = delete;
+        sift_variant_programs& operator=(const sift_variant_programs&) = delete;
+        sift_variant_programs& operator=(sift_variant_programs&&) = delete;
+
+        // Identifies the settings the programs depend on.
+        static std::uint64_t variant_key(const detection_settings& settings);
+
+        struct {
+            std::uint32_t program;
+            uniform_t u_differences_location;
+            uniform_t u_magnitude_threshold_location;
+        } orientation;
+    };
+
+    struct sift_state
+    {
+        sift_state(std::shared_ptr<const sift_programs> programs, std::shared_ptr<texture_pool> pool, size_t num_octaves, size_t num_feature_scales);
+        void resize(int width, int height, int components, texture_precision precision);
+        void reserve_features(std::uint32_t capacity);
+        ~sift_state();
+
+        sift_state(const sift_state&) = delete;
+        sift_state(sift_state&&) = delete;
+        sift_state& operator=(const sift_state&) = delete;
+        sift_state& operator=(sift_state&&) = delete;
+
+        int width = -1;
+        int height = -1;
+        size_t num_octaves;
+        size_t num_feature_scales;
+        // Taken from the pool on resize and given back when the size changes again.
+        std::unique_ptr<texture_set> textures;
+        std::uint32_t upload_buffer;
+        std::vector<std::uint32_t> framebuffers;
+        // filter and orientation buffers start with a feature_buffer_header, followed by the features.
+        std::uint32_t filter_buffer;
+        std::uint32_t orientation_buffer;
+        // With a feature budget the orientation stage writes into oriented_buffer, and only the selected
+        // features are compacted into orientation_buffer.
+        std::uint32_t oriented_buffer;
+        std::uint32_t full_feature_buffer;
+        std::uint32_t feature_capacity = 0;
+        std::uint32_t empty_vao;
+        // One bucket of select_threshold_comp per grid cell, allocated for the largest grid.
+        std::uint32_t bucket_buffer;
+
+        // Weights of the incremental blur for each gaussian level, one GaussKernel block of gauss_blur_comp
+        // every gauss_kernel_stride bytes. They only depend on the level, so they are uploaded once.
+        std::uint32_t gauss_kernel_buffer;
+        size_t gauss_kernel_stride;
+        std::vector<int> gauss_kernel_radii;
+        std::vector<int> gauss_kernel_passes; // wide blurs are split, see blur_passes
+        // BinaryPattern block of binary_descriptor_comp, see binary_pattern.
+        std::uint32_t binary_pattern_buffer;
+
+        // Receives copies of the filter_buffer and orientation_buffer headers after the descriptor stage.
+        std::uint32_t header_readback_buffer;
+        // With persistent readback the header and full feature buffers stay mapped for the lifetime of the state,
+        // otherwise they are mapped once the readback fence has been signaled.
+        bool persistent_readback;
+        const feature_buffer_header* mapped_headers = nullptr;
+        // Features, compact_features or binary_features, depending on how the descriptor stage was run.
+        const void* mapped_features = nullptr;
+        struct __GLsync* readback_fence = nullptr;
+        // Read together with the results, the readback fence guarantees they are available by then.
+        gl_timestamp_queries timestamps;
+
+        std::shared_ptr<const sift_programs> programs;
+        // Programs for the settings of the current detection, set when it is submitted.
+        std::shared_ptr<const sift_variant_programs> variant_programs;
+        std::shared_ptr<texture_pool> pool;
     };
 }
\ No newline at end of file
@@ -0,0 +1,164 @@
+#include <processing/sift/detail/texture_pool.hpp>
+#include <processing/gl_state.hpp>
+#include <opengl/mygl.hpp>
+#include <spdlog/spdlog.h>
+#include <algorithm>
+
+namespace mpp::sift::detail
+{
+    namespace
+    {
+        layered_texture allocate_textures(size_t layers, int width, int height, GLenum format, int mips)
+        {
+            layered_texture tex;
+            tex.layers = int(layers);
+            glGenTextures(1, &tex.id);
+            gl_state::current().bind_texture_array(0, tex.id);
+            glTexParameterf(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameterf(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameterf(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameterf(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexStorage3D(GL_TEXTURE_2D_ARRAY, mips, format, width, height, tex.layers);
+            return tex;
+        }
+
+        size_t mip_chain_size(int width, int height, size_t texel_size, size_t mips)
+        {
+            size_t size = 0;
+            for (size_t mip = 0; mip < mips; ++mip)
+                size += size_t(std::max(width >> mip, 1)) * size_t(std::max(height >> mip, 1)) * texel_size;
+            return size;
+        }
+    }
+
+    texture_set::texture_set(int width, int height, texture_precision precision, size_t num_octaves, size_t num_feature_scales)
+        : width(width), height(height), precision(precision)
+    {
+        // The compute blur writes the gaussian and temporary textures as r32f images, OpenGL ES has no r16f image format.
+        // Everything after the blur can be stored in half precision.
+        const bool half = precision == texture_precision::half;
+        const GLenum difference_format = half ? GL_R16F : GL_R32F;
+        const GLenum feature_format = half ? GL_RGBA16F : GL_RGBA32F;
+        const GLenum gradient_format = half ? GL_RG16F : GL_RG32F;
+
+        // Allocate Textures needed for SIFT, one array layer per scale:
+        // gaussian [r32f        ]: num_feature_scales + 2 outer + 1 extra
+        // DoG      [r32f/r16f   ]: num_feature_scales + 2 outer
+        // features [rgba32f/16f ]: num_feature_scales
+        // gradient [rg32f/16f   ]: num_feature_scales + 2 outer
+        // temps    [r32f        ]: 2
+        temporary_textures = allocate_textures(2, width, height, GL_R32F, int(num_octaves));
+        gaussian_textures = allocate_textures(num_feature_scales + 3, width, height, GL_R32F, int(num_octaves));
+        difference_of_gaussian_textures = allocate_textures(num_feature_scales + 2, width, height, difference_format, int(num_octaves));
+        feature_textures = allocate_textures(num_feature_scales, width, height, feature_format, int(num_octaves));
+        gradient_textures = allocate_textures(num_feature_scales + 2, width, height, gradient_format, int(num_octaves));
+
+        const size_t difference_texel_size = half ? 2 : 4;
+        const size_t feature_texel_size = half ? 8 : 16;
+        const size_t gradient_texel_size = half ? 4 : 8;
+        memory_size = size_t(temporary_textures.layers + gaussian_textures.layers) * mip_chain_size(width, height, 4, num_octaves)
+            + size_t(difference_of_gaussian_textures.layers) * mip_chain_size(width, height, difference_texel_size, num_octaves)
+            + size_t(feature_textures.layers) * mip_chain_size(width, height, feature_texel_size, num_octaves)
+            + size_t(gradient_textures.layers) * mip_chain_size(width, height, gradient_texel_size, num_octaves)
+            + mip_chain_size(width, height, 4, 1) // source, at most rgba8
+            + mip_chain_size(width, height, 1, 1); // mask
+    }
+
+    texture_set::~texture_set()
+    {
+        gl_state::current().delete_textures(1, &source_texture);
+        gl_state::current().delete_textures(1, &mask_texture);
+        gl_state::current().delete_textures(1, &temporary_textures.id);
+        gl_state::current().delete_textures(1, &gaussian_textures.id);
+        gl_state::current().delete_textures(1, &difference_of_gaussian_textures.id);
+        gl_state::current().delete_textures(1, &feature_textures.id);
+        gl_state::current().delete_textures(1, &gradient_textures.id);
+    }
+
+    void texture_set::reserve_source(int components)
+    {
+        if (components == source_components)
+            return;
+
+        // Matches the formats used for the upload, see upload_source in sift.cpp.
+        constexpr GLenum source_formats[] = { GL_R8, GL_RG8, GL_RGB8, GL_RGBA8 };
+        source_components = components;
+        gl_state::current().delete_textures(1, &source_texture);
+        glGenTextures(1, &source_texture);
+        gl_state::current().bind_texture(0, source_texture);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexStorage2D(GL_TEXTURE_2D, 1, source_formats[components - 1], width, height);
+    }
+
+    void texture_set::reserve_mask()
+    {
+        if (mask_texture != 0)
+            return;
+
+        glGenTextures(1, &mask_texture);
+        gl_state::current().bind_texture(0, mask_texture);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexStorage2D(GL_TEXTURE_2D, 1, GL_R8, width, height);
+    }
+
+    texture_pool::texture_pool(size_t num_octaves, size_t num_feature_scales, size_t memory_budget)
+        : _num_octaves(num_octaves), _num_feature_scales(num_feature_scales), _memory_budget(memory_budget)
+    {
+    }
+
+    std::unique_ptr<texture_set> texture_pool::acquire(int width, int height, texture_precision precision)
+    {
+        const auto it = std::find_if(_idle_sets.begin(), _idle_sets.end(), [&](const auto& set) {
+            return set->width == width && set->height == height && set->precision == precision;
+            });
+
+        std::unique_ptr<texture_set> set;
+        if (it != _idle_sets.end())
+        {
+            set = std::move(*it);
+            _idle_sets.erase(it);
+            _memory_idle -= set->memory_size;
+        }
+        else
+        {
+            set = std::make_unique<texture_set>(width, height, precision, _num_octaves, _num_feature_scales);
+        }
+        _memory_in_use += set->memory_size;
+        evict();
+        return set;
+    }
+
+    void texture_pool::release(std::unique_ptr<texture_set> set)
+    {
+        if (!set)
+            return;
+        _memory_in_use -= set->memory_size;
+        _memory_idle += set->memory_size;
+        _idle_sets.push_front(std::move(set));
+        evict();
+    }
+
+    size_t texture_pool::memory_budget() const noexcept
+    {
+        return _memory_budget;
+    }
+
+    void texture_pool::set_memory_budget(size_t budget)
+    {
+        _memory_budget = budget;
+        evict();
+    }
+
+    void texture_pool::evict()
+    {
+        while (!_idle_sets.empty() && _memory_in_use + _memory_idle > _memory_budget)
+        {
+            const auto& set = _idle_sets.back();
+            spdlog::info("Evicting SIFT textures for {}x{} ({} MiB).", set->width, set->height, set->memory_size >> 20);
+            _memory_idle -= set->memory_size;
+            _idle_sets.pop_back();
+        }
+    }
+}
\ No newline at end of file
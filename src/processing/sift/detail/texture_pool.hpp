@@ -0,0 +1,75 @@
+#pragma once
+
+#include <vector>
+#include <list>
+#include <memory>
+#include <cstdint>
+#include <processing/sift/sift.hpp>
+
+namespace mpp::sift::detail
+{
+    // Mipmapped GL_TEXTURE_2D_ARRAY with one layer per scale, so a pass binds a single texture for all scales.
+    struct layered_texture
+    {
+        std::uint32_t id = 0;
+        int layers = 0;
+    };
+
+    // All textures of a SIFT pass which depend on the input image size.
+    struct texture_set
+    {
+        texture_set(int width, int height, texture_precision precision, size_t num_octaves, size_t num_feature_scales);
+        ~texture_set();
+
+        texture_set(const texture_set&) = delete;
+        texture_set(texture_set&&) = delete;
+        texture_set& operator=(const texture_set&) = delete;
+        texture_set& operator=(texture_set&&) = delete;
+
+        // (Re-)allocates source_texture if the number of components changed.
+        void reserve_source(int components);
+        // Allocates mask_texture when the first detection with a mask runs in this set.
+        void reserve_mask();
+
+        int width;
+        int height;
+        texture_precision precision;
+        size_t memory_size; // estimated, in bytes
+        int source_components = 0;
+        // 8-bit source image as uploaded through upload_buffer, converted to luminance on the GPU.
+        std::uint32_t source_texture = 0;
+        // 8-bit region of interest mask of the uploaded region, see region_of_interest::mask.
+        std::uint32_t mask_texture = 0;
+        layered_texture temporary_textures;
+        layered_texture gaussian_textures;
+        layered_texture difference_of_gaussian_textures;
+        layered_texture feature_textures;
+        // Gradient magnitude and direction for each difference-of-gaussian layer
+        layered_texture gradient_textures;
+    };
+
+    // Keeps texture sets of recently used image sizes alive, so alternating sizes (e.g. portrait and landscape photos)
+    // don't reallocate all textures each time. Idle sets are evicted least recently used first when the memory of all
+    // sets, including the ones currently in use, exceeds the budget.
+    class texture_pool
+    {
+    public:
+        texture_pool(size_t num_octaves, size_t num_feature_scales, size_t memory_budget);
+
+        std::unique_ptr<texture_set> acquire(int width, int height, texture_precision precision);
+        void release(std::unique_ptr<texture_set> set);
+
+        size_t memory_budget() const noexcept;
+        void set_memory_budget(size_t budget);
+
+    private:
+        void evict();
+
+        size_t _num_octaves;
+        size_t _num_feature_scales;
+        size_t _memory_budget;
+        size_t _memory_in_use = 0;
+        size_t _memory_idle = 0;
+        std::list<std::unique_ptr<texture_set>> _idle_sets; // most recently released first
+    };
+}
\ No newline at end of file
@@ -0,0 +1,244 @@
+#include <processing/sift/feature_cache.hpp>
+#include <processing/image.hpp>
+#include <processing/mapped_file.hpp>
+#include <processing/fnv_hash.hpp>
+#include <spdlog/spdlog.h>
+#include <fstream>
+#include <cstring>
+
+namespace mpp::sift
+{
+    namespace
+    {
+        constexpr std::uint32_t file_magic = 0x4650504d; // "MPPF"
+        constexpr std::uint32_t file_version = 1;
+        // Part of every fingerprint. Increment when a change of the detection changes its results, so old files are not used anymore.
+        constexpr std::uint32_t detection_revision = 2;
+        constexpr size_t block_alignment = 64;
+
+        struct file_header
+        {
+            std::uint32_t magic;
+            std::uint32_t version;
+            std::uint64_t key;
+            std::uint64_t count;
+            std::uint32_t descriptor_size; // values per descriptor
+            std::uint32_t descriptor_bytes; // bytes per descriptor value
+            std::uint8_t _pad[32];
+        };
+        static_assert(sizeof(file_header) == block_alignment, "The first block starts right after the header.");
+
+        // Byte offsets of the blocks of a file with count features.
+        struct file_layout
+        {
+            size_t positions;
+            size_t sigmas;
+            size_t scales;
+            size_t octaves;
+            size_t orientations;
+            size_t descriptors;
+            size_t size;
+        };
+
+        file_layout layout(size_t count, size_t descriptor_row_size)
+        {
+            const auto align = [](size_t offset) { return (offset + block_alignment - 1) / block_alignment * block_alignment; };
+            file_layout result;
+            result.positions = sizeof(file_header);
+            result.sigmas = align(result.positions + count * sizeof(glm::vec2));
+            result.scales = align(result.sigmas + count * sizeof(float));
+            result.octaves = align(result.scales + count * sizeof(float));
+            result.orientations = align(result.octaves + count * sizeof(int));
+            result.descriptors = align(result.orientations + count * sizeof(float));
+            result.size = result.descriptors + count * descriptor_row_size;
+            return result;
+        }
+
+        template<typename Set>
+        bool save_features_impl(const std::filesystem::path& file, const Set& features, std::uint64_t key)
+        {
+            using descriptor_type = typename Set::descriptor_type;
+            constexpr size_t row_size = Set::descriptor_size * sizeof(descriptor_type);
+            const size_t count = features.size();
+            const auto blocks = layout(count, row_size);
+
+            file_header header{};
+            header.magic = file_magic;
+            header.version = file_version;
+            header.key = key;
+            header.count = count;
+            header.descriptor_size = std::uint32_t(Set::descriptor_size);
+            header.descriptor_bytes = std::uint32_t(sizeof(descriptor_type));
+
+            // Assemble the file in memory, the padding between the blocks stays zero.
+            std::vector<char> contents(blocks.size, 0);
+            const auto write = [&](size_t offset, const void* data, size_t size) {
+                if (size != 0)
+                    std::memcpy(contents.data() + offset, data, size);
+            };
+            write(0, &header, sizeof(header));
+            write(blocks.positions, features.positions(), count * sizeof(glm::vec2));
+            write(blocks.sigmas, features.sigmas(), count * sizeof(float));
+            write(blocks.scales, features.scales(), count * sizeof(float));
+            write(blocks.octaves, features.octaves(), count * sizeof(int));
+            write(blocks.orientations, features.orientations(), count * sizeof(float));
+            write(blocks.descriptors, features.descriptors(), count * row_size);
+
+            // Write to a temporary file first, so nobody reads a partial file.
+            auto temporary = file;
+            temporary += ".tmp";
+            {
+                std::ofstream stream(temporary, std::ios::binary);
+                stream.write(contents.data(), contents.size());
+                if (!stream)
+                    return false;
+            }
+            std::error_code ec;
+            std::filesystem::rename(temporary, file, ec);
+            return !ec;
+        }
+
+        template<typename Set>
+        bool load_features_impl(const std::filesystem::path& file, Set& features, std::uint64_t key)
+        {
+            using descriptor_type = typename Set::descriptor_type;
+            constexpr size_t row_size = Set::descriptor_size * sizeof(descriptor_type);
+
+            const mapped_file mapping(file);
+            if (mapping.size() < sizeof(file_header))
+                return false;
+            file_header header;
+            std::memcpy(&header, mapping.data(), sizeof(header));
+            if (header.magic != file_magic || header.version != file_version || header.key != key
+                || header.descriptor_size != Set::descriptor_size || header.descriptor_bytes != sizeof(descriptor_type))
+                return false;
+            const auto blocks = layout(size_t(header.count), row_size);
+            if (mapping.size() < blocks.size)
+                return false;
+
+            const size_t count = size_t(header.count);
+            features.resize(count);
+            const auto read = [&](void* data, size_t offset, size_t size) {
+                if (size != 0)
+                    std::memcpy(data, mapping.data() + offset, size);
+            };
+            read(features.positions(), blocks.positions, count * sizeof(glm::vec2));
+            read(features.sigmas(), blocks.sigmas, count * sizeof(float));
+            read(features.scales(), blocks.scales, count * sizeof(float));
+            read(features.octaves(), blocks.octaves, count * sizeof(int));
+            read(features.orientations(), blocks.orientations, count * sizeof(float));
+            read(features.descriptors(), blocks.descriptors, count * row_size);
+            return true;
+        }
+
+        std::filesystem::path cache_file(const std::filesystem::path& directory, std::uint64_t key)
+        {
+            return directory / fmt::format("{:016x}.features", key);
+        }
+    }
+
+    std::uint64_t settings_fingerprint(const detection_settings& settings, dst_system system)
+    {
+        // Field by field, as the padding of the settings is not part of their value.
+        std::uint64_t hash = fnv1a_offset_basis;
+        fnv1a(hash, detection_revision);
+        fnv1a(hash, std::uint64_t(settings.octaves));
+        fnv1a(hash, std::uint64_t(settings.feature_scales));
+        fnv1a(hash, settings.orientation_slices);
+        fnv1a(hash, settings.orientation_magnitude_threshold);
+        fnv1a(hash, settings.backend);
+        fnv1a(hash, settings.precision);
+        fnv1a(hash, std::uint64_t(settings.max_features));
+        fnv1a(hash, settings.selection_grid);
+        fnv1a(hash, settings.tile_size);
+        fnv1a(hash, system);
+        return hash;
+    }
+
+    bool save_features(const std::filesystem::path& file, const feature_set& features, std::uint64_t key)
+    {
+        return save_features_impl(file, features, key);
+    }
+
+    bool save_features(const std::filesystem::path& file, const compact_feature_set& features, std::uint64_t key)
+    {
+        return save_features_impl(file, features, key);
+    }
+
+    bool load_features(const std::filesystem::path& file, feature_set& features, std::uint64_t key)
+    {
+        return load_features_impl(file, features, key);
+    }
+
+    bool load_features(const std::filesystem::path& file, compact_feature_set& features, std::uint64_t key)
+    {
+        return load_features_impl(file, features, key);
+    }
+
+    feature_cache::feature_cache()
+    {
+        std::error_code ec;
+        const auto temp = std::filesystem::temp_directory_path(ec);
+        if (!ec)
+            _directory = temp / "mpp-feature-cache";
+    }
+
+    feature_cache::feature_cache(std::filesystem::path directory)
+        : _directory(std::move(directory))
+    {
+    }
+
+    void feature_cache::set_directory(std::filesystem::path directory)
+    {
+        _directory = std::move(directory);
+    }
+
+    std::uint64_t feature_cache::key(const image& img, const detection_settings& settings, dst_system system)
+    {
+        std::uint64_t hash = fnv1a_offset_basis;
+        fnv1a(hash, img.dimensions().x);
+        fnv1a(hash, img.dimensions().y);
+        fnv1a(hash, img.components());
+        fnv1a(hash, img.data(), img.size());
+        fnv1a(hash, settings_fingerprint(settings, system));
+        return hash;
+    }
+
+    bool feature_cache::load(std::uint64_t key, feature_set& features) const
+    {
+        return !_directory.empty() && load_features(cache_file(_directory, key), features, key);
+    }
+
+    bool feature_cache::load(std::uint64_t key, compact_feature_set& features) const
+    {
+        return !_directory.empty() && load_features(cache_file(_directory, key), features, key);
+    }
+
+    template<typename Set>
+    void feature_cache::store_impl(std::uint64_t key, const Set& features)
+    {
+        if (_directory.empty())
+            return;
+        std::error_code ec;
+        std::filesystem::create_directories(_directory, ec);
+        if (ec)
+        {
+            spdlog::warn("Disabling the feature cache, could not create {}: {}", _directory.string(), ec.message());
+            _directory.clear();
+            return;
+        }
+        const auto file = cache_file(_directory, key);
+        if (!save_features(file, features, key))
+            spdlog::warn("Could not write features to {}.", file.string());
+    }
+
+    void feature_cache::store(std::uint64_t key, const feature_set& features)
+    {
+        store_impl(key, features);
+    }
+
+    void feature_cache::store(std::uint64_t key, const compact_feature_set& features)
+    {
+        store_impl(key, features);
+    }
+}
\ No newline at end of file
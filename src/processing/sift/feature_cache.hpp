@@ -0,0 +1,45 @@
+#pragma once
+
+#include <processing/sift/sift.hpp>
+#include <filesystem>
+#include <cstdint>
+
+namespace mpp::sift
+{
+    // Identifies everything besides the image that changes the detected features.
+    std::uint64_t settings_fingerprint(const detection_settings& settings, dst_system system);
+
+    // Feature files start with a 64-byte header, followed by the positions, sigmas, scales, octaves, orientations and
+    // descriptors of the set. Every block starts at a multiple of 64 bytes, so the descriptors of a mapped file keep the
+    // alignment of a feature set. The key is stored in the header and has to match when loading.
+    bool save_features(const std::filesystem::path& file, const feature_set& features, std::uint64_t key);
+    bool save_features(const std::filesystem::path& file, const compact_feature_set& features, std::uint64_t key);
+    // Fails if the file is missing or truncated, or if it was written by another version, with another key or descriptor type.
+    bool load_features(const std::filesystem::path& file, feature_set& features, std::uint64_t key);
+    bool load_features(const std::filesystem::path& file, compact_feature_set& features, std::uint64_t key);
+
+    // Feature files in a directory, addressed by the content of the image and the settings the features were detected with.
+    class feature_cache
+    {
+    public:
+        // Uses "mpp-feature-cache" in the temporary directory.
+        feature_cache();
+        // An empty directory disables the cache.
+        explicit feature_cache(std::filesystem::path directory);
+
+        void set_directory(std::filesystem::path directory);
+        const std::filesystem::path& directory() const noexcept { return _directory; }
+
+        static std::uint64_t key(const image& img, const detection_settings& settings, dst_system system);
+        bool load(std::uint64_t key, feature_set& features) const;
+        bool load(std::uint64_t key, compact_feature_set& features) const;
+        void store(std::uint64_t key, const feature_set& features);
+        void store(std::uint64_t key, const compact_feature_set& features);
+
+    private:
+        template<typename Set>
+        void store_impl(std::uint64_t key, const Set& features);
+
+        std::filesystem::path _directory;
+    };
+}
\ No newline at end of file
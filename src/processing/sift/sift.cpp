@@ -1,6 +1,10 @@
 ﻿#define GLM_LANG_STL11_FORCED
 #include "sift.hpp"
 #include <processing/sift/detail/sift_state.hpp>
+#include <processing/sift/detail/sift_cpu.hpp>
+#include <processing/sift/detail/selection.hpp>
+#include <processing/sift/detail/scale_space.hpp>
+#include <processing/sift/detail/binary_descriptor.hpp>
 #include <functional>
 #include <chrono>
 #include <processing/image.hpp>
@@ -9,11 +13,15 @@
 #include <map>
 #include <glm/gtx/hash.hpp>
 #include <unordered_set>
+#include <unordered_map>
 #include <atomic>
+#include <cstring>
+#include <optional>
 #include <processing/algorithm.hpp>
 #include <spdlog/spdlog.h>
 #include <processing/perf_log.hpp>
-#include <processing/gl_clock.hpp>
+#include <processing/gl_state.hpp>
+#include <processing/fnv_hash.hpp>
 #include <glm/gtx/string_cast.hpp>
 
 namespace mpp::sift {
@@ -31,442 +39,1697 @@ namespace mpp::sift {
             }
         };
 
-        struct opengl_state_capture
+        void dispatch()
+        {
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+        }
+
+        void blur_pass(detail::sift_state & state, std::uint32_t input, int input_layer, std::uint32_t output, int output_layer, int direction)
+        {
+            constexpr int tile_size = 256; // local_size_x of gauss_blur_comp
+            const int length = direction == 0 ? state.width : state.height;
+            const int lines = direction == 0 ? state.height : state.width;
+
+            glUniform1i(state.programs->gauss_blur.u_dir_location, direction);
+            glUniform1i(state.programs->gauss_blur.u_input_layer_location, input_layer);
+            gl_state::current().bind_texture_array(0, input);
+            // Binding a single layer of the array makes it a plain image2D for the shader.
+            glBindImageTexture(0, output, 0, false, output_layer, GL_WRITE_ONLY, GL_R32F);
+            glDispatchCompute((length + tile_size - 1) / tile_size, lines, 1);
+            glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+        }
+
+        void apply_gaussian(detail::sift_state & state)
+        {
+            gl_state::current().use_program(state.programs->gauss_blur.program);
+            glUniform1i(state.programs->gauss_blur.u_input_location, 0);
+            const auto& temporary = state.textures->temporary_textures;
+            const auto& gaussians = state.textures->gaussian_textures;
+            for (int scale = 0; scale < gaussians.layers; ++scale)
+            {
+                // Blur each level from the previous one, only the first one starts at the original in temporary layer 0.
+                const auto source = scale == 0 ? temporary.id : gaussians.id;
+                const int source_layer = scale == 0 ? 0 : scale - 1;
+                glBindBufferRange(GL_UNIFORM_BUFFER, 0, state.gauss_kernel_buffer, scale * state.gauss_kernel_stride, state.gauss_kernel_stride);
+                glUniform1i(state.programs->gauss_blur.u_radius_location, state.gauss_kernel_radii[scale]);
+
+                // Horizontal blur into temporary layer 1, then vertical blur into gaussian layer scale.
+                // Wide blurs repeat this on the gaussian layer itself.
+                blur_pass(state, source, source_layer, temporary.id, 1, 0);
+                blur_pass(state, temporary.id, 1, gaussians.id, scale, 1);
+                for (int pass = 1; pass < state.gauss_kernel_passes[scale]; ++pass)
+                {
+                    blur_pass(state, gaussians.id, scale, temporary.id, 1, 0);
+                    blur_pass(state, temporary.id, 1, gaussians.id, scale, 1);
+                }
+            }
+            // Mipmap generation reads the blurred images next
+            glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+        }
+
+        void apply_viewport(int x, int y, int w, int h)
+        {
+            gl_state::current().set_viewport(glm::ivec4(x, y, w, h));
+            gl_state::current().set_scissor(glm::ivec4(x, y, w, h));
+        }
+
+        // Part of the source image a detection runs on, in pixels.
+        struct image_region
+        {
+            glm::ivec2 origin;
+            glm::ivec2 size;
+        };
+
+        void upload_source(detail::sift_state& state, const image& img, const image_region& region, int components)
+        {
+            constexpr std::array<GLenum, 4> gl_components{ GL_RED, GL_RG, GL_RGB, GL_RGBA };
+            const size_t row_size = size_t(region.size.x) * img.components();
+            const size_t region_size = row_size * region.size.y;
+
+            // Copy the raw 8-bit pixels into the pixel unpack buffer. Respecifying its storage first
+            // lets the driver hand out fresh memory instead of waiting for the previous upload.
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, state.upload_buffer);
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, region_size, nullptr, GL_STREAM_DRAW);
+            auto pixels = static_cast<char*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, region_size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+            if (region.size.x == img.dimensions().x)
+            {
+                std::memcpy(pixels, img.data() + row_size * region.origin.y, region_size);
+            }
+            else
+            {
+                const size_t image_row_size = size_t(img.dimensions().x) * img.components();
+                const char* first = img.data() + image_row_size * region.origin.y + size_t(region.origin.x) * img.components();
+                for (int row = 0; row < region.size.y; ++row)
+                    std::memcpy(pixels + row * row_size, first + row * image_row_size, row_size);
+            }
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+            gl_state::current().bind_texture(0, state.textures->source_texture);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, region.size.x, region.size.y, gl_components[components - 1], GL_UNSIGNED_BYTE, nullptr);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        }
+
+        // First channel of the mask inside of the region, row by row.
+        std::vector<std::uint8_t> extract_mask(const image& mask, const image_region& region)
+        {
+            const int components = mask.components();
+            std::vector<std::uint8_t> values(size_t(region.size.x) * region.size.y);
+            for (int y = 0; y < region.size.y; ++y)
+            {
+                const char* row = mask.data() + (size_t(region.origin.y + y) * mask.dimensions().x + region.origin.x) * components;
+                auto* out = values.data() + size_t(y) * region.size.x;
+                if (components == 1)
+                {
+                    std::memcpy(out, row, size_t(region.size.x));
+                    continue;
+                }
+                for (int x = 0; x < region.size.x; ++x)
+                    out[x] = std::uint8_t(row[size_t(x) * components]);
+            }
+            return values;
+        }
+
+        void upload_mask(detail::sift_state& state, const std::vector<std::uint8_t>& mask, const image_region& region)
+        {
+            state.textures->reserve_mask();
+            gl_state::current().bind_texture(0, state.textures->mask_texture);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, region.size.x, region.size.y, GL_RED, GL_UNSIGNED_BYTE, mask.data());
+        }
+
+        void convert_to_luminance(detail::sift_state& state, int components)
+        {
+            gl_state::current().use_program(state.programs->luminance.program);
+            glUniform1i(state.programs->luminance.u_source_location, 0);
+            // Gray and gray-alpha images only use their first channel.
+            const auto weights = components >= 3 ? glm::vec3(0.21f, 0.72f, 0.07f) : glm::vec3(1.f, 0.f, 0.f);
+            glUniform3f(state.programs->luminance.u_weights_location, weights.r, weights.g, weights.b);
+
+            gl_state::current().bind_texture(0, state.textures->source_texture);
+            gl_state::current().bind_framebuffer(state.framebuffers[0]);
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, state.textures->temporary_textures.id, 0, 0);
+            dispatch();
+        }
+
+        void generate_difference_of_gaussian(detail::sift_state & state)
+        {
+            gl_state::current().use_program(state.programs->difference.program);
+            glUniform1i(state.programs->difference.u_gaussians_location, 0);
+            gl_state::current().bind_texture_array(0, state.textures->gaussian_textures.id);
+
+            gl_state::current().bind_framebuffer(state.framebuffers[0]);
+            // Now compute the difference of gaussian layer scale + 1 to the previous layer scale...
+            for (int scale = 0; scale < state.textures->difference_of_gaussian_textures.layers; ++scale)
+            {
+                // Write it to difference-of-gaussian layer scale
+                glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, state.textures->difference_of_gaussian_textures.id, 0, scale);
+                glUniform1i(state.programs->difference.u_scale_location, scale);
+                dispatch();
+            }
+        }
+
+        void detect_candidates(detail::sift_state & state, int base_width, int base_height, bool masked)
+        {
+            gl_state::current().use_program(state.programs->maximize.program);
+            glUniform1i(state.programs->maximize.u_differences_location, 0);
+            glUniform1i(state.programs->maximize.u_mask_location, 1);
+            glUniform1i(state.programs->maximize.u_masked_location, masked);
+            gl_state::current().bind_texture_array(0, state.textures->difference_of_gaussian_textures.id);
+            if (masked)
+                gl_state::current().bind_texture(1, state.textures->mask_texture);
+
+            gl_state::current().set_clear_color(glm::vec4(0, 0, 0, 1));
+            for (int o = 0; o < state.num_octaves; ++o)
+            {
+                gl_state::current().bind_framebuffer(state.framebuffers[o]);
+                apply_viewport(0, 0, base_width >> o, base_height >> o);
+                for (int feature_scale = 0; feature_scale < state.textures->feature_textures.layers; ++feature_scale)
+                {
+                    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, state.textures->feature_textures.id, o, feature_scale);
+                    glClear(GL_COLOR_BUFFER_BIT);
+                    glUniform1i(state.programs->maximize.u_mip_location, o);
+                    glUniform1i(state.programs->maximize.u_scale_location, feature_scale);
+                    dispatch();
+                }
+            }
+        }
+
+        using detail::feature_buffer_header;
+        using detail::feature_buffer_entry;
+
+        void reset_feature_buffer(std::uint32_t buffer)
+        {
+            // No work groups until the first feature is appended, see filter_comp and orientation_comp.
+            constexpr feature_buffer_header empty_header{ { 0, 1, 1 }, 0 };
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(empty_header), &empty_header);
+        }
+
+        void bind_feature_buffer(GLenum target, std::uint32_t index, std::uint32_t buffer, std::uint32_t capacity)
+        {
+            glBindBufferRange(target, index, buffer, 0, sizeof(feature_buffer_header) + size_t(capacity) * sizeof(feature_buffer_entry));
+        }
+
+        void filter_features(detail::sift_state & state, int base_width, int base_height)
+        {
+            gl_state::current().use_program(state.programs->filter.program);
+            glUniform1i(state.programs->filter.u_differences_location, 0);
+            glUniform1i(state.programs->filter.u_features_location, 1);
+            gl_state::current().bind_texture_array(0, state.textures->difference_of_gaussian_textures.id);
+            gl_state::current().bind_texture_array(1, state.textures->feature_textures.id);
+
+            // All octaves and scales append into the same buffer through its atomic counter,
+            // so there is no need to know the number of features per pass on the CPU.
+            reset_feature_buffer(state.filter_buffer);
+            bind_feature_buffer(GL_SHADER_STORAGE_BUFFER, 0, state.filter_buffer, state.feature_capacity);
+
+            for (int mip = 0; mip < state.num_octaves; ++mip)
+            {
+                glUniform1i(state.programs->filter.u_mip_location, mip);
+                for (int scale = 0; scale < state.textures->feature_textures.layers; ++scale)
+                {
+                    // Reads the previous, current and next difference-of-gaussian layer, starting at scale
+                    glUniform1i(state.programs->filter.u_scale_location, scale);
+                    glDispatchCompute(((base_width >> mip) + 15) / 16, ((base_height >> mip) + 15) / 16, 1);
+                }
+            }
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+        }
+
+        void compute_orientations(detail::sift_state & state, const detection_settings& settings, std::uint32_t output_buffer)
+        {
+            const auto& orientation = state.variant_programs->orientation;
+            gl_state::current().use_program(orientation.program);
+            glUniform1i(orientation.u_differences_location, 0);
+            glUniform1f(orientation.u_magnitude_threshold_location, settings.orientation_magnitude_threshold);
+            gl_state::current().bind_texture_array(0, state.textures->difference_of_gaussian_textures.id);
+
+            reset_feature_buffer(output_buffer);
+            bind_feature_buffer(GL_SHADER_STORAGE_BUFFER, 0, state.filter_buffer, state.feature_capacity);
+            bind_feature_buffer(GL_SHADER_STORAGE_BUFFER, 1, output_buffer, state.feature_capacity);
+
+            // The filter stage has written the number of work groups needed into the buffer header.
+            glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, state.filter_buffer);
+            glDispatchComputeIndirect(0);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+        }
+
+        // Compacts the strongest features of each bucket from oriented_buffer into orientation_buffer.
+        void select_features(detail::sift_state & state, const detection_settings & settings)
+        {
+            const int grid = detail::selection_grid(settings);
+            const size_t buckets_size = size_t(grid * grid) * detail::selection_bucket_size;
+            const std::vector<std::uint8_t> empty_buckets(buckets_size, 0);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, state.bucket_buffer);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, buckets_size, empty_buckets.data());
+
+            reset_feature_buffer(state.orientation_buffer);
+            bind_feature_buffer(GL_SHADER_STORAGE_BUFFER, 0, state.oriented_buffer, state.feature_capacity);
+            bind_feature_buffer(GL_SHADER_STORAGE_BUFFER, 1, state.orientation_buffer, state.feature_capacity);
+            glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 2, state.bucket_buffer, 0, buckets_size);
+
+            // The header of oriented_buffer counts descriptor work groups, so dispatch for the whole capacity instead.
+            // Invocations past the feature count return right away.
+            const std::uint32_t feature_groups = (state.feature_capacity + 31) / 32;
+
+            gl_state::current().use_program(state.programs->select_histogram.program);
+            glUniform1i(state.programs->select_histogram.u_grid_location, grid);
+            glUniform2f(state.programs->select_histogram.u_size_location, float(state.width), float(state.height));
+            glDispatchCompute(feature_groups, 1, 1);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+            gl_state::current().use_program(state.programs->select_threshold.program);
+            glUniform1i(state.programs->select_threshold.u_grid_location, grid);
+            glUniform1ui(state.programs->select_threshold.u_max_features_location, std::uint32_t(settings.max_features));
+            glDispatchCompute(1, 1, 1);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+            gl_state::current().use_program(state.programs->select_compact.program);
+            glUniform1i(state.programs->select_compact.u_grid_location, grid);
+            glUniform2f(state.programs->select_compact.u_size_location, float(state.width), float(state.height));
+            glDispatchCompute(feature_groups, 1, 1);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+        }
+
+        void compute_gradients(detail::sift_state& state)
+        {
+            gl_state::current().use_program(state.programs->gradient.program);
+            glUniform1i(state.programs->gradient.u_input_location, 0);
+            gl_state::current().bind_texture_array(0, state.textures->difference_of_gaussian_textures.id);
+            gl_state::current().bind_vertex_array(state.empty_vao);
+            for (int o = 0; o < state.num_octaves; ++o)
+            {
+                gl_state::current().bind_framebuffer(state.framebuffers[o]);
+                apply_viewport(0, 0, state.width >> o, state.height >> o);
+                glUniform1i(state.programs->gradient.u_mip_location, o);
+                for (int scale = 0; scale < state.textures->gradient_textures.layers; ++scale)
+                {
+                    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, state.textures->gradient_textures.id, o, scale);
+                    glUniform1i(state.programs->gradient.u_layer_location, scale);
+                    dispatch();
+                }
+            }
+        }
+
+        void bind_histogram_descriptor_stage(detail::sift_state& state, bool compact)
+        {
+            // Compact features are smaller, so both fit into the same buffer.
+            glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 1, state.full_feature_buffer, 0, size_t(state.feature_capacity) * sizeof(feature));
+            glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 2, state.full_feature_buffer, 0, size_t(state.feature_capacity) * sizeof(compact_feature));
+            gl_state::current().use_program(state.programs->descriptor.program);
+            glUniform1i(state.programs->descriptor.u_compact_location, compact);
+            glUniform1i(state.programs->descriptor.u_gradients_location, 0);
+            gl_state::current().bind_texture_array(0, state.textures->gradient_textures.id);
+        }
+
+        void bind_binary_descriptor_stage(detail::sift_state& state)
+        {
+            // Binary features are smaller than features as well.
+            glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 1, state.full_feature_buffer, 0, size_t(state.feature_capacity) * sizeof(binary_feature));
+            glBindBufferBase(GL_UNIFORM_BUFFER, 1, state.binary_pattern_buffer);
+            gl_state::current().use_program(state.programs->binary_descriptor.program);
+            glUniform1i(state.programs->binary_descriptor.u_gaussians_location, 0);
+            gl_state::current().bind_texture_array(0, state.textures->gaussian_textures.id);
+        }
+
+        void compute_descriptors(detail::sift_state& state, detail::descriptor_format format)
+        {
+            bind_feature_buffer(GL_SHADER_STORAGE_BUFFER, 0, state.orientation_buffer, state.feature_capacity);
+            if (format == detail::descriptor_format::binary)
+                bind_binary_descriptor_stage(state);
+            else
+                bind_histogram_descriptor_stage(state, format == detail::descriptor_format::compact_histogram);
+
+            // One work group per feature, the orientation stage has written the number of work groups into the buffer header.
+            glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, state.orientation_buffer);
+            glDispatchComputeIndirect(0);
+            glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+        }
+
+        void mark_stage(detail::sift_state& state, detail::detection_stage stage)
+        {
+            state.timestamps.record(size_t(stage));
+        }
+
+        template<typename PerfLog>
+        void compute_features(detail::sift_state& state, const detection_settings& settings, detail::descriptor_format format, PerfLog& plog)
+        {
+            // STEP 4: Filter features to exclude outliers and to improve accuracy
+            filter_features(state, state.width, state.height);
+            mark_stage(state, detail::detection_stage::filter);
+            plog.step("Filter features to exclude outliers and to improve accuracy");
+
+            // Without a feature budget, orientations are written straight into the input of the descriptor stage.
+            const bool select = settings.max_features != 0;
+            compute_orientations(state, settings, select ? state.oriented_buffer : state.orientation_buffer);
+            mark_stage(state, detail::detection_stage::orientation);
+            plog.step("Orientation Computation");
+
+            if (select)
+            {
+                select_features(state, settings);
+                mark_stage(state, detail::detection_stage::selection);
+                plog.step("Feature Selection");
+            }
+
+            compute_descriptors(state, format);
+            mark_stage(state, detail::detection_stage::descriptor);
+            plog.step("Descriptor Computation");
+        }
+
+        void queue_readback(detail::sift_state& state)
+        {
+            // Persistently mapped buffers need an explicit barrier to see shader writes.
+            if (state.persistent_readback)
+                glMemoryBarrier(GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+
+            glBindBuffer(GL_COPY_WRITE_BUFFER, state.header_readback_buffer);
+            glBindBuffer(GL_COPY_READ_BUFFER, state.filter_buffer);
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, sizeof(feature_buffer_header));
+            glBindBuffer(GL_COPY_READ_BUFFER, state.orientation_buffer);
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, sizeof(feature_buffer_header), sizeof(feature_buffer_header));
+
+            state.readback_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, GLbitfield(0));
+            // Make sure the GPU starts working on the commands instead of waiting for the next wait or swap.
+            glFlush();
+        }
+
+        bool readback_ready(const detail::sift_state& state)
+        {
+            if (!state.readback_fence)
+                return true;
+            const auto status = glClientWaitSync(state.readback_fence, GLbitfield(0), 0);
+            return status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED;
+        }
+
+        void wait_for_readback(detail::sift_state& state)
+        {
+            if (!state.readback_fence)
+                return;
+            constexpr std::uint64_t timeout_ns = 1'000'000'000;
+            while (glClientWaitSync(state.readback_fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout_ns) == GL_TIMEOUT_EXPIRED)
+                spdlog::warn("Still waiting for SIFT detection results after a second.");
+            glDeleteSync(state.readback_fence);
+            state.readback_fence = nullptr;
+        }
+
+        // Only call after the readback fence was signaled, the timestamps are not available before.
+        detection_timings resolve_timings(const detail::sift_state& state)
+        {
+            detection_timings timings;
+            const auto stamps = state.timestamps.resolve();
+            if (!stamps)
+                return timings;
+            const auto stage = [&](detail::detection_stage s) {
+                return (*stamps)[size_t(s)] - (*stamps)[size_t(s) - 1];
+            };
+            timings.valid = true;
+            timings.upload = stage(detail::detection_stage::upload);
+            timings.blur = stage(detail::detection_stage::blur);
+            timings.difference_of_gaussian = stage(detail::detection_stage::difference_of_gaussian);
+            timings.extrema = stage(detail::detection_stage::extrema);
+            timings.gradients = stage(detail::detection_stage::gradients);
+            timings.filter = stage(detail::detection_stage::filter);
+            timings.orientation = stage(detail::detection_stage::orientation);
+            timings.selection = stage(detail::detection_stage::selection);
+            timings.descriptor = stage(detail::detection_stage::descriptor);
+            return timings;
+        }
+
+        void log_timings(const detection_timings& timings)
+        {
+            if (!timings.valid)
+                return;
+            const auto us = [](std::chrono::nanoseconds duration) { return std::chrono::duration_cast<std::chrono::microseconds>(duration).count(); };
+            spdlog::info("[SIFT GPU : {} us] upload {} us, blur {} us, DoG {} us, extrema {} us, gradients {} us, filter {} us, orientation {} us, "
+                "selection {} us, descriptor {} us, readback {} us", us(timings.gpu_total()), us(timings.upload), us(timings.blur),
+                us(timings.difference_of_gaussian), us(timings.extrema), us(timings.gradients), us(timings.filter), us(timings.orientation),
+                us(timings.selection), us(timings.descriptor), us(timings.readback));
+        }
+
+        // Returns the headers of the filter_buffer and orientation_buffer, in that order.
+        std::array<feature_buffer_header, 2> read_feature_buffer_headers(const detail::sift_state& state)
+        {
+            std::array<feature_buffer_header, 2> headers;
+            if (state.persistent_readback)
+            {
+                std::copy_n(state.mapped_headers, headers.size(), headers.data());
+                return headers;
+            }
+            glBindBuffer(GL_COPY_READ_BUFFER, state.header_readback_buffer);
+            const auto mapped = static_cast<const feature_buffer_header*>(glMapBufferRange(GL_COPY_READ_BUFFER, 0, sizeof(headers), GL_MAP_READ_BIT));
+            std::copy_n(mapped, headers.size(), headers.data());
+            glUnmapBuffer(GL_COPY_READ_BUFFER);
+            return headers;
+        }
+
+        template<typename Feature>
+        void assign_features(std::vector<Feature>& features, const Feature* mapped, std::uint32_t count)
+        {
+            features.assign(mapped, mapped + count);
+        }
+
+        template<typename Feature>
+        void assign_features(basic_feature_set<Feature>& features, const Feature* mapped, std::uint32_t count)
+        {
+            features.assign(mapped, count);
+        }
+
+        // Compact features whose descriptors stay in the feature buffer, only the keypoints are read back.
+        struct resident_feature_set : compact_feature_set {};
+
+        void assign_features(resident_feature_set& features, const compact_feature* mapped, std::uint32_t count)
+        {
+            features.assign_keypoints(mapped, count);
+        }
+
+        // Output is a std::vector or basic_feature_set of the feature type the descriptor stage has written.
+        template<typename Output>
+        Output read_features(const detail::sift_state& state, std::uint32_t count)
+        {
+            using Feature = typename Output::value_type;
+            Output features;
+            if (count == 0)
+                return features;
+            if (state.persistent_readback)
+            {
+                assign_features(features, static_cast<const Feature*>(state.mapped_features), count);
+                return features;
+            }
+            glBindBuffer(GL_COPY_READ_BUFFER, state.full_feature_buffer);
+            const auto mapped = static_cast<const Feature*>(glMapBufferRange(GL_COPY_READ_BUFFER, 0, count * sizeof(Feature), GL_MAP_READ_BIT));
+            assign_features(features, mapped, count);
+            glUnmapBuffer(GL_COPY_READ_BUFFER);
+            return features;
+        }
+
+        template<typename Feature, typename PerfLog>
+        void convert_coordinates(std::vector<Feature>& features, glm::ivec2 dimensions, dst_system system, PerfLog& plog)
+        {
+            if (system == dst_system::normalized_coordinates)
+            {
+                std::for_each(features.begin(), features.end(), [&](Feature & feat) {
+                    feat.x = (2.f * feat.x / dimensions.x) - 1.f;
+                    feat.y = -((2.f * feat.y / dimensions.y) - 1.f);
+                    });
+                plog.step("Convert to normalized coordinates");
+            }
+            else if (system == dst_system::image_coordinates)
+            {
+                std::for_each(features.begin(), features.end(), [&](Feature & feat) {
+                    feat.x = feat.x / dimensions.x;
+                    feat.y = feat.y / dimensions.y;
+                    });
+                plog.step("Convert to image coordinates");
+            }
+        }
+
+        template<typename Feature, typename PerfLog>
+        void convert_coordinates(basic_feature_set<Feature>& features, glm::ivec2 dimensions, dst_system system, PerfLog& plog)
+        {
+            if (system == dst_system::normalized_coordinates)
+            {
+                std::for_each(features.positions(), features.positions() + features.size(), [&](glm::vec2& position) {
+                    position.x = (2.f * position.x / dimensions.x) - 1.f;
+                    position.y = -((2.f * position.y / dimensions.y) - 1.f);
+                    });
+                plog.step("Convert to normalized coordinates");
+            }
+            else if (system == dst_system::image_coordinates)
+            {
+                std::for_each(features.positions(), features.positions() + features.size(), [&](glm::vec2& position) {
+                    position /= glm::vec2(dimensions);
+                    });
+                plog.step("Convert to image coordinates");
+            }
+        }
+
+        std::vector<feature> detect_features_cpu(const image& img, const detection_settings& settings, dst_system system, detection_timings* timings)
+        {
+            // There are no GPU stages to measure.
+            if (timings)
+                *timings = detection_timings{};
+            perf_log plog("SIFT CPU");
+            plog.start();
+            auto features = detail::detect_features_cpu(img, settings);
+            plog.step("Detect features");
+            convert_coordinates(features, img.dimensions(), system, plog);
+            return features;
+        }
+
+        std::vector<binary_feature> detect_binary_features_cpu(const image& img, const detection_settings& settings, dst_system system, detection_timings* timings)
+        {
+            if (timings)
+                *timings = detection_timings{};
+            perf_log plog("SIFT CPU");
+            plog.start();
+            auto features = detail::detect_binary_features_cpu(img, settings);
+            plog.step("Detect features");
+            convert_coordinates(features, img.dimensions(), system, plog);
+            return features;
+        }
+
+        std::vector<compact_feature> quantize_features(const std::vector<feature>& features)
+        {
+            std::vector<compact_feature> compact(features.size());
+            std::transform(features.begin(), features.end(), compact.begin(), &quantize_descriptor);
+            return compact;
+        }
+    }
+
+    struct sift_cache
+    {
+        // Identifies a scale space, see make_scale_space_key. The parts are computed lazily and are 0 until then.
+        struct scale_space_key
+        {
+            std::uint64_t shape = 0; // 0 if the scale space is incomplete
+            std::uint64_t fingerprint = 0;
+            std::uint64_t content = 0;
+
+            // Whether the textures of this key hold the scale space of the detection with the other key.
+            bool reusable_for(const scale_space_key& other) const
+            {
+                return shape != 0 && shape == other.shape && fingerprint == other.fingerprint && content != 0 && content == other.content;
+            }
+        };
+
+        // One slot of the ring of detections in flight.
+        struct frame
+        {
+            frame(std::shared_ptr<const detail::sift_programs> programs, std::shared_ptr<detail::texture_pool> pool, size_t num_octaves, size_t num_feature_scales)
+                : state(std::move(programs), std::move(pool), num_octaves, num_feature_scales) {}
+
+            detail::sift_state state;
+            std::uint64_t ticket = 0; // 0 if there is no detection in flight
+            // Identifies the scale space and extrema in the textures of the state, see scale_space_key.
+            scale_space_key scale_space;
+            bool gradients = false; // whether the gradient textures were computed from that scale space
+            glm::ivec2 dimensions;
+            dst_system system;
+            detection_settings settings;
+            detail::descriptor_format format = detail::descriptor_format::histogram;
+        };
+
+        sift_cache(size_t num_octaves, size_t num_feature_scales, size_t frames_in_flight, size_t texture_budget)
+            : programs(std::make_shared<detail::sift_programs>()),
+            textures(std::make_shared<detail::texture_pool>(num_octaves, num_feature_scales, texture_budget))
+        {
+            frames.resize(std::max<size_t>(frames_in_flight, 1));
+            for (auto& f : frames)
+                f = std::make_unique<frame>(programs, textures, num_octaves, num_feature_scales);
+        }
+        ~sift_cache()
+        {
+            for (const auto& [id, set] : resident)
+                glDeleteBuffers(1, &set.buffer);
+            if (match_buffer != 0)
+                glDeleteBuffers(1, &match_buffer);
+        }
+
+        sift_cache(const sift_cache&) = delete;
+        sift_cache(sift_cache&&) = delete;
+        sift_cache& operator=(const sift_cache&) = delete;
+        sift_cache& operator=(sift_cache&&) = delete;
+
+        std::shared_ptr<const detail::sift_programs> programs;
+        std::shared_ptr<detail::texture_pool> textures;
+        std::vector<std::unique_ptr<frame>> frames;
+        size_t next_frame = 0;
+        std::uint64_t next_ticket = 1;
+        struct finished_detection
+        {
+            std::vector<feature> features;
+            detection_timings timings;
+        };
+        // Results which had to be read back before their ticket was redeemed, e.g. because the ring was full.
+        // Limited to recent tickets by store_finished, results of tickets which are never redeemed are dropped.
+        std::unordered_map<std::uint64_t, finished_detection> finished;
+        // Compiled on the first detection with their settings, by sift_variant_programs::variant_key.
+        // Only the max_variant_programs most recently used are kept, frames still hold on to evicted ones.
+        struct variant_entry
+        {
+            std::shared_ptr<const detail::sift_variant_programs> programs;
+            std::uint64_t last_use;
+        };
+        std::unordered_map<std::uint64_t, variant_entry> variant_programs;
+        std::uint64_t variant_uses = 0;
+
+        // Buffers of compact_features, in the layout written by the descriptor stage and with the descriptor norm in _pad[0].
+        struct resident_set
+        {
+            std::uint32_t buffer;
+            std::uint32_t count;
+        };
+        std::unordered_map<std::uint64_t, resident_set> resident;
+        std::uint64_t next_resident = 1;
+        // Output of match_comp, a match_buffer_header followed by up to match_capacity matches.
+        std::uint32_t match_buffer = 0;
+        std::uint32_t match_capacity = 0;
+    };
+    std::shared_ptr<sift_cache> create_cache(size_t num_octaves, size_t num_feature_scales, size_t frames_in_flight, size_t texture_budget)
+    {
+        return std::make_shared<sift_cache>(num_octaves, num_feature_scales, frames_in_flight, texture_budget);
+    }
+
+    namespace
+    {
+        template<typename Output, typename PerfLog>
+        Output read_detection(sift_cache::frame& frame, PerfLog& plog, detection_timings* timings)
+        {
+            auto& state = frame.state;
+            wait_for_readback(state);
+            auto headers = read_feature_buffer_headers(state);
+
+            // If the buffers were too small to hold all candidates, grow them and run the compaction stages again.
+            // The textures of this frame are still intact, as it is only reused after being read back.
+            if (headers[0].count > state.feature_capacity)
+            {
+                gl_state_scope state_scope;
+                spdlog::info("Growing SIFT feature buffers from {} to {} features.", state.feature_capacity, headers[0].count);
+                // The stages before the filter are not run again, so the timings of this detection are dropped.
+                state.timestamps.reset();
+                state.reserve_features(headers[0].count);
+                compute_features(state, frame.settings, frame.format, plog);
+                queue_readback(state);
+                wait_for_readback(state);
+                headers = read_feature_buffer_headers(state);
+            }
+            plog.step("Wait for GPU");
+
+            const auto readback_begin = std::chrono::steady_clock::now();
+            auto features = read_features<Output>(state, headers[1].count);
+            const auto readback = std::chrono::steady_clock::now() - readback_begin;
+            if (timings)
+            {
+                *timings = resolve_timings(state);
+                timings->readback = readback;
+            }
+            plog.step("Descriptor Download");
+
+            frame.ticket = 0;
+            convert_coordinates(features, frame.dimensions, frame.system, plog);
+            return features;
+        }
+
+        // Everything the stages up to the extrema depend on, apart from the pixels.
+        std::uint64_t scale_space_shape(const image& img, const image_region& region, const detection_settings& settings, bool masked)
+        {
+            std::uint64_t hash = fnv1a_offset_basis;
+            fnv1a(hash, region.origin.x);
+            fnv1a(hash, region.origin.y);
+            fnv1a(hash, region.size.x);
+            fnv1a(hash, region.size.y);
+            fnv1a(hash, img.components());
+            fnv1a(hash, std::uint64_t(settings.octaves));
+            fnv1a(hash, std::uint64_t(settings.feature_scales));
+            fnv1a(hash, settings.precision);
+            // The mask decides where candidates are searched.
+            fnv1a(hash, masked);
+            // 0 marks frames without a scale space.
+            return hash != 0 ? hash : 1;
+        }
+
+        // Hashes a sparse grid of pixels, which tells most different images apart without reading all of them.
+        std::uint64_t scale_space_fingerprint(const image& img, const image_region& region, const std::vector<std::uint8_t>* mask)
+        {
+            constexpr int samples = 32;
+            const size_t components = size_t(img.components());
+            std::uint64_t hash = fnv1a_offset_basis;
+            for (int sy = 0; sy < samples; ++sy)
+            {
+                const int y = int((std::int64_t(region.size.y - 1) * sy) / (samples - 1));
+                const char* row = img.data() + (size_t(img.dimensions().x) * (region.origin.y + y) + region.origin.x) * components;
+                for (int sx = 0; sx < samples; ++sx)
+                {
+                    const int x = int((std::int64_t(region.size.x - 1) * sx) / (samples - 1));
+                    fnv1a(hash, row + x * components, components);
+                    if (mask)
+                        fnv1a(hash, (*mask)[size_t(y) * region.size.x + x]);
+                }
+            }
+            return hash;
+        }
+
+        // Hashes all uploaded pixels and the mask.
+        std::uint64_t scale_space_content(const image& img, const image_region& region, const std::vector<std::uint8_t>* mask)
+        {
+            std::uint64_t hash = fnv1a_offset_basis;
+            const size_t row_size = size_t(region.size.x) * img.components();
+            const size_t image_row_size = size_t(img.dimensions().x) * img.components();
+            const char* first = img.data() + image_row_size * region.origin.y + size_t(region.origin.x) * img.components();
+            if (row_size == image_row_size)
+                fnv1a_wide(hash, first, row_size * region.size.y);
+            else
+            {
+                for (int row = 0; row < region.size.y; ++row)
+                    fnv1a_wide(hash, first + row * image_row_size, row_size);
+            }
+            if (mask)
+                fnv1a_wide(hash, mask->data(), mask->size());
+            // 0 marks a content hash which was not computed.
+            return hash != 0 ? hash : 1;
+        }
+
+        // Hashing every pixel costs about as much as uploading them, so the content hash is only computed if an idle frame
+        // has the same shape and fingerprint. The first repetition of an image computes it, the ones after that reuse its scale space.
+        sift_cache::scale_space_key make_scale_space_key(const sift_cache& cache, const image& img, const image_region& region, const detection_settings& settings,
+            const std::vector<std::uint8_t>* mask)
+        {
+            sift_cache::scale_space_key key;
+            key.shape = scale_space_shape(img, region, settings, mask != nullptr);
+            key.fingerprint = scale_space_fingerprint(img, region, mask);
+            const bool candidate = std::any_of(cache.frames.begin(), cache.frames.end(), [&](const auto& f) {
+                return f->ticket == 0 && f->scale_space.shape == key.shape && f->scale_space.fingerprint == key.fingerprint;
+            });
+            if (candidate)
+                key.content = scale_space_content(img, region, mask);
+            return key;
+        }
+
+        // Prefers the frame which still holds the scale space of the key, so a detection of the same image with other
+        // thresholds skips blurring and the difference-of-gaussian. Otherwise the frames are used round robin.
+        sift_cache::frame& acquire_frame(sift_cache& cache, const sift_cache::scale_space_key& scale_space)
+        {
+            // Frames in flight are skipped, a batch may still have to read them back.
+            const auto match = std::find_if(cache.frames.begin(), cache.frames.end(), [&](const auto& f) {
+                return f->ticket == 0 && f->scale_space.reusable_for(scale_space);
+            });
+            const size_t index = match != cache.frames.end() ? size_t(match - cache.frames.begin()) : cache.next_frame;
+            // The ring continues after the chosen frame, so the next detection doesn't take the one just submitted.
+            cache.next_frame = (index + 1) % cache.frames.size();
+            return *cache.frames[index];
+        }
+
+        std::shared_ptr<const detail::sift_variant_programs> variant_programs(sift_cache& cache, const detection_settings& settings)
+        {
+            constexpr size_t max_variant_programs = 8;
+            auto& entry = cache.variant_programs[detail::sift_variant_programs::variant_key(settings)];
+            entry.last_use = ++cache.variant_uses;
+            if (!entry.programs)
+            {
+                entry.programs = std::make_shared<detail::sift_variant_programs>(settings);
+                if (cache.variant_programs.size() > max_variant_programs)
+                {
+                    const auto oldest = std::min_element(cache.variant_programs.begin(), cache.variant_programs.end(),
+                        [](const auto& a, const auto& b) { return a.second.last_use < b.second.last_use; });
+                    // The oldest entry is never the one just used.
+                    const auto programs = entry.programs;
+                    cache.variant_programs.erase(oldest);
+                    return programs;
+                }
+            }
+            return entry.programs;
+        }
+
+        sift_cache::finished_detection& store_finished(sift_cache& cache, std::uint64_t ticket)
+        {
+            // Tickets are redeemed in about the order they were submitted, so a result which is this many tickets older than the
+            // newest one is assumed to be abandoned. A frame is read back at the latest after one round through the ring.
+            constexpr std::uint64_t max_unredeemed_tickets = 64;
+            const auto window = max_unredeemed_tickets + cache.frames.size();
+            for (auto it = cache.finished.begin(); it != cache.finished.end();)
+            {
+                if (it->first + window < cache.next_ticket)
+                {
+                    spdlog::warn("Dropping the features of SIFT detection ticket {}, which was not redeemed.", it->first);
+                    it = cache.finished.erase(it);
+                }
+                else
+                    ++it;
+            }
+            return cache.finished[ticket];
+        }
+
+        template<typename PerfLog>
+        sift_cache::frame& submit_detection(sift_cache& cache, const image& img, const image_region& region, const detection_settings& settings, dst_system system,
+            detail::descriptor_format format, PerfLog& plog, const image* mask = nullptr)
+        {
+            std::vector<std::uint8_t> mask_values;
+            if (mask)
+                mask_values = extract_mask(*mask, region);
+            const auto scale_space = make_scale_space_key(cache, img, region, settings, mask ? &mask_values : nullptr);
+            auto& frame = acquire_frame(cache, scale_space);
+
+            // The frame is still in flight, it has to be read back before its resources can be reused.
+            // Only asynchronous detections stay in flight, and those always use histograms.
+            if (frame.ticket != 0)
+            {
+                auto& finished = store_finished(cache, frame.ticket);
+                finished.features = read_detection<std::vector<feature>>(frame, plog, &finished.timings);
+            }
+
+            // Everything changed below is restored when the scope ends, for a seamless interaction with the caller.
+            gl_state_scope state_scope;
+            gl_state::current().set_enabled(GL_MULTISAMPLE, false);
+            gl_state::current().set_pixel_store(GL_UNPACK_ALIGNMENT, 1);
+            gl_state::current().set_pixel_store(GL_PACK_ALIGNMENT, 1);
+            gl_state::current().set_enabled(GL_DEPTH_TEST, false);
+            auto& state = frame.state;
+            state.variant_programs = variant_programs(cache, settings);
+            state.timestamps.reset();
+            mark_stage(state, detail::detection_stage::begin);
+            if (frame.scale_space.reusable_for(scale_space))
+            {
+                // Nothing is recorded for the skipped stages, so they are reported with a duration of zero.
+                plog.step("Reuse scale space");
+            }
+            else
+            {
+                frame.scale_space = {};
+                frame.gradients = false;
+                // Clamp, as the upload only knows 1 to 4 channel formats
+                const int components = std::clamp(img.components(), 1, 4);
+                state.resize(region.size.x, region.size.y, components, settings.precision);
+                upload_source(state, img, region, components);
+                if (mask)
+                    upload_mask(state, mask_values, region);
+                plog.step("Initialize prerequisites");
+
+                const int base_width = region.size.x;
+                const int base_height = region.size.y;
+                apply_viewport(0, 0, base_width, base_height);
+                // Use universal empty vertex array
+                gl_state::current().bind_vertex_array(state.empty_vao);
+                // Fill temp[0] with the luminance of the original image
+                convert_to_luminance(state, components);
+                mark_stage(state, detail::detection_stage::upload);
+
+                // STEP 1: Generate gauss-blurred images
+                apply_gaussian(state);
+
+                // ... and build pyramid just using mipmaps, for all layers at once
+                gl_state::current().bind_texture_array(0, state.textures->gaussian_textures.id);
+                glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+                mark_stage(state, detail::detection_stage::blur);
+                plog.step("Generate gauss-blurred images");
+
+                // STEP 2: Generate Difference-of-Gaussian images (only the full-size ones)
+                generate_difference_of_gaussian(state);
+
+                // ... and build pyramid just using mipmaps
+                gl_state::current().bind_texture_array(0, state.textures->difference_of_gaussian_textures.id);
+                glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+                mark_stage(state, detail::detection_stage::difference_of_gaussian);
+                plog.step("Generate Difference-of-Gaussian images (only the full-size ones)");
+
+                // STEP 3: Detect feature candidates by testing for extrema
+                detect_candidates(state, base_width, base_height, mask != nullptr);
+                mark_stage(state, detail::detection_stage::extrema);
+                plog.step("Detect feature candidates by testing for extrema");
+                frame.scale_space = scale_space;
+            }
+
+            // Gradients for the descriptors, computed once per texel instead of once per feature and sample.
+            // Binary descriptors compare the gaussian levels directly and don't need them.
+            if (format != detail::descriptor_format::binary && !frame.gradients)
+            {
+                compute_gradients(state);
+                frame.gradients = true;
+                plog.step("Compute gradients");
+            }
+            mark_stage(state, detail::detection_stage::gradients);
+
+            constexpr std::uint32_t initial_feature_capacity = 1u << 14;
+            state.reserve_features(initial_feature_capacity);
+            compute_features(state, settings, format, plog);
+            queue_readback(state);
+            plog.step("Queue readback");
+
+            frame.ticket = cache.next_ticket++;
+            frame.dimensions = region.size;
+            frame.system = system;
+            frame.settings = settings;
+            frame.format = format;
+            return frame;
+        }
+    }
+
+    namespace
+    {
+        template<typename Feature>
+        constexpr detail::descriptor_format descriptor_format_of()
+        {
+            if constexpr (std::is_same_v<Feature, compact_feature>)
+                return detail::descriptor_format::compact_histogram;
+            else if constexpr (std::is_same_v<Feature, binary_feature>)
+                return detail::descriptor_format::binary;
+            else
+                return detail::descriptor_format::histogram;
+        }
+
+        struct tile
+        {
+            image_region region; // uploaded part of the image, including the halo
+            glm::ivec2 core_begin; // features inside [core_begin, core_end) belong to this tile
+            glm::ivec2 core_end;
+            size_t area = 0; // index of the region of interest rectangle the core is part of
+        };
+
+        // Pixels around a tile that influence features inside of it: the blur, plus the largest window
+        // the filter, orientation and descriptor stages look at in the coarsest octave.
+        int tile_halo(const detection_settings& settings)
+        {
+            return detail::blur_extent(settings.feature_scales + 3) + (9 << (settings.octaves - 1));
+        }
+
+        // Image size up to which tile_size is ignored, as a single tile would cover the whole image anyway.
+        glm::ivec2 tile_window(const detection_settings& settings)
+        {
+            // Tile origins are multiples of the coarsest mip texel, so all octaves sample the same pixels
+            // as without tiling.
+            const int alignment = 1 << (settings.octaves - 1);
+            const int step = (settings.tile_size + alignment - 1) / alignment * alignment;
+            const int window = (step + 2 * tile_halo(settings) + 2 * alignment - 1) / alignment * alignment;
+            return glm::ivec2(window);
+        }
+
+        bool use_tiles(glm::ivec2 dimensions, const detection_settings& settings)
+        {
+            return settings.tile_size > 0 && glm::any(glm::greaterThan(dimensions, tile_window(settings)));
+        }
+
+        // Splits an area of the image into tiles of equal size, so all of them fit into the same textures. Areas up to the
+        // tile window are a single tile, which covers the area and its halo.
+        void make_tiles(std::vector<tile>& tiles, glm::ivec2 dimensions, const image_region& area, size_t area_index, const detection_settings& settings)
+        {
+            const int alignment = 1 << (settings.octaves - 1);
+            const int halo = tile_halo(settings);
+            const glm::ivec2 step = use_tiles(area.size, settings)
+                ? glm::ivec2((settings.tile_size + alignment - 1) / alignment * alignment)
+                : area.size;
+            const glm::ivec2 window = glm::min((step + 2 * halo + 2 * alignment - 1) / alignment * alignment, dimensions);
+            const glm::ivec2 count = (area.size + step - 1) / step;
+
+            for (int y = 0; y < count.y; ++y)
+            {
+                for (int x = 0; x < count.x; ++x)
+                {
+                    tile& t = tiles.emplace_back();
+                    t.area = area_index;
+                    t.core_begin = area.origin + glm::ivec2(x, y) * step;
+                    t.core_end = glm::min(t.core_begin + step, area.origin + area.size);
+                    // Near the border, the window is shifted inwards instead of shrunk.
+                    const glm::ivec2 origin = glm::clamp(t.core_begin - halo, glm::ivec2(0), dimensions - window);
+                    t.region.origin = origin / alignment * alignment;
+                    t.region.size = window;
+                }
+            }
+        }
+
+        const std::uint8_t* mask_texel(const image& mask, int x, int y)
+        {
+            x = std::clamp(x, 0, mask.dimensions().x - 1);
+            y = std::clamp(y, 0, mask.dimensions().y - 1);
+            return reinterpret_cast<const std::uint8_t*>(mask.data()) + (size_t(y) * mask.dimensions().x + x) * mask.components();
+        }
+
+        bool inside(const image_region& area, float x, float y)
         {
-            opengl_state_capture() {
-                glGetIntegerv(GL_ACTIVE_TEXTURE, &active_texture);
-                for (int i = 0; i < 4; ++i)
+            return x >= area.origin.x && y >= area.origin.y && x < area.origin.x + area.size.x && y < area.origin.y + area.size.y;
+        }
+
+        // Index of the first texel in [begin, end) of a mask row whose first channel is not zero, or end.
+        // Single channel rows are tested eight texels at a time.
+        int first_set_texel(const std::uint8_t* row, int components, int begin, int end)
+        {
+            int x = begin;
+            if (components == 1)
+            {
+                for (; x + 8 <= end; x += 8)
                 {
-                    glActiveTexture(GLenum(GL_TEXTURE0 + i));
-                    glGetIntegerv(GL_TEXTURE_BINDING_2D, &tex2d_bindings[i]);
+                    std::uint64_t word;
+                    std::memcpy(&word, row + x, sizeof(word));
+                    if (word != 0)
+                        break;
                 }
-                glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &current_vao);
-                glGetIntegerv(GL_VIEWPORT, viewport);
-                glGetIntegerv(GL_SCISSOR_BOX, scissor);
-                glGetIntegerv(GL_DEPTH_TEST, &depth_test_enabled);
-                glGetIntegerv(GL_STENCIL_TEST, &stencil_test_enabled);
-                glGetIntegerv(GL_CURRENT_PROGRAM, &current_program);
-                glGetIntegerv(GL_UNPACK_ALIGNMENT, &unpack_alignment);
-                glGetIntegerv(GL_PACK_ALIGNMENT, &pack_alignment);
-                glGetIntegerv(GL_FRAMEBUFFER_BINDING, &current_framebuffer);
-                glGetFloatv(GL_COLOR_CLEAR_VALUE, clear_color);
-                glGetIntegerv(GL_STENCIL_CLEAR_VALUE, &clear_stencil);
-                glGetIntegerv(GL_STENCIL_FUNC, &stencil.func);
-                glGetIntegerv(GL_STENCIL_REF, &stencil.ref);
-                glGetIntegerv(GL_STENCIL_VALUE_MASK, &stencil.mask);
-                glGetIntegerv(GL_STENCIL_PASS_DEPTH_FAIL, &stencil.zfail);
-                glGetIntegerv(GL_STENCIL_FAIL, &stencil.fail);
-                glGetIntegerv(GL_STENCIL_PASS_DEPTH_PASS, &stencil.pass);
-                glGetIntegerv(GL_STENCIL_WRITEMASK, &stencil.wmask);
-                glGetIntegerv(GL_RASTERIZER_DISCARD, &rasterizer_discard);
-                glGetIntegerv(GL_TRANSFORM_FEEDBACK_BUFFER_BINDING, &tf_buffer_binding);
-            }
-            ~opengl_state_capture() {
-                for (int i = 0; i < 4; ++i)
+            }
+            for (; x < end; ++x)
+            {
+                if (row[size_t(x) * components] != 0)
+                    return x;
+            }
+            return end;
+        }
+
+        // Index of the last texel in [begin, end) of a mask row whose first channel is not zero, or begin - 1.
+        int last_set_texel(const std::uint8_t* row, int components, int begin, int end)
+        {
+            int x = end;
+            if (components == 1)
+            {
+                for (; x - 8 >= begin; x -= 8)
                 {
-                    glActiveTexture(GLenum(GL_TEXTURE0 + i));
-                    glBindTexture(GL_TEXTURE_2D, std::uint32_t(tex2d_bindings[i]));
+                    std::uint64_t word;
+                    std::memcpy(&word, row + x - 8, sizeof(word));
+                    if (word != 0)
+                        break;
                 }
-                glActiveTexture(GLenum(active_texture));
-                glClearColor(clear_color[0], clear_color[1], clear_color[2], clear_color[3]);
-                glClearStencil(clear_stencil);
-                glBindVertexArray(current_vao);
-
-                glStencilFunc(GLenum(stencil.func), stencil.ref, stencil.mask);
-                glStencilOp(GLenum(stencil.fail), GLenum(stencil.zfail), GLenum(stencil.pass));
-                glStencilMask(stencil.wmask);
-
-                glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
-                glScissor(scissor[0], scissor[1], scissor[2], scissor[3]);
-                glEnable(GL_DEPTH_TEST);
-                glUseProgram(current_program);
-                glPixelStorei(GL_UNPACK_ALIGNMENT, unpack_alignment);
-                glPixelStorei(GL_PACK_ALIGNMENT, pack_alignment);
-                glBindFramebuffer(GL_FRAMEBUFFER, current_framebuffer);
-                (depth_test_enabled ? glEnable : glDisable)(GL_DEPTH_TEST);
-                (rasterizer_discard ? glEnable : glDisable)(GL_RASTERIZER_DISCARD);
-                (stencil_test_enabled ? glEnable : glDisable)(GL_STENCIL_TEST);
-            }
-
-            int rasterizer_discard;
-            int tf_buffer_binding;
-            int current_vao;
-            int active_texture;
-            int tex2d_bindings[4];
-            int viewport[4];
-            int scissor[4];
-            int depth_test_enabled;
-            int stencil_test_enabled;
-            int current_program;
-            int pack_alignment;
-            int unpack_alignment;
-            int current_framebuffer;
-            float clear_color[4];
-            int clear_stencil;
-            struct {
-                int func;
-                int ref;
-                int mask;
-                int fail;
-                int zfail;
-                int pass;
-                int wmask;
-            } stencil;
-        };
+            }
+            for (; x > begin; --x)
+            {
+                if (row[size_t(x - 1) * components] != 0)
+                    return x - 1;
+            }
+            return begin - 1;
+        }
 
-        void dispatch()
+        // Bounding box of the texels of the mask which are not zero. Empty rows are skipped from the top and the bottom,
+        // and the rows in between are only searched outside of the columns found so far.
+        std::optional<image_region> mask_bounds(const image& mask)
         {
-            glDrawArrays(GL_TRIANGLES, 0, 3);
+            const glm::ivec2 dimensions = mask.dimensions();
+            const int components = mask.components();
+            const auto row = [&](int y) {
+                return reinterpret_cast<const std::uint8_t*>(mask.data()) + size_t(y) * dimensions.x * components;
+            };
+
+            int top = 0;
+            while (top < dimensions.y && first_set_texel(row(top), components, 0, dimensions.x) == dimensions.x)
+                ++top;
+            if (top == dimensions.y)
+                return std::nullopt;
+            int bottom = dimensions.y - 1;
+            while (first_set_texel(row(bottom), components, 0, dimensions.x) == dimensions.x)
+                --bottom;
+
+            int left = dimensions.x;
+            int right = 0; // exclusive
+            for (int y = top; y <= bottom; ++y)
+            {
+                left = first_set_texel(row(y), components, 0, left);
+                right = last_set_texel(row(y), components, right, dimensions.x) + 1;
+            }
+            return image_region{ glm::ivec2(left, top), glm::ivec2(right - left, bottom - top + 1) };
         }
 
-        void apply_gaussian(detail::sift_state & state)
+        // Rectangles of the region of interest clipped to the image. Without rectangles, the bounding box of the mask,
+        // or the whole image without a mask either.
+        std::vector<image_region> roi_areas(glm::ivec2 dimensions, const region_of_interest& roi)
         {
-            glUseProgram(state.gauss_blur.program);
-            glUniform1i(state.gauss_blur.in_texture_location, 0);
-            glActiveTexture(GL_TEXTURE0);
-            for (int scale = 0; scale < int(state.gaussian_textures.size()); ++scale)
+            std::vector<image_region> areas;
+            if (!roi.rectangles.empty())
+            {
+                for (const auto& rect : roi.rectangles)
+                {
+                    const glm::ivec2 begin = glm::clamp(glm::ivec2(rect.x, rect.y), glm::ivec2(0), dimensions);
+                    const glm::ivec2 end = glm::clamp(glm::ivec2(rect.x + rect.z, rect.y + rect.w), glm::ivec2(0), dimensions);
+                    if (glm::all(glm::greaterThan(end, begin)))
+                        areas.push_back({ begin, end - begin });
+                }
+            }
+            else if (roi.mask)
+            {
+                if (const auto bounds = mask_bounds(*roi.mask))
+                    areas.push_back(*bounds);
+            }
+            else
             {
-                glBindFramebuffer(GL_FRAMEBUFFER, state.framebuffers[0]);
+                areas.push_back({ glm::ivec2(0), dimensions });
+            }
+            return areas;
+        }
 
-                // Write from temp_textures[0] (original) to temp_textures[1] using horizontal blur
-                glBindTexture(GL_TEXTURE_2D, state.temporary_textures[0]);
-                glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, state.temporary_textures[1], 0);
-                glUniform1i(state.gauss_blur.u_mip_location, 0);
-                glUniform1i(state.gauss_blur.u_dir_location, 0);
-                glUniform1f(state.gauss_blur.u_sigma_location, std::powf(std::sqrtf(2), float(scale + 1)) * 1.3f);
-                dispatch();
+        // Features on overlapping rectangles are only kept by the first one.
+        bool roi_keeps(const region_of_interest& roi, const std::vector<image_region>& areas, size_t area, float x, float y)
+        {
+            for (size_t i = 0; i < area; ++i)
+            {
+                if (inside(areas[i], x, y))
+                    return false;
+            }
+            return !roi.mask || *mask_texel(*roi.mask, int(x), int(y)) != 0;
+        }
 
-                // Write from temp_textures[1] to textures[scale] using vertical blur
-                glBindTexture(GL_TEXTURE_2D, state.temporary_textures[1]);
-                glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, state.gaussian_textures[scale], 0);
-                glUniform1i(state.gauss_blur.u_dir_location, 1);
-                dispatch();
+        // A mask of another size than the image is ignored.
+        region_of_interest checked_roi(const image& img, const region_of_interest& roi)
+        {
+            region_of_interest checked = roi;
+            if (roi.mask && roi.mask->dimensions() != img.dimensions())
+            {
+                spdlog::warn("Ignoring a {}x{} SIFT mask for a {}x{} image.", roi.mask->dimensions().x, roi.mask->dimensions().y,
+                    img.dimensions().x, img.dimensions().y);
+                checked.mask = nullptr;
             }
-            glFinish();
+            return checked;
         }
 
-        void apply_viewport(int x, int y, int w, int h)
+        // The CPU backend has no stages to skip, so it only drops the features outside of the region of interest.
+        std::vector<feature> detect_features_cpu(const image& img, const region_of_interest& roi, const detection_settings& settings, dst_system system,
+            detection_timings* timings)
         {
-            glViewport(x, y, w, h);
-            glScissor(x, y, w, h);
+            auto features = detect_features_cpu(img, settings, dst_system::pixel_coordinates, timings);
+            perf_log plog("SIFT CPU");
+            plog.start();
+            const auto areas = roi_areas(img.dimensions(), roi);
+            features.erase(std::remove_if(features.begin(), features.end(), [&](const feature& feat) {
+                const auto area = std::find_if(areas.begin(), areas.end(), [&](const auto& a) { return inside(a, feat.x, feat.y); });
+                return area == areas.end() || !roi_keeps(roi, areas, size_t(area - areas.begin()), feat.x, feat.y);
+                }), features.end());
+            plog.step("Filter region of interest");
+            convert_coordinates(features, img.dimensions(), system, plog);
+            return features;
         }
 
-        void generate_difference_of_gaussian(detail::sift_state & state)
+        // Runs the tiles of the region of interest through the frames of the cache and merges their features. With more
+        // than one frame, the next tile is submitted before the previous one is read back. Each feature is only kept by the
+        // tile which owns its position, which drops the duplicates found in the overlapping halos.
+        template<typename Output, typename PerfLog>
+        Output detect_features_tiled(sift_cache& cache, const image& img, const region_of_interest& roi, const detection_settings& settings,
+            dst_system system, PerfLog& plog, detection_timings& timings)
         {
-            glUseProgram(state.difference.program);
-            glUniform1i(state.difference.u_current_tex_location, 0);
-            glUniform1i(state.difference.u_previous_tex_location, 1);
+            using Feature = typename Output::value_type;
+            constexpr auto format = descriptor_format_of<Feature>();
+            const auto areas = roi_areas(img.dimensions(), roi);
+            std::vector<tile> tiles;
+            for (size_t i = 0; i < areas.size(); ++i)
+                make_tiles(tiles, img.dimensions(), areas[i], i, settings);
 
-            glBindFramebuffer(GL_FRAMEBUFFER, state.framebuffers[0]);
-            // Now compute difference of gaussian_textures[scale] to previous scale from gaussian_textures[scale-1]...
-            for (int scale = 1; scale < int(state.gaussian_textures.size()); ++scale)
+            Output features;
+            timings = detection_timings{};
+            timings.valid = true;
+            if (tiles.empty())
             {
-                // Write it to difference_of_gaussian_textures[scale]
-                glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, state.difference_of_gaussian_textures[scale - 1], 0);
-                glActiveTexture(GL_TEXTURE0);
-                glBindTexture(GL_TEXTURE_2D, state.gaussian_textures[scale]);
-                glActiveTexture(GL_TEXTURE1);
-                glBindTexture(GL_TEXTURE_2D, state.gaussian_textures[std::int64_t(scale) - 1]);
-                dispatch();
+                convert_coordinates(features, img.dimensions(), system, plog);
+                return features;
             }
-        }
+            spdlog::info("Detecting SIFT features of a {}x{} image in {} tiles of {}x{}.", img.dimensions().x, img.dimensions().y,
+                tiles.size(), tiles.front().region.size.x, tiles.front().region.size.y);
 
-        void detect_candidates(detail::sift_state & state, int base_width, int base_height)
-        {
-            glUseProgram(state.maximize.program);
-            glUniform1i(state.maximize.u_previous_tex_location, 0);
-            glUniform1i(state.maximize.u_current_tex_location, 1);
-            glUniform1i(state.maximize.u_next_tex_location, 2);
+            const auto collect = [&](sift_cache::frame& frame, const tile& t) {
+                detection_timings tile_timings;
+                for (auto feat : read_detection<std::vector<Feature>>(frame, plog, &tile_timings))
+                {
+                    feat.x += t.region.origin.x;
+                    feat.y += t.region.origin.y;
+                    if (feat.x >= t.core_begin.x && feat.y >= t.core_begin.y && feat.x < t.core_end.x && feat.y < t.core_end.y
+                        && roi_keeps(roi, areas, t.area, feat.x, feat.y))
+                        features.push_back(feat);
+                }
+                timings += tile_timings;
+            };
 
-            glClearColor(0, 0, 0, 1);
-            for (int o = 0; o < state.num_octaves; ++o)
+            // The feature budget is split by the area each tile owns.
+            detection_settings tile_settings = settings;
+            double total_area = 0.0;
+            for (const auto& t : tiles)
+                total_area += double(t.core_end.x - t.core_begin.x) * (t.core_end.y - t.core_begin.y);
+            std::pair<sift_cache::frame*, const tile*> pending{ nullptr, nullptr };
+            for (const auto& t : tiles)
             {
-                glBindFramebuffer(GL_FRAMEBUFFER, state.framebuffers[o]);
-                apply_viewport(0, 0, base_width >> o, base_height >> o);
-                for (size_t feature_scale = 0; feature_scale < state.feature_textures.size(); ++feature_scale)
+                if (settings.max_features != 0)
                 {
-                    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, state.feature_textures[feature_scale], o);
-                    glClear(GL_COLOR_BUFFER_BIT);
-                    glActiveTexture(GL_TEXTURE0);
-                    glBindTexture(GL_TEXTURE_2D, state.difference_of_gaussian_textures[std::int64_t(feature_scale)]);
-                    glActiveTexture(GL_TEXTURE1);
-                    glBindTexture(GL_TEXTURE_2D, state.difference_of_gaussian_textures[std::int64_t(feature_scale) + 1]);
-                    glActiveTexture(GL_TEXTURE2);
-                    glBindTexture(GL_TEXTURE_2D, state.difference_of_gaussian_textures[std::int64_t(feature_scale) + 2]);
-                    glUniform1i(state.maximize.u_neighbors_location, 0);
-                    glUniform1i(state.maximize.u_mip_location, o);
-                    glUniform1i(state.maximize.u_scale_location, int(feature_scale));
-                    dispatch();
+                    const glm::dvec2 core_size = t.core_end - t.core_begin;
+                    tile_settings.max_features = std::max<size_t>(size_t(settings.max_features * core_size.x * core_size.y / total_area), 1);
+                }
+                auto& frame = submit_detection(cache, img, t.region, tile_settings, dst_system::pixel_coordinates, format, plog, roi.mask);
+                if (pending.first)
+                    collect(*pending.first, *pending.second);
+                pending = { &frame, &t };
+                if (cache.frames.size() == 1)
+                {
+                    collect(frame, t);
+                    pending = { nullptr, nullptr };
                 }
             }
+            if (pending.first)
+                collect(*pending.first, *pending.second);
+            plog.step("Merge tiles");
+
+            convert_coordinates(features, img.dimensions(), system, plog);
+            return features;
         }
 
-        struct tf_feature
+        template<typename Output>
+        Output detect_features_gpu(sift_cache& cache, const image& img, const detection_settings& settings, dst_system system, detection_timings* timings,
+            const region_of_interest& roi = {})
         {
-            glm::vec4 feat;
-            std::int32_t octave;
-            float orientation;
-            std::int32_t _pad[2];
-        };
-
-        int filter_features(detail::sift_state & state, int base_width, int base_height, int samples_passed)
-        {
-            glUseProgram(state.filter.program);
-            glUniform1i(state.filter.u_previous_tex_location, 0);
-            glUniform1i(state.filter.u_current_tex_location, 1);
-            glUniform1i(state.filter.u_next_tex_location, 2);
-            glUniform1i(state.filter.u_feature_tex_location, 3);
-            // leave out border of a couple of pixels
-            glUniform1i(state.filter.u_border_location, 8);
-            glEnable(GL_RASTERIZER_DISCARD);
-            std::int64_t tf_buf_offset = 0;
-            std::uint32_t tf_query;
-            glGenQueries(1, &tf_query);
-            glBindBuffer(GL_TRANSFORM_FEEDBACK_BUFFER, state.filter_transform_buffer);
-            int buffer_size;
-            glGetBufferParameteriv(GL_TRANSFORM_FEEDBACK_BUFFER, GL_BUFFER_SIZE, &buffer_size);
-            if (buffer_size < samples_passed * sizeof(tf_feature))
-                glBufferData(GL_TRANSFORM_FEEDBACK_BUFFER, samples_passed * sizeof(tf_feature), nullptr, GL_DYNAMIC_COPY);
+            // Measures CPU time only, the GPU stages are measured with the timestamps of the frame.
+            basic_perf_log<std::chrono::microseconds, std::chrono::steady_clock> plog("SIFT");
+            plog.start();
+            detection_timings local_timings;
+            auto& result_timings = timings ? *timings : local_timings;
 
-            for (int mip = 0; mip < state.num_octaves; ++mip)
+            Output features;
+            if (!roi.rectangles.empty() || roi.mask || use_tiles(img.dimensions(), settings))
             {
-                glUniform1i(state.filter.u_mip_location, mip);
-                for (int scale = 0; scale < state.feature_textures.size(); ++scale)
-                {
-                    glUniform1i(state.filter.u_scale_location, scale);
-                    // Bind previous, current and next scale DoG image
-                    // update sigma uniform
-                    // compute stuff
-                    glBindFramebuffer(GL_FRAMEBUFFER, state.framebuffers[mip]);
-                    apply_viewport(0, 0, base_width >> mip, base_height >> mip);
-                    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, state.feature_textures[scale], mip);
-                    glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER, 0, state.filter_transform_buffer,
-                        tf_buf_offset * sizeof(tf_feature), (samples_passed - tf_buf_offset) * sizeof(tf_feature));
-
-                    glActiveTexture(GL_TEXTURE0);
-                    glBindTexture(GL_TEXTURE_2D, state.difference_of_gaussian_textures[std::int64_t(scale) + 0]);
-                    glActiveTexture(GL_TEXTURE1);
-                    glBindTexture(GL_TEXTURE_2D, state.difference_of_gaussian_textures[std::int64_t(scale) + 1]);
-                    glActiveTexture(GL_TEXTURE2);
-                    glBindTexture(GL_TEXTURE_2D, state.difference_of_gaussian_textures[std::int64_t(scale) + 2]);
-                    glActiveTexture(GL_TEXTURE3);
-                    glBindTexture(GL_TEXTURE_2D, state.feature_textures[scale]);
-
-                    glBeginQuery(GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN, tf_query);
-                    glBeginTransformFeedback(GL_POINTS);
-                    glDrawArrays(GL_POINTS, 0, (base_width >> mip) * (base_height >> mip));
-                    glEndQuery(GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN);
-                    glEndTransformFeedback();
-                    std::uint32_t prims_written = 0;
-                    glGetQueryObjectuiv(tf_query, GL_QUERY_RESULT, &prims_written);
-                    tf_buf_offset += std::int64_t(prims_written);
-                }
+                features = detect_features_tiled<Output>(cache, img, roi, settings, system, plog, result_timings);
+            }
+            else
+            {
+                constexpr auto format = descriptor_format_of<typename Output::value_type>();
+                const image_region region{ glm::ivec2(0), img.dimensions() };
+                features = read_detection<Output>(submit_detection(cache, img, region, settings, system, format, plog), plog, &result_timings);
             }
-            glDisable(GL_RASTERIZER_DISCARD);
-            return tf_buf_offset;
+            log_timings(result_timings);
+            return features;
         }
 
-        int compute_orientations(detail::sift_state & state, int num_features, int base_width, int base_height) {
+        // Submits each image before reading back the previous one, so the GPU works on the next image while the previous
+        // results are waited for and copied. This only overlaps with two or more frames in the cache. The OpenGL state is
+        // restored once for the whole batch. on_read(index, frame, features) is called in input order after each readback,
+        // see detect_batch for when frame is null.
+        template<typename Output, typename OnRead>
+        std::vector<Output> detect_batch_gpu(sift_cache& cache, const image* images, size_t count, const detection_settings& settings, dst_system system,
+            detection_timings* timings, OnRead&& on_read)
+        {
+            basic_perf_log<std::chrono::microseconds, std::chrono::steady_clock> plog("SIFT Batch");
+            plog.start();
+            constexpr auto format = descriptor_format_of<typename Output::value_type>();
+            gl_state_scope state_scope;
+
+            std::vector<Output> results(count);
+            detection_timings total;
+            total.valid = true;
+            const auto collect = [&](sift_cache::frame& frame, size_t index) {
+                detection_timings image_timings;
+                results[index] = read_detection<Output>(frame, plog, &image_timings);
+                on_read(index, &frame, results[index]);
+                total += image_timings;
+            };
 
-            glUseProgram(state.orientation.program);
-            for (int i = 0; i < state.difference_of_gaussian_textures.size(); ++i)
+            std::pair<sift_cache::frame*, size_t> pending{ nullptr, 0 };
+            for (size_t i = 0; i < count; ++i)
             {
-                glUniform1i(state.orientation.u_textures_locations[i], i);
-                glActiveTexture(GLenum(int(GL_TEXTURE0) + i));
-                glBindTexture(GL_TEXTURE_2D, state.difference_of_gaussian_textures[i]);
+                if (use_tiles(images[i].dimensions(), settings))
+                {
+                    // Tiled detections pipeline through the frames on their own.
+                    if (pending.first)
+                        collect(*pending.first, pending.second);
+                    pending = { nullptr, 0 };
+                    detection_timings image_timings;
+                    results[i] = detect_features_tiled<Output>(cache, images[i], region_of_interest{}, settings, system, plog, image_timings);
+                    on_read(i, static_cast<const sift_cache::frame*>(nullptr), results[i]);
+                    total += image_timings;
+                    continue;
+                }
+
+                const image_region region{ glm::ivec2(0), images[i].dimensions() };
+                auto& frame = submit_detection(cache, images[i], region, settings, system, format, plog);
+                if (pending.first)
+                    collect(*pending.first, pending.second);
+                pending = { &frame, i };
+                // With a single frame, the next submission would have to read this one back anyway.
+                if (cache.frames.size() == 1)
+                {
+                    collect(frame, i);
+                    pending = { nullptr, 0 };
+                }
             }
+            if (pending.first)
+                collect(*pending.first, pending.second);
 
-            glEnable(GL_RASTERIZER_DISCARD);
-            std::uint32_t tf_query;
-            glGenQueries(1, &tf_query);
-            int filter_buffer_size = num_features * sizeof(tf_feature);
-            int orientation_buffer_size = 0;
-            glBindBuffer(GL_TRANSFORM_FEEDBACK_BUFFER, state.orientation_transform_buffer);
-            glGetBufferParameteriv(GL_TRANSFORM_FEEDBACK_BUFFER, GL_BUFFER_SIZE, &orientation_buffer_size);
-            if (filter_buffer_size > orientation_buffer_size)
-                glBufferData(GL_TRANSFORM_FEEDBACK_BUFFER, filter_buffer_size, nullptr, GL_DYNAMIC_COPY);
+            log_timings(total);
+            if (timings)
+                *timings = total;
+            return results;
+        }
 
-            glBindFramebuffer(GL_FRAMEBUFFER, state.framebuffers[0]);
-            apply_viewport(0, 0, base_width, base_height);
-            glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, state.feature_textures[0], 0);
-            glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER, 0, state.orientation_transform_buffer,
-                0, filter_buffer_size);
+        std::shared_ptr<sift_cache> create_detection_cache(const image& img, const detection_settings& settings)
+        {
+            // Tiles are pipelined through two frames.
+            const size_t frames_in_flight = use_tiles(img.dimensions(), settings) ? 2 : 1;
+            return create_cache(settings.octaves, settings.feature_scales, frames_in_flight);
+        }
 
-            glBindVertexArray(state.orientation_vao);
-            glEnableVertexAttribArray(0);
-            glEnableVertexAttribArray(1);
-            glBindBuffer(GL_ARRAY_BUFFER, state.filter_transform_buffer);
-            glVertexAttribPointer(0, 4, GL_FLOAT, false, sizeof(tf_feature), (const void*)offsetof(tf_feature, feat));
-            glVertexAttribPointer(1, 1, GL_INT, false, sizeof(tf_feature), (const void*)offsetof(tf_feature, octave));
+        // Output is any of the types detect_features_gpu reads back, the CPU backend converts its features to it.
+        template<typename Output>
+        Output detect_cpu(const image& img, const region_of_interest& roi, const detection_settings& settings, dst_system system, detection_timings* timings)
+        {
+            if constexpr (std::is_same_v<Output, std::vector<binary_feature>>)
+            {
+                return detect_binary_features_cpu(img, settings, system, timings);
+            }
+            else
+            {
+                auto features = roi.rectangles.empty() && !roi.mask ? detect_features_cpu(img, settings, system, timings)
+                    : detect_features_cpu(img, roi, settings, system, timings);
+                if constexpr (std::is_same_v<Output, std::vector<feature>>)
+                    return features;
+                else if constexpr (std::is_same_v<Output, std::vector<compact_feature>>)
+                    return quantize_features(features);
+                else if constexpr (std::is_same_v<typename Output::value_type, feature>)
+                    return Output(features);
+                else
+                {
+                    const auto compact = quantize_features(features);
+                    Output output;
+                    output.assign(compact.data(), compact.size());
+                    return output;
+                }
+            }
+        }
 
-            glBeginQuery(GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN, tf_query);
-            glBeginTransformFeedback(GL_POINTS);
-            glDrawArrays(GL_POINTS, 0, num_features);
-            glEndQuery(GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN);
-            glEndTransformFeedback();
-            std::uint32_t prims_written = 0;
-            glGetQueryObjectuiv(tf_query, GL_QUERY_RESULT, &prims_written);
-            std::int64_t tf_buf_offset = std::int64_t(prims_written);
-            glBindVertexArray(0);
-            glDisable(GL_RASTERIZER_DISCARD);
-            return tf_buf_offset;
+        // All single image detections dispatch here, to the backend of the settings. Without a cache, the GPU uses a temporary one.
+        template<typename Output>
+        Output detect(sift_cache* cache, const image& img, const region_of_interest& roi, const detection_settings& settings, dst_system system,
+            detection_timings* timings)
+        {
+            const auto checked = checked_roi(img, roi);
+            if (settings.backend == detection_backend::cpu)
+                return detect_cpu<Output>(img, checked, settings, system, timings);
+            if (!cache)
+                return detect_features_gpu<Output>(*create_detection_cache(img, settings), img, settings, system, timings, checked);
+            return detect_features_gpu<Output>(*cache, img, settings, system, timings, checked);
         }
 
-        void compute_descriptors(detail::sift_state& state, int num_features)
+        // Batch version of detect, see detect_batch_gpu. Features of the CPU backend and of tiled detections are merged on
+        // the CPU, so there is no buffer holding all of them, and on_read gets a null frame for them.
+        template<typename Output, typename OnRead>
+        std::vector<Output> detect_batch(sift_cache& cache, const image* images, size_t count, const detection_settings& settings, dst_system system,
+            detection_timings* timings, OnRead&& on_read)
         {
-            glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, state.orientation_transform_buffer, 0, num_features * sizeof(tf_feature));
-            int full_buffer_size = 0;
-            glBindBuffer(GL_SHADER_STORAGE_BUFFER, state.full_feature_buffer);
-            glGetBufferParameteriv(GL_SHADER_STORAGE_BUFFER, GL_BUFFER_SIZE, &full_buffer_size);
-            if (full_buffer_size < num_features * sizeof(feature))
-                glBufferData(GL_SHADER_STORAGE_BUFFER, num_features * sizeof(feature), nullptr, GL_DYNAMIC_COPY);
-            glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 1, state.full_feature_buffer, 0, num_features * sizeof(feature));
-            glUseProgram(state.descriptor.program);
+            if (settings.backend != detection_backend::cpu)
+                return detect_batch_gpu<Output>(cache, images, count, settings, system, timings, on_read);
 
-            for (int i = 0; i < state.difference_of_gaussian_textures.size(); ++i)
+            // There are no GPU stages to measure.
+            if (timings)
+                *timings = detection_timings{};
+            std::vector<Output> results;
+            for (size_t i = 0; i < count; ++i)
             {
-                glUniform1i(state.descriptor.u_textures_locations[i], i);
-                glActiveTexture(GLenum(int(GL_TEXTURE0) + i));
-                glBindTexture(GL_TEXTURE_2D, state.difference_of_gaussian_textures[i]);
+                results.push_back(detect_cpu<Output>(images[i], region_of_interest{}, settings, system, nullptr));
+                on_read(i, static_cast<const sift_cache::frame*>(nullptr), results.back());
             }
-            glDispatchCompute((num_features + 31) / 32, 1, 1);
+            return results;
         }
     }
 
-    struct sift_cache
+    std::vector<feature> detect_features(const image & img, const detection_settings & settings, dst_system system, detection_timings* timings)
     {
-        sift_cache(size_t num_octaves, size_t num_feature_scales) : state(num_octaves, num_feature_scales) {}
-        detail::sift_state state;
-    };
-    std::shared_ptr<sift_cache> create_cache(size_t num_octaves, size_t num_feature_scales)
+        return detect<std::vector<feature>>(nullptr, img, {}, settings, system, timings);
+    }
+
+    std::vector<feature> detect_features(sift_cache & cache, const image & img, const detection_settings & settings, dst_system system, detection_timings* timings)
+    {
+        return detect<std::vector<feature>>(&cache, img, {}, settings, system, timings);
+    }
+
+    std::vector<feature> detect_features(const image& img, const region_of_interest& roi, const detection_settings& settings, dst_system system,
+        detection_timings* timings)
+    {
+        return detect<std::vector<feature>>(nullptr, img, roi, settings, system, timings);
+    }
+
+    std::vector<feature> detect_features(sift_cache& cache, const image& img, const region_of_interest& roi, const detection_settings& settings,
+        dst_system system, detection_timings* timings)
+    {
+        return detect<std::vector<feature>>(&cache, img, roi, settings, system, timings);
+    }
+
+    std::vector<std::vector<feature>> detect_features(sift_cache& cache, const std::vector<image>& images, const detection_settings& settings, dst_system system,
+        detection_timings* timings)
+    {
+        return detect_batch<std::vector<feature>>(cache, images.data(), images.size(), settings, system, timings,
+            [](size_t, const sift_cache::frame*, const std::vector<feature>&) {});
+    }
+
+    std::vector<compact_feature> detect_compact_features(const image& img, const detection_settings& settings, dst_system system, detection_timings* timings)
+    {
+        return detect<std::vector<compact_feature>>(nullptr, img, {}, settings, system, timings);
+    }
+
+    std::vector<compact_feature> detect_compact_features(sift_cache& cache, const image& img, const detection_settings& settings, dst_system system, detection_timings* timings)
+    {
+        return detect<std::vector<compact_feature>>(&cache, img, {}, settings, system, timings);
+    }
+
+    feature_set detect_feature_set(const image& img, const detection_settings& settings, dst_system system, detection_timings* timings)
+    {
+        return detect<feature_set>(nullptr, img, {}, settings, system, timings);
+    }
+
+    feature_set detect_feature_set(sift_cache& cache, const image& img, const detection_settings& settings, dst_system system, detection_timings* timings)
+    {
+        return detect<feature_set>(&cache, img, {}, settings, system, timings);
+    }
+
+    compact_feature_set detect_compact_feature_set(const image& img, const detection_settings& settings, dst_system system, detection_timings* timings)
+    {
+        return detect<compact_feature_set>(nullptr, img, {}, settings, system, timings);
+    }
+
+    compact_feature_set detect_compact_feature_set(sift_cache& cache, const image& img, const detection_settings& settings, dst_system system, detection_timings* timings)
     {
-        return std::make_shared<sift_cache>(num_octaves, num_feature_scales);
+        return detect<compact_feature_set>(&cache, img, {}, settings, system, timings);
     }
 
-    std::vector<feature> detect_features(const image & img, const detection_settings & settings, dst_system system)
+    std::vector<binary_feature> detect_binary_features(const image& img, const detection_settings& settings, dst_system system, detection_timings* timings)
     {
-        auto in_state = create_cache(settings.octaves, settings.feature_scales);
-        return detect_features(*in_state, img, settings, system);
+        return detect<std::vector<binary_feature>>(nullptr, img, {}, settings, system, timings);
     }
 
-    std::vector<feature> detect_features(sift_cache & cache, const image & img, const detection_settings & settings, dst_system system)
+    std::vector<binary_feature> detect_binary_features(sift_cache& cache, const image& img, const detection_settings& settings, dst_system system, detection_timings* timings)
     {
-        using clock_type =
-#if defined(__ANDROID__)
-            std::chrono::system_clock;
-#else
-            gl_query_clock;
-#endif
+        return detect<std::vector<binary_feature>>(&cache, img, {}, settings, system, timings);
+    }
 
-        basic_perf_log<std::chrono::microseconds, clock_type> plog("SIFT");
+    detection_ticket detect_features_async(sift_cache& cache, const image& img, const detection_settings& settings, dst_system system)
+    {
+        if (settings.backend == detection_backend::cpu)
+        {
+            const detection_ticket ticket{ cache.next_ticket++ };
+            store_finished(cache, ticket.id).features = detect_cpu<std::vector<feature>>(img, {}, settings, system, nullptr);
+            return ticket;
+        }
 
+        // Measures CPU time only, a GPU clock would wait for the submitted commands.
+        perf_log plog("SIFT Submit");
         plog.start();
-        // Before starting, capture the OpenGL state for a seamless interaction
-        opengl_state_capture capture_state;
-        glDisable(GL_MULTISAMPLE);
-        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-        glPixelStorei(GL_PACK_ALIGNMENT, 1);
-        glDisable(GL_DEPTH_TEST);
-        auto& state = cache.state;
-        state.resize(img.dimensions().x, img.dimensions().y);
-        std::vector<float> imgf_data(img.dimensions().x * img.dimensions().y);
-        float* ins = imgf_data.data();
-        for (auto it = img.data(); it < img.data() + img.size(); it += img.components(), ++ins)
-        {
-            if (img.components() >= 3)
-            {
-                const auto& v3 = reinterpret_cast<glm::u8vec3 const&>(*it);
-                const auto r = glm::vec3(v3) / 255.f;
-                *ins = float(0.21 * r.r + 0.72 * r.g + 0.07 * r.b);
+        const image_region region{ glm::ivec2(0), img.dimensions() };
+        return { submit_detection(cache, img, region, settings, system, detail::descriptor_format::histogram, plog).ticket };
+    }
+
+    bool features_ready(sift_cache& cache, detection_ticket ticket)
+    {
+        if (cache.finished.count(ticket.id) != 0)
+            return true;
+        for (const auto& frame : cache.frames)
+        {
+            if (frame->ticket == ticket.id)
+                return readback_ready(frame->state);
+        }
+        return false;
+    }
+
+    std::vector<feature> wait_features(sift_cache& cache, detection_ticket ticket, detection_timings* timings)
+    {
+        if (const auto it = cache.finished.find(ticket.id); it != cache.finished.end())
+        {
+            auto features = std::move(it->second.features);
+            if (timings)
+                *timings = it->second.timings;
+            cache.finished.erase(it);
+            return features;
+        }
+        for (const auto& frame : cache.frames)
+        {
+            if (frame->ticket == ticket.id)
+            {
+                perf_log plog("SIFT Readback");
+                plog.start();
+                return read_detection<std::vector<feature>>(*frame, plog, timings);
+            }
+        }
+        spdlog::warn("Unknown SIFT detection ticket {}.", ticket.id);
+        return {};
+    }
+
+    namespace
+    {
+        // Without a source buffer, features are uploaded from the CPU instead.
+        resident_descriptors make_resident(sift_cache& cache, std::uint32_t source_buffer, const compact_feature_set& features)
+        {
+            const auto count = std::uint32_t(features.size());
+            const auto size = std::max<size_t>(count, 1) * sizeof(compact_feature);
+            std::uint32_t buffer;
+            glGenBuffers(1, &buffer);
+            glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+            if (source_buffer != 0)
+            {
+                glBufferData(GL_COPY_WRITE_BUFFER, size, nullptr, GL_STATIC_COPY);
+                glBindBuffer(GL_COPY_READ_BUFFER, source_buffer);
+                glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, count * sizeof(compact_feature));
             }
             else
             {
-                *ins = float(*reinterpret_cast<const unsigned char*>(it)) / 255.f;
+                glBufferData(GL_COPY_WRITE_BUFFER, size, features.to_vector().data(), GL_STATIC_DRAW);
             }
-        }
 
-        // Fill temp[0] with original image
-        glBindTexture(GL_TEXTURE_2D, state.temporary_textures[0]);
-        constexpr std::array<GLenum, 4> gl_components{ GL_RED, GL_RG, GL_RGB, GL_RGBA };
-        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, img.dimensions().x, img.dimensions().y, GL_RED, GL_FLOAT, imgf_data.data());
-        plog.step("Initialize prerequisites");
+            // match_comp reads the norms of the descriptors from their padding.
+            if (count != 0)
+            {
+                gl_state_scope state_scope;
+                gl_state::current().use_program(cache.programs->descriptor_norm.program);
+                glUniform1ui(cache.programs->descriptor_norm.u_count_location, count);
+                glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, buffer);
+                constexpr std::uint32_t group_size = 64;
+                glDispatchCompute((count + group_size - 1) / group_size, 1, 1);
+                glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+            }
 
-        const int base_width = img.dimensions().x;
-        const int base_height = img.dimensions().y;
-        apply_viewport(0, 0, base_width, base_height);
-        // Use universal empty vertex array
-        glBindVertexArray(state.empty_vao);
-        // STEP 1: Generate gauss-blurred images
-        apply_gaussian(state);
+            const resident_descriptors descriptors{ cache.next_resident++ };
+            cache.resident[descriptors.id] = { buffer, count };
+            return descriptors;
+        }
 
-        // ... and build pyramid just using mipmaps
-        for (auto id : state.gaussian_textures)
+        void reserve_matches(sift_cache& cache, std::uint32_t capacity)
         {
-            glBindTexture(GL_TEXTURE_2D, id);
-            glGenerateMipmap(GL_TEXTURE_2D);
+            if (capacity <= cache.match_capacity)
+                return;
+            cache.match_capacity = capacity;
+            if (cache.match_buffer == 0)
+                glGenBuffers(1, &cache.match_buffer);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, cache.match_buffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(detail::match_buffer_header) + size_t(capacity) * sizeof(indexed_match), nullptr, GL_DYNAMIC_READ);
         }
-        plog.step("Generate gauss-blurred images");
-
-        // STEP 2: Generate Difference-of-Gaussian images (only the full-size ones)
-        generate_difference_of_gaussian(state);
+    }
 
-        // ... and build pyramid just using mipmaps
-        for (auto id : state.difference_of_gaussian_textures)
+    namespace
+    {
+        std::vector<compact_feature_set> detect_resident(sift_cache& cache, const image* images, size_t count, const detection_settings& settings,
+            resident_descriptors* descriptors, dst_system system, detection_timings* timings)
         {
-            glBindTexture(GL_TEXTURE_2D, id);
-            glGenerateMipmap(GL_TEXTURE_2D);
+            auto features = detect_batch<resident_feature_set>(cache, images, count, settings, system, timings,
+                [&](size_t index, const sift_cache::frame* frame, const compact_feature_set& features) {
+                // Called before the frame is submitted to again, so its feature buffer still holds the descriptors.
+                // Without a frame, the features still have the descriptors to upload.
+                descriptors[index] = make_resident(cache, frame ? frame->state.full_feature_buffer : 0, features);
+                });
+            std::vector<compact_feature_set> results;
+            results.reserve(features.size());
+            for (auto& set : features)
+            {
+                set.drop_descriptors();
+                results.push_back(std::move(set));
+            }
+            return results;
         }
-        plog.step("Generate Difference-of-Gaussian images (only the full-size ones)");
+    }
 
-#ifndef __ANDROID__
-        std::uint32_t count_query;
-        glGenQueries(1, &count_query);
-        glBeginQuery(GL_SAMPLES_PASSED, count_query);
-#endif
-        // STEP 3: Detect feature candidates by testing for extrema
-        detect_candidates(state, base_width, base_height);
-        plog.step("Detect feature candidates by testing for extrema");
-        constexpr auto max_features = 1u << 14;
-        std::uint32_t samples_passed = max_features;
-#ifndef __ANDROID__
-        glEndQuery(GL_SAMPLES_PASSED);
-        glGetQueryObjectuiv(count_query, GL_QUERY_RESULT, &samples_passed);
-        glDeleteQueries(1, &count_query);
-#endif
+    compact_feature_set detect_resident_feature_set(sift_cache& cache, const image& img, const detection_settings& settings, resident_descriptors& descriptors,
+        dst_system system, detection_timings* timings)
+    {
+        return std::move(detect_resident(cache, &img, 1, settings, &descriptors, system, timings).front());
+    }
 
-        // STEP 4: Filter features to exclude outliers and to improve accuracy
-        int num_features = filter_features(state, base_width, base_height, samples_passed);
-        plog.step("Filter features to exclude outliers and to improve accuracy");
+    std::vector<compact_feature_set> detect_resident_feature_sets(sift_cache& cache, const std::vector<image>& images, const detection_settings& settings,
+        std::vector<resident_descriptors>& descriptors, dst_system system, detection_timings* timings)
+    {
+        descriptors.assign(images.size(), resident_descriptors{});
+        return detect_resident(cache, images.data(), images.size(), settings, descriptors.data(), system, timings);
+    }
 
-        num_features = compute_orientations(state, num_features, base_width, base_height);
-        plog.step("Orientation Computation");
+    void release_descriptors(sift_cache& cache, resident_descriptors descriptors)
+    {
+        if (const auto it = cache.resident.find(descriptors.id); it != cache.resident.end())
+        {
+            glDeleteBuffers(1, &it->second.buffer);
+            cache.resident.erase(it);
+        }
+    }
 
-        compute_descriptors(state, num_features);
-        plog.step("Descriptor Computation");
+    resident_descriptors upload_descriptors(sift_cache& cache, const compact_feature_set& features)
+    {
+        return make_resident(cache, 0, features);
+    }
 
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, state.full_feature_buffer);
-        auto d = static_cast<const feature*>(glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, num_features * sizeof(feature), GL_MAP_READ_BIT));
-        std::vector<feature> tf_data(d, d + num_features);
-        glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
-        plog.step("Descriptor Download");
+    void download_descriptors(sift_cache& cache, resident_descriptors descriptors, compact_feature_set& features)
+    {
+        const auto set = cache.resident.find(descriptors.id);
+        if (set == cache.resident.end() || set->second.count != features.size())
+        {
+            spdlog::warn("Unknown resident SIFT descriptors {}.", descriptors.id);
+            return;
+        }
+        features.resize_descriptors();
+        if (features.empty())
+            return;
+        glBindBuffer(GL_COPY_READ_BUFFER, set->second.buffer);
+        const auto mapped = static_cast<const compact_feature*>(glMapBufferRange(GL_COPY_READ_BUFFER, 0,
+            features.size() * sizeof(compact_feature), GL_MAP_READ_BIT));
+        for (size_t i = 0; i < features.size(); ++i)
+            std::copy_n(mapped[i].descriptor.data(), compact_feature_set::descriptor_size, features.descriptor(i));
+        glUnmapBuffer(GL_COPY_READ_BUFFER);
+    }
 
-        if (system == dst_system::normalized_coordinates)
+    std::vector<indexed_match> match_features(sift_cache& cache, resident_descriptors a, resident_descriptors b, const match_settings& settings)
+    {
+        const auto set_a = cache.resident.find(a.id);
+        const auto set_b = cache.resident.find(b.id);
+        if (set_a == cache.resident.end() || set_b == cache.resident.end())
         {
-            std::for_each(tf_data.begin(), tf_data.end(), [&](feature & feat) {
-                feat.x = (2.f * feat.x / img.dimensions().x) - 1.f;
-                feat.y = -((2.f * feat.y / img.dimensions().y) - 1.f);
-                });
-            plog.step("Convert to normalized coordinates");
+            spdlog::warn("Unknown resident SIFT descriptors {} and {}.", a.id, b.id);
+            return {};
         }
-        else if (system == dst_system::image_coordinates)
+        const auto count_a = set_a->second.count;
+        const auto count_b = set_b->second.count;
+        // The ratio test needs two neighbours.
+        if (count_a == 0 || count_b < 2)
+            return {};
+
+        perf_log plog("SIFT GPU Match");
+        plog.start();
+        gl_state_scope state_scope;
+        // Each feature of a has at most one match.
+        reserve_matches(cache, count_a);
+        const detail::match_buffer_header header{ 0 };
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, cache.match_buffer);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(header), &header);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, set_a->second.buffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, set_b->second.buffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, cache.match_buffer);
+
+        gl_state::current().use_program(cache.programs->match.program);
+        glUniform1ui(cache.programs->match.u_count_a_location, count_a);
+        glUniform1ui(cache.programs->match.u_count_b_location, count_b);
+        glUniform1f(cache.programs->match.u_relation_threshold_location, settings.relation_threshold);
+        glUniform1f(cache.programs->match.u_similarity_threshold_location, settings.similarity_threshold);
+        constexpr std::uint32_t group_size = 64;
+        glDispatchCompute((count_a + group_size - 1) / group_size, 1, 1);
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+        plog.step("Compute matches on the GPU");
+
+        // Mapping the header waits for the matcher, the matches are read with a second mapping of just the used range.
+        glBindBuffer(GL_COPY_READ_BUFFER, cache.match_buffer);
+        const auto count = static_cast<const detail::match_buffer_header*>(
+            glMapBufferRange(GL_COPY_READ_BUFFER, 0, sizeof(detail::match_buffer_header), GL_MAP_READ_BIT))->count;
+        glUnmapBuffer(GL_COPY_READ_BUFFER);
+        std::vector<indexed_match> matches(count);
+        if (count != 0)
         {
-            std::for_each(tf_data.begin(), tf_data.end(), [&](feature & feat) {
-                feat.x = feat.x / img.dimensions().x;
-                feat.y = feat.y / img.dimensions().y;
-                });
-            plog.step("Convert to image coordinates");
+            const auto mapped = static_cast<const indexed_match*>(glMapBufferRange(GL_COPY_READ_BUFFER, sizeof(detail::match_buffer_header),
+                count * sizeof(indexed_match), GL_MAP_READ_BIT));
+            std::copy_n(mapped, count, matches.data());
+            glUnmapBuffer(GL_COPY_READ_BUFFER);
         }
-        return tf_data;
+        plog.step("Download matches");
+
+        // Matches are appended in no particular order. Sort them like match_indices, and by index for equal similarities.
+        std::sort(matches.begin(), matches.end(), [](const indexed_match& x, const indexed_match& y) {
+            return x.similarity != y.similarity ? x.similarity > y.similarity : x.a < y.a;
+            });
+        matches.resize(std::min(matches.size(), size_t(std::max(settings.max_match_count, 0))));
+        return matches;
+    }
+
+    std::chrono::nanoseconds detection_timings::gpu_total() const
+    {
+        return upload + blur + difference_of_gaussian + extrema + gradients + filter + orientation + selection + descriptor;
+    }
+
+    detection_timings& detection_timings::operator+=(const detection_timings& other)
+    {
+        valid = valid && other.valid;
+        upload += other.upload;
+        blur += other.blur;
+        difference_of_gaussian += other.difference_of_gaussian;
+        extrema += other.extrema;
+        gradients += other.gradients;
+        filter += other.filter;
+        orientation += other.orientation;
+        selection += other.selection;
+        descriptor += other.descriptor;
+        readback += other.readback;
+        return *this;
     }
 
     float cosine_similarity(const float* a, const float* b, unsigned int size)
@@ -482,68 +1745,177 @@ namespace mpp::sift {
         return dot / (sqrt(denom_a) * sqrt(denom_b));
     }
 
-    std::vector<match> match_features(const std::vector<feature> & a, const std::vector<feature> & b, const match_settings & settings)
+    float cosine_similarity(const std::uint8_t* a, const std::uint8_t* b, unsigned int size)
     {
-        perf_log plog("SIFT Match");
-        plog.start();
-        constexpr auto stride = 16;
-        std::array<std::multimap<float, std::pair<const sift::feature*, const sift::feature*>, std::greater<float>>, stride> amatches;
+        // 128 products of at most 255^2 fit into 32 bits.
+        std::uint32_t dot = 0;
+        std::uint32_t denom_a = 0;
+        std::uint32_t denom_b = 0;
+        for (auto i = 0u; i < size; ++i) {
+            dot += std::uint32_t(a[i]) * b[i];
+            denom_a += std::uint32_t(a[i]) * a[i];
+            denom_b += std::uint32_t(b[i]) * b[i];
+        }
+        return float(dot) / (sqrt(float(denom_a)) * sqrt(float(denom_b)));
+    }
 
-        struct distance_compute
+    compact_feature quantize_descriptor(const feature& feat)
+    {
+        compact_feature result;
+        result.x = feat.x;
+        result.y = feat.y;
+        result.sigma = feat.sigma;
+        result.scale = feat.scale;
+        result.octave = feat.octave;
+        result.orientation = feat.orientation;
+        result._pad[0] = result._pad[1] = 0.f;
+        std::transform(feat.descriptor.histrogram.begin(), feat.descriptor.histrogram.end(), result.descriptor.histogram.begin(), [](float value) {
+            return std::uint8_t(std::clamp(int(512.f * value), 0, 255));
+            });
+        return result;
+    }
+
+    namespace
+    {
+        // compute is called with the index of a feature in a and the index of a feature in b.
+        template<typename Similarity>
+        std::vector<indexed_match> match_indices(size_t size_a, size_t size_b, const match_settings & settings, Similarity compute)
         {
-            float operator()(const sift::feature* a, const sift::feature* b) const
-            {
-                return cosine_similarity(a->descriptor.histrogram.data(), b->descriptor.histrogram.data(), 128);
-            }
-        } compute;
+            perf_log plog("SIFT Match");
+            plog.start();
+            constexpr auto stride = 16;
+            std::array<std::multimap<float, std::pair<std::uint32_t, std::uint32_t>, std::greater<float>>, stride> amatches;
 
-        std::atomic_int count = 0;
+            std::atomic_int count = 0;
 
-        for_n(stride, [&](int i) {
-            const int step = (a.size() + stride - 1) / float(stride);
-            std::multimap<float, const sift::feature*, std::greater<float>> vec;
-            for (int j = i * step; j < (i+1) * step && j < a.size(); j++)
-            {
-                auto& fta = a[j];
-                auto& map = amatches[i];
-                vec.clear();
-                for (auto& ftb : b)
+            for_n(stride, [&](int i) {
+                const int step = (size_a + stride - 1) / float(stride);
+                std::multimap<float, std::uint32_t, std::greater<float>> vec;
+                for (int j = i * step; j < (i+1) * step && j < size_a; j++)
                 {
-                    const auto sim = compute(&fta, &ftb);
-                    vec.emplace(sim, &ftb);
-                }
+                    auto& map = amatches[i];
+                    vec.clear();
+                    for (std::uint32_t k = 0; k < size_b; ++k)
+                    {
+                        const auto sim = compute(std::uint32_t(j), k);
+                        vec.emplace(sim, k);
+                    }
 
-                auto first = vec.begin();
-                auto second = first;
-                second++;
-                if (!(vec.size() < 2 || second->first / first->first > settings.relation_threshold || first->first < settings.similarity_threshold))
-                {
-                    map.emplace(first->first, std::make_pair(&fta, first->second));
-                    ++count;
+                    auto first = vec.begin();
+                    auto second = first;
+                    second++;
+                    if (!(vec.size() < 2 || second->first / first->first > settings.relation_threshold || first->first < settings.similarity_threshold))
+                    {
+                        map.emplace(first->first, std::make_pair(std::uint32_t(j), first->second));
+                        ++count;
+                    }
                 }
+                });
+            plog.step("Compute matches by finding each features nearest neighbour");
+
+            std::multimap<float, std::pair<std::uint32_t, std::uint32_t>, std::greater<float>> best_matches;
+            for (auto const& map : amatches)
+            {
+                for (const auto& item : map)
+                    best_matches.emplace(item.first, item.second);
             }
-            });
-        plog.step("Compute matches by finding each features nearest neighbour");
 
-        std::multimap<float, std::pair<const sift::feature*, const sift::feature*>, std::greater<float>> best_matches;
-        for (auto const& map : amatches)
+            std::vector<indexed_match> matches;
+            matches.reserve(std::min(count.load(), settings.max_match_count));
+            auto it = best_matches.begin();
+            for (int i = 0; i < std::min(count.load(), settings.max_match_count); ++i)
+            {
+                matches.emplace_back(indexed_match{ it->second.first, it->second.second, it->first });
+                it++;
+            }
+            plog.step("Merging multithreaded match results.");
+
+            return matches;
+        }
+
+        template<typename Match, typename Feature>
+        std::vector<Match> gather_matches(const std::vector<indexed_match>& matches, const std::vector<Feature>& a, const std::vector<Feature>& b)
         {
-            for (const auto& item : map)
-                best_matches.emplace(item.first, item.second);
+            std::vector<Match> result(matches.size());
+            std::transform(matches.begin(), matches.end(), result.begin(), [&](const indexed_match& m) {
+                return Match{ a[m.a], b[m.b], m.similarity };
+                });
+            return result;
         }
 
-        std::vector<match> features;
-        features.reserve(std::min(count.load(), settings.max_match_count));
-        auto it = best_matches.begin();
-        for (int i = 0; i < std::min(count.load(), settings.max_match_count); ++i)
+        template<typename Feature>
+        std::vector<std::pair<glm::vec2, glm::vec2>> corresponding_points_impl(const std::vector<indexed_match>& matches, const basic_feature_set<Feature>& a,
+            const basic_feature_set<Feature>& b)
         {
-            features.emplace_back(match{ *it->second.first, *it->second.second, it->first });
-            it++;
+            std::vector<std::pair<glm::vec2, glm::vec2>> pt(matches.size());
+            size_t i = 0;
+            for (auto& m : matches)
+                pt[i++] = std::make_pair(a.positions()[m.a], b.positions()[m.b]);
+            return pt;
         }
-        plog.step("Merging multithreaded match results.");
+    }
+
+    std::vector<match> match_features(const std::vector<feature> & a, const std::vector<feature> & b, const match_settings & settings)
+    {
+        const auto matches = match_indices(a.size(), b.size(), settings, [&](std::uint32_t i, std::uint32_t j) {
+            return cosine_similarity(a[i].descriptor.histrogram.data(), b[j].descriptor.histrogram.data(), 128);
+            });
+        return gather_matches<match>(matches, a, b);
+    }
+
+    std::vector<compact_match> match_features(const std::vector<compact_feature> & a, const std::vector<compact_feature> & b, const match_settings & settings)
+    {
+        const auto matches = match_indices(a.size(), b.size(), settings, [&](std::uint32_t i, std::uint32_t j) {
+            return cosine_similarity(a[i].descriptor.histogram.data(), b[j].descriptor.histogram.data(), 128);
+            });
+        return gather_matches<compact_match>(matches, a, b);
+    }
+
+    std::vector<indexed_match> match_features(const feature_set& a, const feature_set& b, const match_settings& settings)
+    {
+        return match_indices(a.size(), b.size(), settings, [&](std::uint32_t i, std::uint32_t j) {
+            return cosine_similarity(a.descriptor(i), b.descriptor(j), feature_set::descriptor_size);
+            });
+    }
+
+    std::vector<indexed_match> match_features(const compact_feature_set& a, const compact_feature_set& b, const match_settings& settings)
+    {
+        return match_indices(a.size(), b.size(), settings, [&](std::uint32_t i, std::uint32_t j) {
+            return cosine_similarity(a.descriptor(i), b.descriptor(j), compact_feature_set::descriptor_size);
+            });
+    }
+
+    std::vector<binary_match> match_features(const std::vector<binary_feature>& a, const std::vector<binary_feature>& b, const match_settings& settings)
+    {
+        perf_log plog("SIFT Binary Match");
+        plog.start();
+        constexpr auto stride = 16;
+        std::array<std::vector<binary_match>, stride> amatches;
+
+        for_n(stride, [&](int i) {
+            const size_t step = (a.size() + stride - 1) / stride;
+            for (size_t j = i * step; j < (i + 1) * step && j < a.size(); ++j)
+            {
+                // Both nearest neighbours in one pass, each distance is only four popcounts.
+                constexpr size_t feature_words = sizeof(binary_feature) / sizeof(std::uint32_t);
+                const auto [best, second, best_index] = b.empty() ? detail::hamming_neighbours{ 0, 0, 0 }
+                    : detail::nearest_hamming_neighbours(a[j].descriptor.data(), b[0].descriptor.data(), b.size(), feature_words);
 
-        return features;
+                if (b.size() >= 2 && best <= settings.max_hamming_distance && best < settings.relation_threshold * second)
+                    amatches[i].push_back(binary_match{ a[j], b[best_index], best });
+            }
+            });
+        plog.step("Compute matches by finding each features nearest neighbour");
+
+        std::vector<binary_match> matches;
+        for (auto& m : amatches)
+            matches.insert(matches.end(), m.begin(), m.end());
+        std::stable_sort(matches.begin(), matches.end(), [](const binary_match& x, const binary_match& y) { return x.distance < y.distance; });
+        matches.resize(std::min(matches.size(), size_t(std::max(settings.max_match_count, 0))));
+        plog.step("Merging multithreaded match results.");
+        return matches;
     }
+
     std::vector<std::pair<glm::vec2, glm::vec2>> corresponding_points(const std::vector<match> & matches)
     {
         std::vector<std::pair<glm::vec2, glm::vec2>> pt(matches.size());
@@ -552,4 +1924,28 @@ namespace mpp::sift {
             pt[i++] = std::make_pair(glm::vec2(m.a.x, m.a.y), glm::vec2(m.b.x, m.b.y));
         return pt;
     }
-}
+    std::vector<std::pair<glm::vec2, glm::vec2>> corresponding_points(const std::vector<compact_match> & matches)
+    {
+        std::vector<std::pair<glm::vec2, glm::vec2>> pt(matches.size());
+        size_t i = 0;
+        for (auto& m : matches)
+            pt[i++] = std::make_pair(glm::vec2(m.a.x, m.a.y), glm::vec2(m.b.x, m.b.y));
+        return pt;
+    }
+    std::vector<std::pair<glm::vec2, glm::vec2>> corresponding_points(const std::vector<binary_match>& matches)
+    {
+        std::vector<std::pair<glm::vec2, glm::vec2>> pt(matches.size());
+        size_t i = 0;
+        for (auto& m : matches)
+            pt[i++] = std::make_pair(glm::vec2(m.a.x, m.a.y), glm::vec2(m.b.x, m.b.y));
+        return pt;
+    }
+    std::vector<std::pair<glm::vec2, glm::vec2>> corresponding_points(const std::vector<indexed_match>& matches, const feature_set& a, const feature_set& b)
+    {
+        return corresponding_points_impl(matches, a, b);
+    }
+    std::vector<std::pair<glm::vec2, glm::vec2>> corresponding_points(const std::vector<indexed_match>& matches, const compact_feature_set& a, const compact_feature_set& b)
+    {
+        return corresponding_points_impl(matches, a, b);
+    }
+}
\ No newline at end of file
@@ -2,8 +2,13 @@
 
 #include <vector>
 #include <array>
+#include <algorithm>
 #include <functional>
+#include <memory>
+#include <cstdint>
+#include <chrono>
 #include <glm/glm.hpp>
+#include <processing/aligned_allocator.hpp>
 
 namespace mpp {
     class image;
@@ -11,12 +16,44 @@ namespace mpp {
 
 namespace mpp::sift
 {
+    enum class detection_backend
+    {
+        opengl, // runs on the OpenGL context current on the calling thread
+        cpu // runs on all available cores, needs no OpenGL context
+    };
+
+    enum class texture_precision
+    {
+        full, // 32-bit float textures
+        half // 16-bit float difference-of-gaussian and feature textures, the blur itself stays 32-bit
+    };
+
     struct detection_settings
     {
         size_t octaves = 3;
         size_t feature_scales = 3;
         int orientation_slices = 16;
         float orientation_magnitude_threshold = 0.0002f;
+        detection_backend backend = detection_backend::opengl;
+        texture_precision precision = texture_precision::full;
+        // Keep at most this many features, 0 keeps all of them. The image is split into selection_grid^2 buckets
+        // of equal size which keep their strongest features, so the selection is spread over the whole image.
+        size_t max_features = 0;
+        int selection_grid = 8;
+        // Images larger than this (plus a halo around each tile) are detected in overlapping tiles on the OpenGL backend,
+        // so texture memory stays bounded. 0 always processes the whole image at once.
+        int tile_size = 0;
+    };
+
+    // Parts of an image to detect features in. Only the rectangles and a halo around them are processed on the OpenGL backend,
+    // so the cost scales with their area instead of the image size. Features are kept inside of the rectangles where the mask is not zero.
+    struct region_of_interest
+    {
+        std::vector<glm::ivec4> rectangles; // x, y, width, height in pixels, none covers the whole image
+        // Optional, of the same size as the image. Only its first channel is used. Without rectangles, the bounding box of its
+        // non-zero pixels is processed, and no feature candidates are searched where it is zero. Callers which know where the
+        // mask is set can pass that as rectangles, which skips searching the bounding box.
+        const image* mask = nullptr;
     };
 
     struct match_settings
@@ -24,6 +61,8 @@ namespace mpp::sift
         float relation_threshold = 0.8f;
         float similarity_threshold = 0.83f; // > 88% matches
         int max_match_count = std::numeric_limits<int>::max();
+        // Only used for binary features, which are compared by the number of differing bits instead of the similarity.
+        int max_hamming_distance = 80;
     };
 
     enum class dst_system
@@ -46,21 +85,330 @@ namespace mpp::sift
 
         struct descriptor_t
         {
+            using value_type = float;
             std::array<float, 128> histrogram{ 0 };
+
+            const value_type* data() const noexcept { return histrogram.data(); }
+            value_type* data() noexcept { return histrogram.data(); }
+        } descriptor;
+    };
+
+    // Same as feature, but with the descriptor quantized to 128 bytes. A third of the size of a feature.
+    struct compact_feature
+    {
+        float x;
+        float y;
+        float sigma;
+        float scale;
+
+        int octave;
+        float orientation; // angle in radians
+        float _pad[2];
+
+        struct descriptor_t
+        {
+            using value_type = std::uint8_t;
+            std::array<std::uint8_t, 128> histogram{ 0 };
+
+            const value_type* data() const noexcept { return histogram.data(); }
+            value_type* data() noexcept { return histogram.data(); }
+        } descriptor;
+    };
+
+    // Feature with a 256-bit binary descriptor instead of the histogram. Each bit compares two points of the gaussian level
+    // the feature was found in, rotated with its orientation. Matched by hamming distance, a quarter of the size of a compact_feature.
+    struct binary_feature
+    {
+        float x;
+        float y;
+        float sigma;
+        float scale;
+
+        int octave;
+        float orientation; // angle in radians
+        float _pad[2];
+
+        struct descriptor_t
+        {
+            using value_type = std::uint32_t;
+            std::array<std::uint32_t, 8> bits{ 0 };
+
+            const value_type* data() const noexcept { return bits.data(); }
+            value_type* data() noexcept { return bits.data(); }
         } descriptor;
     };
 
+    // Features as a structure of arrays. Positions are one contiguous array, so anything that only needs them does not
+    // stream the descriptors through the cache. The descriptors form one matrix with a 64-byte aligned row per feature.
+    template<typename Feature>
+    class basic_feature_set
+    {
+    public:
+        using value_type = Feature; // layout of a single feature, as read back from the GPU
+        using descriptor_type = typename Feature::descriptor_t::value_type;
+        static constexpr size_t descriptor_size = 128;
+        static constexpr size_t descriptor_alignment = 64;
+        static_assert(descriptor_size * sizeof(descriptor_type) % descriptor_alignment == 0, "Each descriptor row must start aligned.");
+
+        basic_feature_set() = default;
+        explicit basic_feature_set(const std::vector<Feature>& features) { assign(features.data(), features.size()); }
+
+        size_t size() const noexcept { return _positions.size(); }
+        bool empty() const noexcept { return _positions.empty(); }
+
+        void clear() noexcept
+        {
+            _positions.clear();
+            _sigmas.clear();
+            _scales.clear();
+            _octaves.clear();
+            _orientations.clear();
+            _descriptors.clear();
+        }
+        void reserve(size_t count)
+        {
+            _positions.reserve(count);
+            _sigmas.reserve(count);
+            _scales.reserve(count);
+            _octaves.reserve(count);
+            _orientations.reserve(count);
+            _descriptors.reserve(count * descriptor_size);
+        }
+        void resize(size_t count)
+        {
+            _positions.resize(count);
+            _sigmas.resize(count);
+            _scales.resize(count);
+            _octaves.resize(count);
+            _orientations.resize(count);
+            _descriptors.resize(count * descriptor_size);
+        }
+
+        void assign(const Feature* features, size_t count)
+        {
+            resize(count);
+            for (size_t i = 0; i < count; ++i)
+                set(i, features[i]);
+        }
+        void push_back(const Feature& feat)
+        {
+            resize(size() + 1);
+            set(size() - 1, feat);
+        }
+        void set(size_t index, const Feature& feat)
+        {
+            set_keypoint(index, feat);
+            std::copy_n(feat.descriptor.data(), descriptor_size, descriptor(index));
+        }
+
+        // A set can leave out its descriptors when they are kept elsewhere, see detect_resident_feature_set.
+        bool has_descriptors() const noexcept { return _descriptors.size() == size() * descriptor_size; }
+        void assign_keypoints(const Feature* features, size_t count)
+        {
+            drop_descriptors();
+            _positions.resize(count);
+            _sigmas.resize(count);
+            _scales.resize(count);
+            _octaves.resize(count);
+            _orientations.resize(count);
+            for (size_t i = 0; i < count; ++i)
+                set_keypoint(i, features[i]);
+        }
+        void drop_descriptors() noexcept
+        {
+            _descriptors.clear();
+            _descriptors.shrink_to_fit();
+        }
+        void resize_descriptors() { _descriptors.resize(size() * descriptor_size); }
+        Feature get(size_t index) const
+        {
+            Feature feat{};
+            feat.x = _positions[index].x;
+            feat.y = _positions[index].y;
+            feat.sigma = _sigmas[index];
+            feat.scale = _scales[index];
+            feat.octave = _octaves[index];
+            feat.orientation = _orientations[index];
+            std::copy_n(descriptor(index), descriptor_size, feat.descriptor.data());
+            return feat;
+        }
+        std::vector<Feature> to_vector() const
+        {
+            std::vector<Feature> features(size());
+            for (size_t i = 0; i < size(); ++i)
+                features[i] = get(i);
+            return features;
+        }
+
+        glm::vec2* positions() noexcept { return _positions.data(); }
+        const glm::vec2* positions() const noexcept { return _positions.data(); }
+        float* sigmas() noexcept { return _sigmas.data(); }
+        const float* sigmas() const noexcept { return _sigmas.data(); }
+        float* scales() noexcept { return _scales.data(); }
+        const float* scales() const noexcept { return _scales.data(); }
+        int* octaves() noexcept { return _octaves.data(); }
+        const int* octaves() const noexcept { return _octaves.data(); }
+        float* orientations() noexcept { return _orientations.data(); }
+        const float* orientations() const noexcept { return _orientations.data(); }
+        // Row-major, descriptor_size values per feature.
+        descriptor_type* descriptors() noexcept { return _descriptors.data(); }
+        const descriptor_type* descriptors() const noexcept { return _descriptors.data(); }
+        descriptor_type* descriptor(size_t index) noexcept { return _descriptors.data() + index * descriptor_size; }
+        const descriptor_type* descriptor(size_t index) const noexcept { return _descriptors.data() + index * descriptor_size; }
+
+    private:
+        void set_keypoint(size_t index, const Feature& feat)
+        {
+            _positions[index] = glm::vec2(feat.x, feat.y);
+            _sigmas[index] = feat.sigma;
+            _scales[index] = feat.scale;
+            _octaves[index] = feat.octave;
+            _orientations[index] = feat.orientation;
+        }
+
+        std::vector<glm::vec2> _positions;
+        std::vector<float> _sigmas;
+        std::vector<float> _scales;
+        std::vector<int> _octaves;
+        std::vector<float> _orientations; // angles in radians
+        std::vector<descriptor_type, aligned_allocator<descriptor_type, descriptor_alignment>> _descriptors;
+    };
+    using feature_set = basic_feature_set<feature>;
+    using compact_feature_set = basic_feature_set<compact_feature>;
+
     struct match
     {
         feature a;
         feature b;
         float similarity;
     };
+
+    struct compact_match
+    {
+        compact_feature a;
+        compact_feature b;
+        float similarity;
+    };
+
+    struct binary_match
+    {
+        binary_feature a;
+        binary_feature b;
+        int distance; // number of differing descriptor bits
+    };
+
+    // Match between two feature sets, refers to the features by their index.
+    struct indexed_match
+    {
+        std::uint32_t a;
+        std::uint32_t b;
+        float similarity;
+    };
+
+    // Descriptors are normalized, so each entry is in [0, 1] and rarely above 0.5. Scale by 512 and clamp to a byte,
+    // the same way the GPU does.
+    compact_feature quantize_descriptor(const feature& feat);
+    // Time spent in each stage of a detection on the OpenGL backend. The GPU stages are measured with timestamp queries,
+    // which are resolved together with the results instead of stalling the pipeline. Tiled detections add up all tiles.
+    struct detection_timings
+    {
+        bool valid = false; // false without timestamp queries (OpenGL ES needs GL_EXT_disjoint_timer_query), on the CPU backend, or if the detection was run again
+        std::chrono::nanoseconds upload{ 0 }; // source upload and luminance conversion
+        std::chrono::nanoseconds blur{ 0 }; // gaussian levels and their mipmaps
+        std::chrono::nanoseconds difference_of_gaussian{ 0 };
+        std::chrono::nanoseconds extrema{ 0 };
+        std::chrono::nanoseconds gradients{ 0 }; // zero for binary features
+        std::chrono::nanoseconds filter{ 0 };
+        std::chrono::nanoseconds orientation{ 0 };
+        std::chrono::nanoseconds selection{ 0 }; // zero without max_features
+        std::chrono::nanoseconds descriptor{ 0 };
+        std::chrono::nanoseconds readback{ 0 }; // CPU time of copying the results from the GPU, also measured if valid is false
+
+        std::chrono::nanoseconds gpu_total() const;
+        detection_timings& operator+=(const detection_timings& other);
+    };
+
     struct sift_cache;
-    std::shared_ptr<sift_cache> create_cache(size_t num_octaves, size_t num_feature_scales);
+    // frames_in_flight is the number of detections detect_features_async can overlap, each one with its own set of GPU resources.
+    // texture_budget limits the estimated memory (in bytes) of the textures kept for recently used image sizes.
+    std::shared_ptr<sift_cache> create_cache(size_t num_octaves, size_t num_feature_scales, size_t frames_in_flight = 1, size_t texture_budget = size_t(1) << 30);
+
+    // Handle to a detection submitted with detect_features_async. Only valid for the cache it was submitted to.
+    struct detection_ticket
+    {
+        std::uint64_t id = 0;
+    };
 
-    std::vector<feature> detect_features(const image& img, const detection_settings& settings, dst_system system = dst_system::pixel_coordinates);
-    std::vector<feature> detect_features(sift_cache& cache, const image& img, const detection_settings& settings, dst_system system = dst_system::pixel_coordinates);
+    // If timings is not null, it receives the time spent in each stage.
+    std::vector<feature> detect_features(const image& img, const detection_settings& settings, dst_system system = dst_system::pixel_coordinates,
+        detection_timings* timings = nullptr);
+    std::vector<feature> detect_features(sift_cache& cache, const image& img, const detection_settings& settings, dst_system system = dst_system::pixel_coordinates,
+        detection_timings* timings = nullptr);
+    // Only keeps the features inside of the region of interest. On the CPU backend, the whole image is detected and the features are filtered.
+    std::vector<feature> detect_features(const image& img, const region_of_interest& roi, const detection_settings& settings,
+        dst_system system = dst_system::pixel_coordinates, detection_timings* timings = nullptr);
+    std::vector<feature> detect_features(sift_cache& cache, const image& img, const region_of_interest& roi, const detection_settings& settings,
+        dst_system system = dst_system::pixel_coordinates, detection_timings* timings = nullptr);
+    // Detects the features of all images as one batch, the results are in the order of the images. Each image is submitted before the
+    // previous one is read back, so with two or more frames in the cache the GPU doesn't idle between images. timings receives the sum.
+    std::vector<std::vector<feature>> detect_features(sift_cache& cache, const std::vector<image>& images, const detection_settings& settings,
+        dst_system system = dst_system::pixel_coordinates, detection_timings* timings = nullptr);
+    // Submits all GPU work and returns without waiting for it. If all frames of the cache are in flight, the oldest one is read back first.
+    // Like the other cache functions, these must be called on the thread the OpenGL context of the cache is current on.
+    // Results of tickets which are not redeemed within 64 further detections (plus the number of frames) are dropped.
+    detection_ticket detect_features_async(sift_cache& cache, const image& img, const detection_settings& settings, dst_system system = dst_system::pixel_coordinates);
+    bool features_ready(sift_cache& cache, detection_ticket ticket);
+    std::vector<feature> wait_features(sift_cache& cache, detection_ticket ticket, detection_timings* timings = nullptr);
+    // Detect features with compact descriptors, which are already quantized on the GPU and only need a third of the readback.
+    std::vector<compact_feature> detect_compact_features(const image& img, const detection_settings& settings, dst_system system = dst_system::pixel_coordinates,
+        detection_timings* timings = nullptr);
+    std::vector<compact_feature> detect_compact_features(sift_cache& cache, const image& img, const detection_settings& settings, dst_system system = dst_system::pixel_coordinates,
+        detection_timings* timings = nullptr);
     std::vector<match> match_features(const std::vector<feature>& a, const std::vector<feature>& b, const match_settings& settings);
+    std::vector<compact_match> match_features(const std::vector<compact_feature>& a, const std::vector<compact_feature>& b, const match_settings& settings);
     std::vector<std::pair<glm::vec2, glm::vec2>> corresponding_points(const std::vector<match>& matches);
+    std::vector<std::pair<glm::vec2, glm::vec2>> corresponding_points(const std::vector<compact_match>& matches);
+    // Detect features with binary descriptors. They skip the gradient stage and are matched with popcounts instead of dot products.
+    std::vector<binary_feature> detect_binary_features(const image& img, const detection_settings& settings, dst_system system = dst_system::pixel_coordinates,
+        detection_timings* timings = nullptr);
+    std::vector<binary_feature> detect_binary_features(sift_cache& cache, const image& img, const detection_settings& settings, dst_system system = dst_system::pixel_coordinates,
+        detection_timings* timings = nullptr);
+    std::vector<binary_match> match_features(const std::vector<binary_feature>& a, const std::vector<binary_feature>& b, const match_settings& settings);
+    std::vector<std::pair<glm::vec2, glm::vec2>> corresponding_points(const std::vector<binary_match>& matches);
+
+    // Same as detect_features and detect_compact_features, but the results are read back straight into a feature set.
+    feature_set detect_feature_set(const image& img, const detection_settings& settings, dst_system system = dst_system::pixel_coordinates,
+        detection_timings* timings = nullptr);
+    feature_set detect_feature_set(sift_cache& cache, const image& img, const detection_settings& settings, dst_system system = dst_system::pixel_coordinates,
+        detection_timings* timings = nullptr);
+    compact_feature_set detect_compact_feature_set(const image& img, const detection_settings& settings, dst_system system = dst_system::pixel_coordinates,
+        detection_timings* timings = nullptr);
+    compact_feature_set detect_compact_feature_set(sift_cache& cache, const image& img, const detection_settings& settings, dst_system system = dst_system::pixel_coordinates,
+        detection_timings* timings = nullptr);
+    std::vector<indexed_match> match_features(const feature_set& a, const feature_set& b, const match_settings& settings);
+    std::vector<indexed_match> match_features(const compact_feature_set& a, const compact_feature_set& b, const match_settings& settings);
+    std::vector<std::pair<glm::vec2, glm::vec2>> corresponding_points(const std::vector<indexed_match>& matches, const feature_set& a, const feature_set& b);
+    std::vector<std::pair<glm::vec2, glm::vec2>> corresponding_points(const std::vector<indexed_match>& matches, const compact_feature_set& a, const compact_feature_set& b);
+
+    // Compact descriptors of one detection, kept in GPU memory of the cache they were detected with.
+    struct resident_descriptors
+    {
+        std::uint64_t id = 0;
+    };
+    // Same as detect_compact_feature_set, but the descriptors are kept on the GPU until release_descriptors is called.
+    // Only the positions, sigmas, scales, octaves and orientations are read back, the returned set has no descriptors.
+    // Tiled detections and the CPU backend have the descriptors on the CPU first and upload them.
+    compact_feature_set detect_resident_feature_set(sift_cache& cache, const image& img, const detection_settings& settings, resident_descriptors& descriptors,
+        dst_system system = dst_system::pixel_coordinates, detection_timings* timings = nullptr);
+    // Batch version of detect_resident_feature_set, see the batch version of detect_features. descriptors receives one handle per image.
+    std::vector<compact_feature_set> detect_resident_feature_sets(sift_cache& cache, const std::vector<image>& images, const detection_settings& settings,
+        std::vector<resident_descriptors>& descriptors, dst_system system = dst_system::pixel_coordinates, detection_timings* timings = nullptr);
+    void release_descriptors(sift_cache& cache, resident_descriptors descriptors);
+    // Uploads the descriptors of a set, e.g. one loaded from a feature_cache, to match it with resident descriptors.
+    resident_descriptors upload_descriptors(sift_cache& cache, const compact_feature_set& features);
+    // Reads resident descriptors back into the set they were detected with, e.g. to store it in a feature_cache.
+    void download_descriptors(sift_cache& cache, resident_descriptors descriptors, compact_feature_set& features);
+    // Matches resident descriptors on the GPU, like match_features does for compact feature sets. Only the matches are read back,
+    // their indices refer to the feature sets returned together with the descriptors.
+    std::vector<indexed_match> match_features(sift_cache& cache, resident_descriptors a, resident_descriptors b, const match_settings& settings);
 }
\ No newline at end of file